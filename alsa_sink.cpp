@@ -0,0 +1,302 @@
+#include "alsa_sink.h"
+
+#ifdef LARK_HAVE_ALSA
+
+#include "music_backend.h"
+#include "perf_stats.h"
+#include <string.h>
+
+// Periods in the device buffer: enough to ride out a slow decoder wakeup,
+// few enough that a seek drops little
+static const unsigned ALSA_PERIODS = 4;
+
+AlsaSink::AlsaSink(const std::string& device)
+    : device(device.empty() ? "default" : device), decoder(NULL), pcm(NULL), use_mmap(true),
+      can_pause(false), rate(0), frame_bytes(4), period_frames(0), buffer_frames(0), start_threshold(0),
+      generation(0), thread(0), thread_started(false), stopping(false), paused(false),
+      drop_pending(false), resume_position(-1) {
+}
+
+AlsaSink::~AlsaSink() {
+    close();
+}
+
+bool AlsaSink::set_hw_params(unsigned channels) {
+    snd_pcm_hw_params_t* hw;
+    snd_pcm_hw_params_alloca(&hw);
+    int err = snd_pcm_hw_params_any(pcm, hw);
+    if (err < 0) return false;
+
+    // Let plug devices convert the rate; hw: devices must support it
+    snd_pcm_hw_params_set_rate_resample(pcm, hw, 1);
+    use_mmap = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+    if (!use_mmap && snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
+        return false;
+    }
+    if ((err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16_LE)) < 0
+        || (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0
+        || (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0) {
+        g_printerr("Backend: ALSA cannot play %u Hz, %u channel(s): %s (try LARK_OUTPUT_RATE)\n",
+                   rate, channels, snd_strerror(err));
+        return false;
+    }
+
+    snd_pcm_uframes_t period = period_frames;
+    snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL);
+    snd_pcm_uframes_t buffer = period * ALSA_PERIODS;
+    snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer);
+    if ((err = snd_pcm_hw_params(pcm, hw)) < 0) {
+        g_printerr("Backend: ALSA hw params: %s\n", snd_strerror(err));
+        return false;
+    }
+    snd_pcm_hw_params_get_period_size(hw, &period_frames, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer_frames);
+    can_pause = snd_pcm_hw_params_can_pause(hw);
+    return true;
+}
+
+bool AlsaSink::open(Decoder* dec, size_t chunk_bytes, guint gen) {
+    close();
+    decoder = dec;
+    generation = gen;
+    stopping = false;
+    paused = false;
+    drop_pending = false;
+    resume_position = -1;
+
+    Decoder::Format format = decoder->get_format();
+    rate = format.rate;
+    frame_bytes = format.channels * 2;
+    period_frames = chunk_bytes / frame_bytes;
+
+    int err = snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+        g_printerr("Backend: Cannot open ALSA device %s: %s\n", device.c_str(), snd_strerror(err));
+        pcm = NULL;
+        return false;
+    }
+    if (!set_hw_params(format.channels)) {
+        snd_pcm_close(pcm);
+        pcm = NULL;
+        return false;
+    }
+
+    // Start once the buffer is full; wake when a whole period is free
+    snd_pcm_sw_params_t* sw;
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(pcm, sw);
+    start_threshold = buffer_frames - buffer_frames % period_frames;
+    snd_pcm_sw_params_set_start_threshold(pcm, sw, start_threshold);
+    snd_pcm_sw_params_set_avail_min(pcm, sw, period_frames);
+    snd_pcm_sw_params(pcm, sw);
+    snd_pcm_prepare(pcm);
+
+    g_print("Backend: ALSA %s, %s, period %lu frames, buffer %lu frames\n", device.c_str(),
+            use_mmap ? "mmap" : "writei", (unsigned long)period_frames, (unsigned long)buffer_frames);
+    return true;
+}
+
+void AlsaSink::start() {
+    if (thread_started || !pcm) return;
+    if (pthread_create(&thread, NULL, thread_func, this) != 0) {
+        perror("Backend: Failed to create ALSA thread");
+        emit(SINK_ERROR, generation);
+        return;
+    }
+    thread_started = true;
+}
+
+void AlsaSink::set_paused(bool value) {
+    gint64 resume = -1;
+    {
+        std::lock_guard<std::mutex> lock(pause_mutex);
+        paused = value;
+        if (!value) resume = resume_position.exchange(-1);
+    }
+    pause_cond.notify_all();
+    // The pause dropped what the device held unheard: play it again
+    if (resume >= 0) seek(resume);
+}
+
+bool AlsaSink::seek(gint64 position) {
+    // A seek made while paused replaces the position to resume from
+    resume_position = -1;
+    if (!decoder || !decoder->seek(position)) return false;
+    // The play thread drops the device buffer itself: a pcm handle is not
+    // safe to use from two threads
+    drop_pending = true;
+    return true;
+}
+
+void AlsaSink::close() {
+    if (thread_started) {
+        {
+            std::lock_guard<std::mutex> lock(pause_mutex);
+            stopping = true;
+        }
+        pause_cond.notify_all();
+        pthread_join(thread, NULL);
+        thread_started = false;
+    }
+    if (pcm) {
+        snd_pcm_drop(pcm);
+        snd_pcm_close(pcm);
+        pcm = NULL;
+    }
+}
+
+// Underruns and suspends are recoverable; anything else ends playback
+bool AlsaSink::recover(int err) {
+    if (err == -EPIPE) {
+        PerfSlot* stats = perf_stats_slot("sink");
+        if (stats) stats->count(PERF_UNDERRUNS);
+    }
+    if (snd_pcm_recover(pcm, err, 1) < 0) {
+        g_printerr("Backend: ALSA error: %s\n", snd_strerror(err));
+        return false;
+    }
+    return true;
+}
+
+bool AlsaSink::write_frames(const uint8_t* data, snd_pcm_uframes_t frames) {
+    while (frames > 0 && !stopping && !drop_pending) {
+        if (!use_mmap) {
+            snd_pcm_sframes_t n = snd_pcm_writei(pcm, data, frames);
+            if (n < 0) {
+                if (!recover((int)n)) return false;
+                continue;
+            }
+            data += n * frame_bytes;
+            frames -= n;
+            continue;
+        }
+
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (!recover((int)avail)) return false;
+            continue;
+        }
+        if (avail == 0) {
+            // Buffer full: sleep until a period has played
+            start_if_filled(false);
+            int err = snd_pcm_wait(pcm, 100);
+            if (err < 0 && !recover(err)) return false;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t n = frames;
+        int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &n);
+        if (err < 0) {
+            if (!recover(err)) return false;
+            continue;
+        }
+        // Interleaved: every channel's area points into the same buffer
+        uint8_t* dst = static_cast<uint8_t*>(areas[0].addr) + areas[0].first / 8 + offset * areas[0].step / 8;
+        memcpy(dst, data, n * frame_bytes);
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, n);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != n) {
+            if (!recover(committed < 0 ? (int)committed : -EPIPE)) return false;
+            continue;
+        }
+        data += n * frame_bytes;
+        frames -= n;
+        start_if_filled(false);
+    }
+    return true;
+}
+
+// writei() starts a prepared stream at the start threshold by itself, but
+// mmap commits never do, after open() or after any drop, prepare or
+// recover. `tail`: the last audio is queued, start however little it is.
+void AlsaSink::start_if_filled(bool tail) {
+    if (snd_pcm_state(pcm) != SND_PCM_STATE_PREPARED) return;
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+    if (avail < 0 || (snd_pcm_uframes_t)avail >= buffer_frames) return;
+    snd_pcm_uframes_t queued = buffer_frames - (snd_pcm_uframes_t)avail;
+    if (queued >= start_threshold || tail) {
+        int err = snd_pcm_start(pcm);
+        if (err < 0) g_printerr("Backend: ALSA start: %s\n", snd_strerror(err));
+    }
+}
+
+// What the device still holds is heard after everything released from the ring
+void AlsaSink::report_delay() {
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(pcm, &delay) == 0 && delay > 0) {
+        decoder->get_clock().set_latency((gint64)delay * 1000000000LL / rate);
+    }
+}
+
+void* AlsaSink::thread_func(void* arg) {
+    static_cast<AlsaSink*>(arg)->play_loop();
+    return NULL;
+}
+
+void AlsaSink::play_loop() {
+    PcmRing& ring = decoder->get_ring();
+    PerfSlot* stats = perf_stats_slot("sink");
+    size_t period_bytes = period_frames * frame_bytes;
+    bool device_paused = false;
+
+    while (!stopping) {
+        if (drop_pending.exchange(false)) {
+            snd_pcm_drop(pcm);
+            snd_pcm_prepare(pcm);
+            device_paused = false;
+        }
+
+        if (paused) {
+            // Under the lock, so set_paused(false) sees the resume position
+            // of any drop made here
+            std::unique_lock<std::mutex> lock(pause_mutex);
+            if (paused && !device_paused) {
+                // Without hardware pause, stop the device and refill on
+                // resume from where the listener was
+                if (!can_pause || snd_pcm_pause(pcm, 1) < 0) {
+                    resume_position = decoder->get_clock().position(ring.released());
+                    snd_pcm_drop(pcm);
+                    snd_pcm_prepare(pcm);
+                }
+                device_paused = true;
+            }
+            pause_cond.wait(lock, [this] { return stopping || !paused; });
+            continue;
+        }
+        if (device_paused) {
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PAUSED) snd_pcm_pause(pcm, 0);
+            device_paused = false;
+        }
+
+        uint64_t asked_at = stats ? perf_now_ns() : 0;
+        const uint8_t* data;
+        uint64_t end_pos;
+        size_t len = ring.acquire(&data, period_bytes, 100, &end_pos);
+        if (len == 0) {
+            if (ring.at_end()) {
+                // Let the device play out what it holds, then report the end
+                start_if_filled(true);
+                snd_pcm_drain(pcm);
+                emit(SINK_EOS, generation);
+                return;
+            }
+            continue;
+        }
+        if (stats) {
+            stats->time(PERF_SINK_WAIT, perf_now_ns() - asked_at);
+            stats->count(PERF_BUFFERS);
+            stats->fill_level(ring.fill(), ring.capacity());
+        }
+
+        bool ok = write_frames(data, len / frame_bytes);
+        ring.release(end_pos);
+        if (!ok) {
+            emit(SINK_ERROR, generation);
+            return;
+        }
+        report_delay();
+    }
+}
+
+#endif // LARK_HAVE_ALSA
@@ -0,0 +1,67 @@
+#ifndef ALSA_SINK_H
+#define ALSA_SINK_H
+
+#include "audio_sink.h"
+
+#ifdef LARK_HAVE_ALSA
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+// Direct ALSA output, without GStreamer's threads and copies. One thread
+// moves a period at a time from the ring into the device: straight into the
+// mmap'ed DMA buffer where the device allows it, with writei() otherwise.
+// The ring region is released as soon as it is copied, and the device delay
+// is handed to the playback clock after every period.
+class AlsaSink : public AudioSink {
+public:
+    explicit AlsaSink(const std::string& device);
+    ~AlsaSink();
+
+    const char* name() const { return "alsa"; }
+    bool open(Decoder* decoder, size_t chunk_bytes, guint generation);
+    void start();
+    void set_paused(bool paused);
+    bool seek(gint64 position);
+    void close();
+
+private:
+    std::string device;
+    Decoder* decoder;
+    snd_pcm_t* pcm;
+    bool use_mmap;
+    bool can_pause;
+    unsigned rate;
+    size_t frame_bytes;
+    snd_pcm_uframes_t period_frames;
+    snd_pcm_uframes_t buffer_frames;
+    snd_pcm_uframes_t start_threshold;
+    guint generation;
+
+    pthread_t thread;
+    bool thread_started;
+    std::atomic<bool> stopping;
+    std::atomic<bool> paused;
+    std::atomic<bool> drop_pending; // a seek: discard what the device holds
+    // Without hardware pause the device buffer is dropped on pause; this is
+    // where playback was heard then, to seek back to on resume (-1 if none)
+    std::atomic<gint64> resume_position;
+    std::mutex pause_mutex;
+    std::condition_variable pause_cond;
+
+    bool set_hw_params(unsigned channels);
+    bool write_frames(const uint8_t* data, snd_pcm_uframes_t frames);
+    bool recover(int err);
+    void start_if_filled(bool tail);
+    void report_delay();
+    static void* thread_func(void* arg);
+    void play_loop();
+};
+
+#endif // LARK_HAVE_ALSA
+
+#endif // ALSA_SINK_H
@@ -0,0 +1,30 @@
+#include "audio_sink.h"
+#include "gst_sink.h"
+#include "alsa_sink.h"
+#include "file_sink.h"
+
+AudioSink* audio_sink_create(const std::string& spec) {
+    std::string kind = spec.substr(0, spec.find(':'));
+    std::string arg = kind.size() < spec.size() ? spec.substr(kind.size() + 1) : std::string();
+
+    if (kind.empty() || kind == "gst") {
+        return new GstSink();
+    }
+    if (kind == "alsa") {
+#ifdef LARK_HAVE_ALSA
+        return new AlsaSink(arg);
+#else
+        g_printerr("Backend: Built without ALSA support\n");
+        return NULL;
+#endif
+    }
+    // Paced like a device; "null:fast" and "wav-fast:PATH" drain at decode speed
+    if (kind == "null") {
+        return new FileSink(std::string(), arg != "fast");
+    }
+    if ((kind == "wav" || kind == "wav-fast") && !arg.empty()) {
+        return new FileSink(arg, kind == "wav");
+    }
+    g_printerr("Backend: Unknown audio sink '%s'\n", spec.c_str());
+    return NULL;
+}
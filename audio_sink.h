@@ -0,0 +1,59 @@
+#ifndef AUDIO_SINK_H
+#define AUDIO_SINK_H
+
+#include <glib.h>
+#include <stddef.h>
+#include <string>
+
+class Decoder;
+struct PerfSlot;
+
+// Where decoded PCM goes. MusicBackend creates one per play_file() and
+// drives it from its command thread; the sink pulls audio from the
+// decoder's ring on a thread of its own. End of stream, errors and latency
+// changes come back through the event callback, which may run on any thread
+// and carries the generation the sink was opened with, so events from a
+// sink that has since been replaced can be told apart.
+class AudioSink {
+public:
+    enum Event { SINK_EOS, SINK_ERROR, SINK_LATENCY };
+    typedef void (*EventCallback)(void* user_data, Event event, guint generation);
+
+    virtual ~AudioSink() {}
+    virtual const char* name() const = 0;
+
+    void set_event_callback(EventCallback callback, void* user_data) {
+        event_callback = callback;
+        event_user_data = user_data;
+    }
+
+    // Prepare to play the ring of an opened decoder in its format, taking at
+    // most `chunk_bytes` from the ring at a time. Nothing is consumed yet.
+    virtual bool open(Decoder* decoder, size_t chunk_bytes, guint generation) = 0;
+    // Start consuming; call once the decoder runs
+    virtual void start() = 0;
+    virtual void set_paused(bool paused) = 0;
+    // Drop the audio queued in the device and have the decoder continue from
+    // `position` (nanoseconds). False if that cannot be done in place.
+    virtual bool seek(gint64 position) = 0;
+    // Pass the device latency to the decoder's clock after SINK_LATENCY
+    virtual void update_latency() {}
+    // Stop consuming and release the device. Shut the ring down first, so a
+    // consumer waiting for audio wakes up.
+    virtual void close() = 0;
+
+protected:
+    AudioSink() : event_callback(NULL), event_user_data(NULL) {}
+    void emit(Event event, guint generation) {
+        if (event_callback) event_callback(event_user_data, event, generation);
+    }
+
+    EventCallback event_callback;
+    void* event_user_data;
+};
+
+// Sink for `spec`: "gst" (the default), "alsa" or "alsa:DEVICE", "wav:PATH"
+// or "null". NULL if the spec is unknown or the sink was not compiled in.
+AudioSink* audio_sink_create(const std::string& spec);
+
+#endif // AUDIO_SINK_H
@@ -0,0 +1,95 @@
+#include "chapter_timeline.h"
+#include <stdio.h>
+#include <algorithm>
+
+ChapterTimeline::ChapterTimeline() : duration(0), generation_stamp(0) {
+}
+
+void ChapterTimeline::assign(const std::vector<Mp4Demuxer::Chapter>& source, int64_t book_duration,
+                             const std::string& book_path) {
+    clear();
+    chapters.reserve(source.size());
+    for (size_t i = 0; i < source.size(); ++i) {
+        Chapter ch;
+        ch.start = (int64_t)source[i].timestamp * 100;
+        ch.title = source[i].title;
+        ch.title_offset = source[i].title_offset;
+        ch.title_size = source[i].title_size;
+        chapters.push_back(ch);
+    }
+    // chpl is written in order almost always; a stable sort keeps the file's
+    // order between chapters that share a start
+    std::stable_sort(chapters.begin(), chapters.end(), [](const Chapter& a, const Chapter& b) {
+        return a.start < b.start;
+    });
+    duration = book_duration > 0 ? book_duration : 0;
+    filepath = book_path;
+}
+
+void ChapterTimeline::clear() {
+    chapters.clear();
+    duration = 0;
+    filepath.clear();
+    file.close();
+    loaded_titles.clear();
+    generation_stamp++;
+}
+
+int64_t ChapterTimeline::end(size_t index) const {
+    if (index + 1 < chapters.size()) return chapters[index + 1].start;
+    return std::max(duration, chapters[index].start);
+}
+
+std::string ChapterTimeline::title(size_t index) const {
+    const Chapter& ch = chapters[index];
+    if (!ch.title.empty()) return ch.title.str();
+
+    char fallback[32];
+    snprintf(fallback, sizeof(fallback), "Chapter %u", (unsigned)(index + 1));
+    if (ch.title_size == 0) return fallback;
+
+    std::unordered_map<size_t, std::string>::const_iterator it = loaded_titles.find(index);
+    if (it != loaded_titles.end()) return it->second;
+
+    // Read once, failures included, so a missing book is not retried on
+    // every clock tick
+    Mp4Demuxer::Chapter sample;
+    sample.title_offset = ch.title_offset;
+    sample.title_size = ch.title_size;
+    std::string text;
+    if (!(file.is_open() || file.open(filepath.c_str())) || !mp4_read_chapter_title(file, sample, &text)
+        || text.empty()) {
+        text = fallback;
+    }
+    loaded_titles[index] = text;
+    return text;
+}
+
+int ChapterTimeline::find(int64_t position) const {
+    // The last chapter starting at or before `position`; of several sharing
+    // a start, the last one, since the others are empty
+    std::vector<Chapter>::const_iterator it =
+        std::upper_bound(chapters.begin(), chapters.end(), position,
+                         [](int64_t pos, const Chapter& ch) { return pos < ch.start; });
+    return (int)(it - chapters.begin()) - 1;
+}
+
+int64_t ChapterTimeline::offset(int64_t position) const {
+    int index = find(position);
+    return index < 0 ? position : position - chapters[index].start;
+}
+
+int ChapterTimeline::next(int64_t position) const {
+    int index = find(position) + 1;
+    return index < (int)chapters.size() ? index : -1;
+}
+
+int ChapterTimeline::previous(int64_t position) const {
+    int index = find(position);
+    if (index < 0) return -1;
+    if (position - chapters[index].start > PREVIOUS_GRACE_NS) return index;
+    // Skip the empty chapters that share this one's start
+    int previous = index - 1;
+    while (previous >= 0 && chapters[previous].start == chapters[index].start) previous--;
+    return previous >= 0 ? previous : index;
+}
@@ -0,0 +1,85 @@
+#ifndef CHAPTER_TIMELINE_H
+#define CHAPTER_TIMELINE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "mp4_demuxer.h"
+
+// The chapters of the open book on its timeline, in nanoseconds. chpl stores
+// starts in 100 ns units; converting to ns keeps every one of them exact, so
+// chapters that begin within the same second stay apart. Starts are sorted
+// once in assign(); every lookup after that is a binary search, cheap enough
+// for each clock tick of a book with thousands of chapters.
+//
+// A chapter runs from its start to the next chapter's start; the last one
+// runs to the end of the book. Audio before the first start belongs to no
+// chapter. Not thread-safe: owned and read by the main loop.
+//
+// Titles of text-track chapters are not in memory: title() reads the one
+// asked for from the book (one small pread) and keeps it, so only chapters
+// that are actually shown are ever decoded.
+class ChapterTimeline {
+public:
+    // Previous chapter within this far into a chapter; past it, previous()
+    // goes back to the start of the current one, like a CD player
+    static const int64_t PREVIOUS_GRACE_NS = 3 * 1000000000LL;
+
+    struct Chapter {
+        int64_t start;         // ns
+        Mp4View title;         // may be empty
+        uint64_t title_offset; // text-track title sample, if title_size > 0
+        uint32_t title_size;
+    };
+
+    ChapterTimeline();
+
+    // Replace the chapters with `chapters` (as read by Mp4Demuxer) of the
+    // book at `filepath`, which is `duration` ns long (0 if not known)
+    void assign(const std::vector<Mp4Demuxer::Chapter>& chapters, int64_t duration,
+                const std::string& filepath);
+    void clear();
+
+    size_t size() const { return chapters.size(); }
+    bool empty() const { return chapters.empty(); }
+    const Chapter& operator[](size_t index) const { return chapters[index]; }
+
+    int64_t start(size_t index) const { return chapters[index].start; }
+    // Start of the next chapter, or the end of the book for the last one
+    // (its start if the duration is not known)
+    int64_t end(size_t index) const;
+    int64_t length(size_t index) const { return end(index) - start(index); }
+    // The chapter's title, or "Chapter N" if it has none or it cannot be read
+    std::string title(size_t index) const;
+
+    // Chapter playing at `position` (ns); -1 before the first one or if
+    // there are none
+    int find(int64_t position) const;
+    // Time since the start of the chapter at `position`, or `position`
+    // itself outside any chapter
+    int64_t offset(int64_t position) const;
+    // Chapter to jump to from `position`: -1 if there is none
+    int next(int64_t position) const;
+    int previous(int64_t position) const;
+
+    // Changes on every assign() or clear(); views over the chapters (the
+    // chapter dialog's model) use it to tell whether they are still current
+    unsigned generation() const { return generation_stamp; }
+
+private:
+    std::vector<Chapter> chapters;
+    int64_t duration;
+    unsigned generation_stamp;
+
+    // Lazily read text-track titles, and the book they are read from
+    std::string filepath;
+    mutable Mp4File file;
+    mutable std::unordered_map<size_t, std::string> loaded_titles;
+
+    ChapterTimeline(const ChapterTimeline&);
+    ChapterTimeline& operator=(const ChapterTimeline&);
+};
+
+#endif // CHAPTER_TIMELINE_H
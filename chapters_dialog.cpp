@@ -1,8 +1,27 @@
 #include "chapters_dialog.h"
-#include <vector>
-#include <sstream>
+#include "tree_columns.h"
+#include <stdio.h>
 
-static std::string seconds_to_hhmmss(gint64 secs) {
+// The list only holds chapter numbers; titles and times are read from the
+// backend's ChapterTimeline as rows are drawn. It is built once per book and
+// kept between dialog opens, until the timeline changes.
+static GtkListStore *cached_store = NULL;
+static unsigned cached_generation = 0;
+
+static GtkListStore *chapter_store(const ChapterTimeline &chapters) {
+    if (cached_store && cached_generation == chapters.generation()) return cached_store;
+    if (cached_store) g_object_unref(cached_store);
+
+    cached_store = gtk_list_store_new(1, G_TYPE_INT); // index into the timeline
+    for (size_t i = 0; i < chapters.size(); ++i) {
+        gtk_list_store_insert_with_values(cached_store, NULL, -1, 0, (int)i, -1);
+    }
+    cached_generation = chapters.generation();
+    return cached_store;
+}
+
+static std::string ns_to_hhmmss(gint64 ns) {
+    gint64 secs = ns / GST_SECOND;
     int h = (int)(secs / 3600);
     int m = (int)((secs % 3600) / 60);
     int s = (int)(secs % 60);
@@ -14,70 +33,77 @@ static std::string seconds_to_hhmmss(gint64 secs) {
     return std::string(buf);
 }
 
-void show_chapters_dialog(GtkWindow *parent, MusicBackend *backend, const std::string &current_file) {
-    if (!backend) return;
+static void title_cell(GtkTreeViewColumn *, GtkCellRenderer *renderer, GtkTreeModel *model,
+                       GtkTreeIter *iter, gpointer user_data) {
+    const ChapterTimeline *chapters = static_cast<const ChapterTimeline *>(user_data);
+    int index;
+    gtk_tree_model_get(model, iter, 0, &index, -1);
+    std::string title = chapters->title(index);
+    g_object_set(renderer, "text", title.c_str(), NULL);
+}
+
+static void time_cell(GtkTreeViewColumn *, GtkCellRenderer *renderer, GtkTreeModel *model,
+                      GtkTreeIter *iter, gpointer user_data) {
+    const ChapterTimeline *chapters = static_cast<const ChapterTimeline *>(user_data);
+    int index;
+    gtk_tree_model_get(model, iter, 0, &index, -1);
+    std::string t = ns_to_hhmmss(chapters->start(index));
+    g_object_set(renderer, "text", t.c_str(), NULL);
+}
+
+static void add_column(GtkWidget *tree, const char *title, GtkTreeCellDataFunc func,
+                       const ChapterTimeline *chapters, int width) {
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    GtkTreeViewColumn *col = append_fixed_column(tree, title, width, renderer);
+    gtk_tree_view_column_set_cell_data_func(col, renderer, func, (gpointer)chapters, NULL);
+}
+
+void show_chapters_dialog(GtkWindow *parent, MusicBackend *backend) {
+    if (!backend || backend->chapters.empty()) return;
+    const ChapterTimeline &chapters = backend->chapters;
 
     GtkWidget *dialog = gtk_dialog_new_with_buttons("Chapters",
                                                     parent,
-                                                    GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                    (GtkDialogFlags)(GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT),
                                                     GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
                                                     GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT,
                                                     NULL);
 
     GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
     GtkWidget *tree = gtk_tree_view_new();
-    GtkListStore *store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_INT); // Title, Seconds
-
-    for (size_t i = 0; i < backend->chapters.size(); ++i) {
-        GtkTreeIter iter;
-        gtk_list_store_append(store, &iter);
-        const auto &ch = backend->chapters[i];
-        std::string title = ch.title.empty() ? ("Chapter " + std::to_string(i+1)) : ch.title;
-        gtk_list_store_set(store, &iter, 0, title.c_str(), 1, (int)ch.timestamp, -1);
-    }
-
-    gtk_tree_view_set_model(GTK_TREE_VIEW(tree), GTK_TREE_MODEL(store));
-    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
-    GtkTreeViewColumn *col1 = gtk_tree_view_column_new_with_attributes("Title", renderer, "text", 0, NULL);
-    gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col1);
-
-    GtkCellRenderer *renderer2 = gtk_cell_renderer_text_new();
-    GtkTreeViewColumn *col2 = gtk_tree_view_column_new_with_attributes("Time", renderer2, "text", 1, NULL);
-    gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col2);
-
-    gtk_tree_view_column_set_cell_data_func(col2, renderer2,
-        +[](GtkTreeViewColumn *col, GtkCellRenderer *renderer, GtkTreeModel *model, GtkTreeIter *iter, gpointer user_data) {
-            int seconds;
-            gtk_tree_model_get(model, iter, 1, &seconds, -1);
-            std::string t = seconds_to_hhmmss(seconds);
-            g_object_set(renderer, "text", t.c_str(), NULL);
-        }, NULL, NULL);
+    add_column(tree, "Title", title_cell, &chapters, 420);
+    add_column(tree, "Time", time_cell, &chapters, 100);
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(tree), TRUE);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(tree), GTK_TREE_MODEL(chapter_store(chapters)));
 
-    gtk_container_add(GTK_CONTAINER(content), tree);
-    gtk_widget_set_size_request(tree, 520, 300);
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(scroll, 540, 600);
+    gtk_container_add(GTK_CONTAINER(scroll), tree);
+    gtk_container_add(GTK_CONTAINER(content), scroll);
     gtk_widget_show_all(content);
 
+    // Start at the chapter being heard
+    int current = chapters.find(backend->get_position());
+    if (current >= 0) {
+        GtkTreePath *path = gtk_tree_path_new_from_indices(current, -1);
+        gtk_tree_selection_select_path(gtk_tree_view_get_selection(GTK_TREE_VIEW(tree)), path);
+        gtk_tree_view_scroll_to_cell(GTK_TREE_VIEW(tree), path, NULL, TRUE, 0.5, 0);
+        gtk_tree_path_free(path);
+    }
+
     int resp = gtk_dialog_run(GTK_DIALOG(dialog));
     if (resp == GTK_RESPONSE_ACCEPT) {
         GtkTreeSelection *sel = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree));
         GtkTreeIter sel_iter;
         GtkTreeModel *model;
         if (gtk_tree_selection_get_selected(sel, &model, &sel_iter)) {
-            int seconds;
-            gtk_tree_model_get(model, &sel_iter, 1, &seconds, -1);
-            for (size_t i = 0; i < backend->chapters.size(); ++i) {
-                if ((int)backend->chapters[i].timestamp == seconds) {
-                    if (!current_file.empty()) {
-                        backend->play_file(current_file.c_str(), seconds);
-                    } else {
-                        backend->play_chapter(i);
-                    }
-                    break;
-                }
-            }
+            int index;
+            gtk_tree_model_get(model, &sel_iter, 0, &index, -1);
+            backend->play_chapter(index);
         }
     }
 
+    // The store stays cached for the next open
     gtk_widget_destroy(dialog);
-    g_object_unref(store);
 }
@@ -3,8 +3,9 @@
 
 #include <gtk/gtk.h>
 #include "music_backend.h"
-#include <string>
 
-void show_chapters_dialog(GtkWindow *parent, MusicBackend *backend, const std::string &current_file);
+// Chapters of the book `backend` last read, with the one playing selected;
+// plays the chapter picked from its start.
+void show_chapters_dialog(GtkWindow *parent, MusicBackend *backend);
 
 #endif // CHAPTERS_DIALOG_H
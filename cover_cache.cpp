@@ -0,0 +1,304 @@
+#include "cover_cache.h"
+#include "lark_paths.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+static const char COVER_MAGIC[4] = { 'L', 'K', 'C', 'V' };
+static const uint32_t COVER_VERSION = 1;
+
+struct CoverCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t width;
+    uint32_t height;
+    uint32_t path_len;
+    uint32_t reserved;
+};
+
+// 4x4 Bayer matrix; as thresholds t = 16 * m + 8, spread over 0..255
+static const uint8_t BAYER4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+};
+
+void cover_dither_row(const uint8_t* pixels, int channels, uint8_t* gray, int width, int y) {
+    uint8_t thresholds[8];
+    for (int i = 0; i < 8; ++i) {
+        thresholds[i] = (uint8_t)(BAYER4[y & 3][i & 3] * 16 + 8);
+    }
+
+    int x = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    // Eight pixels per step: BT.601 luma in 8.8 fixed point, then the same
+    // level as the scalar loop below and back to 0..255 as level * 17
+    uint8x8_t t = vld1_u8(thresholds);
+    uint8x8_t kr = vdup_n_u8(77), kg = vdup_n_u8(150), kb = vdup_n_u8(29);
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t r, g, b;
+        if (channels == 4) {
+            uint8x8x4_t px = vld4_u8(pixels + x * 4);
+            r = px.val[0]; g = px.val[1]; b = px.val[2];
+        } else {
+            uint8x8x3_t px = vld3_u8(pixels + x * 3);
+            r = px.val[0]; g = px.val[1]; b = px.val[2];
+        }
+        uint16x8_t luma = vmull_u8(r, kr);
+        luma = vmlal_u8(luma, g, kg);
+        luma = vmlal_u8(luma, b, kb);
+        uint16x8_t scaled = vmull_u8(vshrn_n_u16(luma, 8), vdup_n_u8(15));
+        scaled = vsraq_n_u16(scaled, scaled, 8);
+        uint8x8_t level = vshrn_n_u16(vaddw_u8(scaled, t), 8);
+        vst1_u8(gray + x, vmul_u8(level, vdup_n_u8(17)));
+    }
+#endif
+    // Scalar tail (and the whole row elsewhere; plain enough to auto-vectorize)
+    for (; x < width; ++x) {
+        const uint8_t* p = pixels + x * channels;
+        unsigned luma = (77u * p[0] + 150u * p[1] + 29u * p[2]) >> 8;
+        // luma * 15 * 257 / 256 spans 0..3839, so white reaches 15 even at
+        // the lowest threshold and black stays 0 at the highest
+        unsigned scaled = luma * 15u;
+        unsigned level = (scaled + (scaled >> 8) + thresholds[x & 7]) >> 8;
+        gray[x] = (uint8_t)(level * 17u);
+    }
+}
+
+// --- Thumbnail cache ---
+
+static std::string cover_path_for(const std::string& book_path) {
+    std::string dir = lark_cache_dir(".lark_covers");
+    if (dir.empty()) return std::string();
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.gray", lark_hash64(book_path));
+    return dir + name;
+}
+
+static GdkPixbuf* pixbuf_from_gray(const uint8_t* gray, int width, int height) {
+    GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    if (!pixbuf) return NULL;
+
+    guchar* rows = gdk_pixbuf_get_pixels(pixbuf);
+    int stride = gdk_pixbuf_get_rowstride(pixbuf);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* in = gray + (size_t)y * width;
+        guchar* out = rows + (size_t)y * stride;
+        for (int x = 0; x < width; ++x) {
+            out[0] = out[1] = out[2] = in[x];
+            out += 3;
+        }
+    }
+    return pixbuf;
+}
+
+static bool load_thumbnail(const std::string& cache_path, const std::string& book_path,
+                           const struct stat& st, int width, int height, std::vector<uint8_t>* gray) {
+    FILE* in = fopen(cache_path.c_str(), "rb");
+    if (!in) return false;
+
+    CoverCacheHeader header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1
+           && memcmp(header.magic, COVER_MAGIC, 4) == 0
+           && header.version == COVER_VERSION
+           && header.file_size == (uint64_t)st.st_size
+           && header.file_mtime == (int64_t)st.st_mtime
+           && header.width == (uint32_t)width
+           && header.height == (uint32_t)height
+           && header.path_len == book_path.size();
+    if (ok) {
+        std::string stored(header.path_len, '\0');
+        ok = fread(&stored[0], 1, header.path_len, in) == header.path_len && stored == book_path;
+    }
+    if (ok) {
+        gray->resize((size_t)width * height);
+        ok = fread(&(*gray)[0], 1, gray->size(), in) == gray->size();
+    }
+    fclose(in);
+    return ok;
+}
+
+static void save_thumbnail(const std::string& cache_path, const std::string& book_path,
+                           const struct stat& st, int width, int height, const std::vector<uint8_t>& gray) {
+    std::string tmp_path = cache_path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (!out) return;
+
+    CoverCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COVER_MAGIC, 4);
+    header.version = COVER_VERSION;
+    header.file_size = (uint64_t)st.st_size;
+    header.file_mtime = (int64_t)st.st_mtime;
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.path_len = (uint32_t)book_path.size();
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+           && fwrite(book_path.data(), 1, book_path.size(), out) == book_path.size()
+           && fwrite(&gray[0], 1, gray.size(), out) == gray.size();
+    ok = (fclose(out) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
+
+// --- Decoding ---
+
+struct TargetSize {
+    int width;
+    int height;
+};
+
+// Ask the loader to scale while decoding (libjpeg decodes at 1/2, 1/4 or 1/8
+// scale directly), instead of decoding the full image and scaling afterwards
+static void on_size_prepared(GdkPixbufLoader* loader, int, int, gpointer data) {
+    const TargetSize* size = static_cast<const TargetSize*>(data);
+    gdk_pixbuf_loader_set_size(loader, size->width, size->height);
+}
+
+static bool decode_dithered(const Mp4View& image, int width, int height, std::vector<uint8_t>* gray) {
+    if (image.empty()) return false;
+
+    TargetSize size = { width, height };
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(on_size_prepared), &size);
+    gboolean written = gdk_pixbuf_loader_write(loader, image.data(), image.size(), NULL);
+    gboolean closed = gdk_pixbuf_loader_close(loader, NULL);
+    GdkPixbuf* pixbuf = (written && closed) ? gdk_pixbuf_loader_get_pixbuf(loader) : NULL;
+
+    bool ok = pixbuf
+           && gdk_pixbuf_get_bits_per_sample(pixbuf) == 8
+           && gdk_pixbuf_get_n_channels(pixbuf) >= 3;
+    if (ok) {
+        // Loaders that ignore the size hint still get scaled here
+        if (gdk_pixbuf_get_width(pixbuf) != width || gdk_pixbuf_get_height(pixbuf) != height) {
+            pixbuf = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+        } else {
+            g_object_ref(pixbuf);
+        }
+    }
+    if (ok && pixbuf) {
+        const guchar* rows = gdk_pixbuf_get_pixels(pixbuf);
+        int stride = gdk_pixbuf_get_rowstride(pixbuf);
+        int channels = gdk_pixbuf_get_n_channels(pixbuf);
+        gray->resize((size_t)width * height);
+        for (int y = 0; y < height; ++y) {
+            cover_dither_row(rows + (size_t)y * stride, channels, &(*gray)[(size_t)y * width], width, y);
+        }
+        g_object_unref(pixbuf);
+    }
+    g_object_unref(loader);
+    return ok && !gray->empty();
+}
+
+// Decode the embedded image straight from the book. The bytes are a view
+// into a mapping when possible, else one temporary copy; either way they
+// are gone when this returns.
+static bool decode_from_book(const std::string& book_path, uint64_t offset, uint64_t size,
+                             int width, int height, std::vector<uint8_t>* gray) {
+    Mp4File file;
+    if (!file.open(book_path.c_str())) return false;
+    file.map();
+
+    const uint8_t* mapped = file.view(offset, size);
+    if (mapped) {
+        return decode_dithered(Mp4View(mapped, (size_t)size), width, height, gray);
+    }
+    std::vector<uint8_t> copy((size_t)size);
+    if (!file.read(offset, &copy[0], copy.size())) return false;
+    return decode_dithered(Mp4View(&copy[0], copy.size()), width, height, gray);
+}
+
+GdkPixbuf* cover_cache_get(const std::string& book_path, uint64_t offset, uint64_t size,
+                           int width, int height) {
+    if (size == 0 || width <= 0 || height <= 0) return NULL;
+
+    std::vector<uint8_t> gray;
+    struct stat st;
+    bool have_stat = stat(book_path.c_str(), &st) == 0;
+    std::string cache_path = have_stat ? cover_path_for(book_path) : std::string();
+
+    if (!cache_path.empty() && load_thumbnail(cache_path, book_path, st, width, height, &gray)) {
+        return pixbuf_from_gray(&gray[0], width, height);
+    }
+
+    if (!decode_from_book(book_path, offset, size, width, height, &gray)) return NULL;
+    if (!cache_path.empty()) {
+        save_thumbnail(cache_path, book_path, st, width, height, gray);
+    }
+    return pixbuf_from_gray(&gray[0], width, height);
+}
+
+// --- Background loading ---
+
+// Bumped by every request; results of older requests are dropped
+static std::atomic<unsigned int> cover_generation(0);
+
+struct CoverRequest {
+    std::string book_path;
+    uint64_t offset;
+    uint64_t size;
+    int width;
+    int height;
+    CoverReadyFunc func;
+    gpointer user_data;
+    unsigned int generation;
+    GdkPixbuf* pixbuf;
+};
+
+static gboolean deliver_cover(gpointer data) {
+    CoverRequest* request = static_cast<CoverRequest*>(data);
+    if (request->generation == cover_generation.load()) {
+        request->func(request->pixbuf, request->user_data);
+    } else if (request->pixbuf) {
+        g_object_unref(request->pixbuf);
+    }
+    delete request;
+    return FALSE;
+}
+
+static void* cover_thread_func(void* arg) {
+    CoverRequest* request = static_cast<CoverRequest*>(arg);
+    if (request->generation == cover_generation.load()) {
+        request->pixbuf = cover_cache_get(request->book_path, request->offset, request->size,
+                                          request->width, request->height);
+    }
+    g_idle_add(deliver_cover, request);
+    return NULL;
+}
+
+void cover_cache_get_async(const std::string& book_path, uint64_t offset, uint64_t size,
+                           int width, int height, CoverReadyFunc func, gpointer user_data) {
+    CoverRequest* request = new CoverRequest;
+    request->book_path = book_path;
+    request->offset = offset;
+    request->size = size;
+    request->width = width;
+    request->height = height;
+    request->func = func;
+    request->user_data = user_data;
+    request->generation = ++cover_generation;
+    request->pixbuf = NULL;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cover_thread_func, request) != 0) {
+        // No thread: load inline rather than show no cover
+        cover_thread_func(request);
+        return;
+    }
+    pthread_detach(thread);
+}
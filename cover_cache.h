@@ -0,0 +1,35 @@
+#ifndef COVER_CACHE_H
+#define COVER_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "mp4_boxes.h"
+
+// Cover art prepared for the e-ink panel: decoded straight at display size
+// (the JPEG loader scales while decoding), reduced once to the panel's 16
+// gray levels with an ordered dither, and kept in ~/.lark_covers so later
+// opens of the same book skip the image decoder entirely.
+
+// New reference to the cover of `book_path` at width x height, from the
+// thumbnail cache or decoded from the `size` image bytes at `offset` in the
+// book; those are only read on a cache miss, and released before returning.
+// Returns NULL if the book has no cover or it cannot be decoded.
+GdkPixbuf* cover_cache_get(const std::string& book_path, uint64_t offset, uint64_t size,
+                           int width, int height);
+
+// Called on the GTK main loop with the cover (or NULL); takes the reference
+typedef void (*CoverReadyFunc)(GdkPixbuf* pixbuf, gpointer user_data);
+
+// Run cover_cache_get() on a background thread and hand the result to
+// `func` on the main loop. Starting a new request drops the result of any
+// request still in flight, so switching books never shows a stale cover.
+void cover_cache_get_async(const std::string& book_path, uint64_t offset, uint64_t size,
+                           int width, int height, CoverReadyFunc func, gpointer user_data);
+
+// Convert one row of RGB(A) pixels to 16-level gray (0, 17, ..., 255)
+// using a 4x4 Bayer matrix; `y` selects the matrix row.
+void cover_dither_row(const uint8_t* pixels, int channels, uint8_t* gray, int width, int y);
+
+#endif // COVER_CACHE_H
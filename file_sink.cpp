@@ -0,0 +1,188 @@
+#include "file_sink.h"
+#include "music_backend.h"
+#include "perf_stats.h"
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xff; p[1] = v >> 8;
+}
+
+FileSink::FileSink(const std::string& path, bool paced)
+    : path(path), paced(paced), decoder(NULL), file(NULL), data_bytes(0), chunk_bytes(8192),
+      generation(0), thread(0), thread_started(false), stopping(false), paused(false),
+      restart_pacing(true) {
+}
+
+FileSink::~FileSink() {
+    close();
+}
+
+// RIFF header for 16-bit PCM; the sizes are filled in again by close()
+bool FileSink::write_header() {
+    Decoder::Format format = decoder->get_format();
+    uint32_t data = data_bytes > 0xffffffffULL - 36 ? 0xffffffffU - 36 : (uint32_t)data_bytes;
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 36 + data);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1); // PCM
+    put_le16(h + 22, (uint16_t)format.channels);
+    put_le32(h + 24, format.rate);
+    put_le32(h + 28, format.rate * format.channels * 2);
+    put_le16(h + 32, (uint16_t)(format.channels * 2));
+    put_le16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, data);
+    return fseeko(file, 0, SEEK_SET) == 0 && fwrite(h, 1, sizeof(h), file) == sizeof(h);
+}
+
+bool FileSink::open(Decoder* dec, size_t chunk, guint gen) {
+    close();
+    decoder = dec;
+    chunk_bytes = chunk;
+    generation = gen;
+    data_bytes = 0;
+    stopping = false;
+    paused = false;
+    restart_pacing = true;
+
+    if (!path.empty()) {
+        file = fopen(path.c_str(), "wb");
+        if (!file || !write_header()) {
+            g_printerr("Backend: Cannot write %s\n", path.c_str());
+            if (file) fclose(file);
+            file = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+void FileSink::start() {
+    if (thread_started) return;
+    if (pthread_create(&thread, NULL, thread_func, this) != 0) {
+        perror("Backend: Failed to create sink thread");
+        emit(SINK_ERROR, generation);
+        return;
+    }
+    thread_started = true;
+}
+
+void FileSink::set_paused(bool value) {
+    {
+        std::lock_guard<std::mutex> lock(pause_mutex);
+        paused = value;
+        restart_pacing = true;
+    }
+    pause_cond.notify_all();
+}
+
+bool FileSink::seek(gint64 position) {
+    // Nothing is queued past the ring, so the decoder's flush is all it takes
+    if (!decoder || !decoder->seek(position)) return false;
+    {
+        std::lock_guard<std::mutex> lock(pause_mutex);
+        restart_pacing = true;
+    }
+    pause_cond.notify_all();
+    return true;
+}
+
+void FileSink::close() {
+    if (thread_started) {
+        {
+            std::lock_guard<std::mutex> lock(pause_mutex);
+            stopping = true;
+        }
+        pause_cond.notify_all();
+        pthread_join(thread, NULL);
+        thread_started = false;
+    }
+    if (file) {
+        if (!write_header() || fclose(file) != 0) {
+            g_printerr("Backend: Failed to finish %s\n", path.c_str());
+        } else {
+            g_print("Backend: Wrote %llu bytes of PCM to %s\n", (unsigned long long)data_bytes, path.c_str());
+        }
+        file = NULL;
+    }
+}
+
+void* FileSink::thread_func(void* arg) {
+    static_cast<FileSink*>(arg)->consume_loop();
+    return NULL;
+}
+
+void FileSink::consume_loop() {
+    PcmRing& ring = decoder->get_ring();
+    Decoder::Format format = decoder->get_format();
+    uint64_t bytes_per_second = (uint64_t)format.rate * format.channels * 2;
+    PerfSlot* stats = perf_stats_slot("sink");
+    decoder->get_clock().set_latency(0);
+
+    // Pacing: audio taken since `origin` may not run ahead of the wall clock
+    uint64_t origin = 0;
+    uint64_t taken = 0;
+
+    while (!stopping) {
+        if (paused) {
+            std::unique_lock<std::mutex> lock(pause_mutex);
+            pause_cond.wait(lock, [this] { return stopping || !paused; });
+            continue;
+        }
+        if (restart_pacing.exchange(false)) {
+            origin = perf_now_ns();
+            taken = 0;
+        }
+
+        uint64_t asked_at = stats ? perf_now_ns() : 0;
+        const uint8_t* pcm;
+        uint64_t end_pos;
+        size_t len = ring.acquire(&pcm, chunk_bytes, 100, &end_pos);
+        if (len == 0) {
+            if (ring.at_end()) {
+                emit(SINK_EOS, generation);
+                return;
+            }
+            if (stats && !stopping) stats->count(PERF_UNDERRUNS);
+            restart_pacing = true; // a device would have played silence meanwhile
+            continue;
+        }
+        if (stats) {
+            stats->time(PERF_SINK_WAIT, perf_now_ns() - asked_at);
+            stats->count(PERF_BUFFERS);
+            stats->fill_level(ring.fill(), ring.capacity());
+        }
+
+        if (file) {
+            if (fwrite(pcm, 1, len, file) != len) {
+                g_printerr("Backend: Failed to write %s\n", path.c_str());
+                ring.release(end_pos);
+                emit(SINK_ERROR, generation);
+                return;
+            }
+            data_bytes += len;
+        }
+
+        // Hold the region for as long as a device would take to play it
+        taken += len;
+        if (paced) {
+            uint64_t due = origin + taken / bytes_per_second * 1000000000ULL
+                         + taken % bytes_per_second * 1000000000ULL / bytes_per_second;
+            uint64_t now = perf_now_ns();
+            if (due > now) {
+                std::unique_lock<std::mutex> lock(pause_mutex);
+                pause_cond.wait_for(lock, std::chrono::nanoseconds(due - now),
+                                    [this] { return stopping || paused || restart_pacing; });
+            }
+        }
+        ring.release(end_pos);
+    }
+}
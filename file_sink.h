@@ -0,0 +1,51 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include "audio_sink.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+// Output without an audio device, for benchmarks, tests and dev boxes: the
+// PCM is written to a WAV file, or dropped if there is no path. A paced sink
+// takes audio at the speed a device would, so positions and end of stream
+// behave as in real playback; an unpaced one drains the ring as fast as the
+// decoder fills it.
+class FileSink : public AudioSink {
+public:
+    FileSink(const std::string& path, bool paced);
+    ~FileSink();
+
+    const char* name() const { return path.empty() ? "null" : "wav"; }
+    bool open(Decoder* decoder, size_t chunk_bytes, guint generation);
+    void start();
+    void set_paused(bool paused);
+    bool seek(gint64 position);
+    void close();
+
+private:
+    std::string path;
+    bool paced;
+    Decoder* decoder;
+    FILE* file;
+    uint64_t data_bytes; // written to the WAV so far
+    size_t chunk_bytes;
+    guint generation;
+
+    pthread_t thread;
+    bool thread_started;
+    std::atomic<bool> stopping;
+    std::atomic<bool> paused;
+    std::atomic<bool> restart_pacing; // after a seek or pause
+    std::mutex pause_mutex;
+    std::condition_variable pause_cond;
+
+    bool write_header();
+    static void* thread_func(void* arg);
+    void consume_loop();
+};
+
+#endif // FILE_SINK_H
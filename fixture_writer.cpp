@@ -0,0 +1,588 @@
+#include "fixture_writer.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+static const unsigned FRAME_SAMPLES = 1024;
+
+// Scale factor bands filled with noise: about the speech range at 44.1 kHz,
+// and valid at every rate (8 kHz has 40 long-window bands)
+static const unsigned NOISE_BANDS = 30;
+static const unsigned GLOBAL_GAIN = 100;
+// Band energies (1.5 dB steps): quiet syllable to stressed syllable
+static const int ENERGY_LOW = 30;
+static const int ENERGY_HIGH = 44;
+
+// Roughly one chunk per second, like common encoders
+static const unsigned FRAMES_PER_CHUNK = 43;
+
+// --- AAC-LC frames ---
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>* out) : out(out), acc(0), count(0) {}
+
+    void put(uint32_t value, int bits) {
+        for (int i = bits - 1; i >= 0; --i) {
+            acc = (uint8_t)((acc << 1) | ((value >> i) & 1));
+            if (++count == 8) {
+                out->push_back(acc);
+                acc = 0;
+                count = 0;
+            }
+        }
+    }
+    void align() {
+        if (count > 0) put(0, 8 - count);
+    }
+
+private:
+    std::vector<uint8_t>* out;
+    uint8_t acc;
+    int count;
+};
+
+// individual_channel_stream(): a long window that is either empty (digital
+// silence) or NOISE_BANDS of noise at `energy`, then no pulse/TNS/gain control
+static void write_ics(BitWriter& bw, int energy) {
+    bool silent = energy < 0;
+    bw.put(GLOBAL_GAIN, 8);
+    bw.put(0, 1);                          // ics_reserved_bit
+    bw.put(0, 2);                          // ONLY_LONG_SEQUENCE
+    bw.put(0, 1);                          // sine window
+    bw.put(silent ? 0 : NOISE_BANDS, 6);   // max_sfb
+    bw.put(0, 1);                          // predictor_data_present
+    if (!silent) {
+        // section_data: one section of NOISE_HCB over all bands
+        bw.put(13, 4);
+        bw.put(NOISE_BANDS, 5);
+        // scale_factor_data: the first noise energy is PCM coded relative to
+        // global_gain - 90, the rest are Huffman-coded deltas of 0 ("0")
+        bw.put((uint32_t)(energy - ((int)GLOBAL_GAIN - 90) + 256), 9);
+        for (unsigned b = 1; b < NOISE_BANDS; ++b) bw.put(0, 1);
+    }
+    bw.put(0, 1); // pulse_data_present
+    bw.put(0, 1); // tns_data_present
+    bw.put(0, 1); // gain_control_data_present
+}
+
+static void write_frame(std::vector<uint8_t>* out, unsigned channels, int energy_left, int energy_right) {
+    out->clear();
+    BitWriter bw(out);
+    if (channels == 1) {
+        bw.put(0, 3); // ID_SCE
+        bw.put(0, 4);
+        write_ics(bw, energy_left);
+    } else {
+        bw.put(1, 3); // ID_CPE
+        bw.put(0, 4);
+        bw.put(0, 1); // common_window
+        write_ics(bw, energy_left);
+        write_ics(bw, energy_right);
+    }
+    bw.put(7, 3);     // ID_END
+    bw.align();
+}
+
+// Talking in sentences of 2-7 s with pauses of 0.3-1.5 s; the energy moves
+// per syllable (about 5 per second)
+class SpeechEnvelope {
+public:
+    explicit SpeechEnvelope(unsigned frames_per_second)
+        : fps(frames_per_second > 0 ? frames_per_second : 1), state(12345), talking(false),
+          left(0), syllable_left(0), energy(ENERGY_LOW) {}
+
+    // Energy of the next frame, -1 for silence
+    int next() {
+        if (left == 0) {
+            talking = !talking;
+            left = talking ? fps * 2 + random() % (fps * 5) : fps * 3 / 10 + random() % (fps * 6 / 5 + 1);
+            syllable_left = 0;
+        }
+        left--;
+        if (!talking) return -1;
+        if (syllable_left == 0) {
+            syllable_left = fps / 10 + random() % (fps / 5 + 1);
+            energy = ENERGY_LOW + (int)(random() % (ENERGY_HIGH - ENERGY_LOW + 1));
+        }
+        syllable_left--;
+        return energy;
+    }
+
+private:
+    unsigned fps;
+    uint32_t state;
+    bool talking;
+    unsigned left;
+    unsigned syllable_left;
+    int energy;
+
+    uint32_t random() {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+};
+
+// --- Boxes ---
+
+class BoxBuffer {
+public:
+    std::vector<uint8_t> data;
+
+    void u8(uint32_t v) { data.push_back((uint8_t)v); }
+    void u16(uint32_t v) { u8(v >> 8); u8(v); }
+    void u32(uint32_t v) { u16(v >> 16); u16(v); }
+    void u64(uint64_t v) { u32((uint32_t)(v >> 32)); u32((uint32_t)v); }
+    void fourcc(const char* s) { bytes(s, 4); }
+    void bytes(const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        data.insert(data.end(), b, b + n);
+    }
+    void zeros(size_t n) { data.insert(data.end(), n, 0); }
+    void full(uint32_t version, uint32_t flags) { u32((version << 24) | flags); }
+
+    // Open a box; end() patches its size
+    size_t begin(const char* type) {
+        size_t start = data.size();
+        u32(0);
+        fourcc(type);
+        return start;
+    }
+    void end(size_t start) {
+        uint32_t size = (uint32_t)(data.size() - start);
+        data[start] = (uint8_t)(size >> 24);
+        data[start + 1] = (uint8_t)(size >> 16);
+        data[start + 2] = (uint8_t)(size >> 8);
+        data[start + 3] = (uint8_t)size;
+    }
+};
+
+static void write_matrix(BoxBuffer& b) {
+    static const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+    for (int i = 0; i < 9; ++i) b.u32(unity[i]);
+}
+
+static int samplerate_index(unsigned rate) {
+    static const unsigned rates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000
+    };
+    for (int i = 0; i < 12; ++i) {
+        if (rates[i] == rate) return i;
+    }
+    return -1;
+}
+
+static void write_esds(BoxBuffer& b, int rate_index, unsigned channels) {
+    // AudioSpecificConfig: AAC LC, rate index, channel configuration,
+    // GASpecificConfig with 1024-sample frames and no extensions
+    uint8_t asc[2];
+    asc[0] = (uint8_t)((2 << 3) | (rate_index >> 1));
+    asc[1] = (uint8_t)(((rate_index & 1) << 7) | (channels << 3));
+
+    size_t esds = b.begin("esds");
+    b.full(0, 0);
+    b.u8(0x03);                  // ES_Descriptor
+    b.u8(3 + 2 + 13 + 2 + 2 + 3);
+    b.u16(1);                    // ES_ID
+    b.u8(0);                     // no dependency, URL or OCR stream
+    b.u8(0x04);                  // DecoderConfigDescriptor
+    b.u8(13 + 2 + 2);
+    b.u8(0x40);                  // MPEG-4 audio
+    b.u8(0x15);                  // audio stream
+    b.u8(0); b.u16(0);           // buffer size
+    b.u32(0);                    // max bitrate
+    b.u32(0);                    // average bitrate
+    b.u8(0x05);                  // DecoderSpecificInfo
+    b.u8(2);
+    b.bytes(asc, 2);
+    b.u8(0x06);                  // SLConfigDescriptor
+    b.u8(1);
+    b.u8(2);
+    b.end(esds);
+}
+
+static void write_text_item(BoxBuffer& b, const char* type, const std::string& text) {
+    size_t item = b.begin(type);
+    size_t data = b.begin("data");
+    b.u32(1);                    // UTF-8
+    b.u32(0);                    // locale
+    b.bytes(text.data(), text.size());
+    b.end(data);
+    b.end(item);
+}
+
+static void write_udta(BoxBuffer& b, const FixtureSpec& spec, uint64_t duration_ns) {
+    size_t udta = b.begin("udta");
+
+    if (spec.chapters > 0) {
+        size_t chpl = b.begin("chpl");
+        b.full(1, 0);
+        b.u32(0);
+        b.u8(spec.chapters);
+        for (unsigned i = 0; i < spec.chapters; ++i) {
+            char title[32];
+            int len = snprintf(title, sizeof(title), "Chapter %u", i + 1);
+            b.u64(duration_ns / 100 / spec.chapters * i);
+            b.u8((uint32_t)len);
+            b.bytes(title, (size_t)len);
+        }
+        b.end(chpl);
+    }
+
+    size_t meta = b.begin("meta");
+    b.full(0, 0);
+    size_t hdlr = b.begin("hdlr");
+    b.full(0, 0);
+    b.u32(0);
+    b.fourcc("mdir");
+    b.fourcc("appl");
+    b.zeros(8);
+    b.u8(0);
+    b.end(hdlr);
+
+    size_t ilst = b.begin("ilst");
+    static const char nam[] = { (char)0xA9, 'n', 'a', 'm', 0 };
+    static const char art[] = { (char)0xA9, 'A', 'R', 'T', 0 };
+    static const char alb[] = { (char)0xA9, 'a', 'l', 'b', 0 };
+    write_text_item(b, nam, spec.title);
+    write_text_item(b, art, "Lark Bench");
+    write_text_item(b, alb, spec.title);
+    if (spec.cover_bytes > 0) {
+        size_t covr = b.begin("covr");
+        size_t data = b.begin("data");
+        b.u32(13);               // JPEG
+        b.u32(0);
+        // SOI, filler that does not compress, EOI
+        size_t fill = spec.cover_bytes > 4 ? spec.cover_bytes - 4 : 0;
+        b.u16(0xFFD8);
+        uint32_t x = 2463534242u;
+        for (size_t i = 0; i < fill; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            b.u8(x & 0x7F);
+        }
+        b.u16(0xFFD9);
+        b.end(data);
+        b.end(covr);
+    }
+    b.end(ilst);
+    b.end(meta);
+    b.end(udta);
+}
+
+// Chunk offset table; co64 once offsets pass 4 GB
+static void write_chunk_offsets(BoxBuffer& b, const std::vector<uint64_t>& offsets, bool wide) {
+    size_t stco = b.begin(wide ? "co64" : "stco");
+    b.full(0, 0);
+    b.u32((uint32_t)offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (wide) b.u64(offsets[i]);
+        else b.u32((uint32_t)offsets[i]);
+    }
+    b.end(stco);
+}
+
+// The chapter text track (ID 2) the audio track points to with tref/chap:
+// one sample per chapter, all in one chunk at `chunk_offset`
+static void write_text_track(BoxBuffer& b, const std::vector<uint32_t>& sizes, uint64_t chunk_offset,
+                             uint64_t duration_ms, bool wide) {
+    uint32_t count = (uint32_t)sizes.size();
+    uint32_t spacing = (uint32_t)(duration_ms / count);
+
+    size_t trak = b.begin("trak");
+    size_t tkhd = b.begin("tkhd");
+    b.full(0, 0);                // disabled: chapters are not played
+    b.u32(0); b.u32(0);
+    b.u32(2);                    // track ID
+    b.u32(0);
+    b.u32((uint32_t)duration_ms);
+    b.zeros(8);
+    b.u16(0); b.u16(0);
+    b.u16(0);
+    b.u16(0);
+    write_matrix(b);
+    b.u32(0); b.u32(0);
+    b.end(tkhd);
+
+    size_t mdia = b.begin("mdia");
+    size_t mdhd = b.begin("mdhd");
+    b.full(0, 0);
+    b.u32(0); b.u32(0);
+    b.u32(1000);
+    b.u32((uint32_t)duration_ms);
+    b.u16(0x55C4);
+    b.u16(0);
+    b.end(mdhd);
+    size_t hdlr = b.begin("hdlr");
+    b.full(0, 0);
+    b.u32(0);
+    b.fourcc("text");
+    b.zeros(12);
+    b.bytes("TextHandler", 12);
+    b.end(hdlr);
+
+    size_t minf = b.begin("minf");
+    size_t nmhd = b.begin("nmhd");
+    b.full(0, 0);
+    b.end(nmhd);
+    size_t stbl = b.begin("stbl");
+    size_t stsd = b.begin("stsd");
+    b.full(0, 0);
+    b.u32(1);
+    size_t text = b.begin("text");
+    b.zeros(6);
+    b.u16(1);                    // data reference index
+    b.zeros(43);                 // display flags, box, colors, font: defaults
+    b.end(text);
+    b.end(stsd);
+
+    size_t stts = b.begin("stts");
+    b.full(0, 0);
+    b.u32(count > 1 ? 2 : 1);
+    if (count > 1) {
+        b.u32(count - 1);
+        b.u32(spacing);
+    }
+    b.u32(1);
+    b.u32((uint32_t)(duration_ms - (uint64_t)spacing * (count - 1)));
+    b.end(stts);
+
+    size_t stsc = b.begin("stsc");
+    b.full(0, 0);
+    b.u32(1);
+    b.u32(1);
+    b.u32(count);
+    b.u32(1);
+    b.end(stsc);
+
+    size_t stsz = b.begin("stsz");
+    b.full(0, 0);
+    b.u32(0);
+    b.u32(count);
+    for (uint32_t i = 0; i < count; ++i) b.u32(sizes[i]);
+    b.end(stsz);
+
+    write_chunk_offsets(b, std::vector<uint64_t>(1, chunk_offset), wide);
+
+    b.end(stbl);
+    b.end(minf);
+    b.end(mdia);
+    b.end(trak);
+}
+
+bool fixture_write_m4b(const char* path, const FixtureSpec& spec) {
+    int rate_index = samplerate_index(spec.samplerate);
+    if (rate_index < 3 || (spec.channels != 1 && spec.channels != 2)
+        || spec.duration <= 0 || spec.chapters > 255 || spec.text_chapters > spec.duration * 1000) {
+        return false;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+
+    BoxBuffer head;
+    size_t ftyp = head.begin("ftyp");
+    head.fourcc("M4B ");
+    head.u32(0);
+    head.fourcc("M4B ");
+    head.fourcc("M4A ");
+    head.fourcc("mp42");
+    head.fourcc("isom");
+    head.end(ftyp);
+    // 64-bit mdat header, sized once the audio is written
+    size_t mdat_pos = head.data.size();
+    head.u32(1);
+    head.fourcc("mdat");
+    head.u64(0);
+    bool ok = fwrite(&head.data[0], 1, head.data.size(), f) == head.data.size();
+
+    // --- Audio, one chunk at a time ---
+    uint32_t frames = (uint32_t)(spec.duration * spec.samplerate / FRAME_SAMPLES);
+    if (frames == 0) frames = 1;
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> chunk_offsets;
+    sizes.reserve(frames);
+    SpeechEnvelope envelope(spec.samplerate / FRAME_SAMPLES);
+    std::vector<uint8_t> frame, chunk;
+    uint64_t offset = head.data.size();
+    for (uint32_t i = 0; i < frames && ok; ++i) {
+        int energy = envelope.next();
+        // A touch of width: the right channel is a step quieter
+        write_frame(&frame, spec.channels, energy, energy < 0 ? -1 : energy - 1);
+        if (i % FRAMES_PER_CHUNK == 0) {
+            ok = chunk.empty() || fwrite(&chunk[0], 1, chunk.size(), f) == chunk.size();
+            offset += chunk.size();
+            chunk.clear();
+            chunk_offsets.push_back(offset);
+        }
+        chunk.insert(chunk.end(), frame.begin(), frame.end());
+        sizes.push_back((uint32_t)frame.size());
+    }
+    if (ok && !chunk.empty()) {
+        ok = fwrite(&chunk[0], 1, chunk.size(), f) == chunk.size();
+        offset += chunk.size();
+    }
+
+    // --- Chapter titles: text samples (length, UTF-8 text) after the audio ---
+    std::vector<uint32_t> text_sizes;
+    uint64_t text_offset = offset;
+    if (ok && spec.text_chapters > 0) {
+        BoxBuffer text;
+        for (unsigned i = 0; i < spec.text_chapters; ++i) {
+            char title[32];
+            int len = snprintf(title, sizeof(title), "Chapter %u", i + 1);
+            text.u16((uint32_t)len);
+            text.bytes(title, (size_t)len);
+            text_sizes.push_back((uint32_t)len + 2);
+        }
+        ok = fwrite(&text.data[0], 1, text.data.size(), f) == text.data.size();
+        offset += text.data.size();
+    }
+
+    uint64_t mdat_size = offset - mdat_pos;
+    uint8_t size_field[8];
+    for (int i = 0; i < 8; ++i) size_field[i] = (uint8_t)(mdat_size >> (56 - 8 * i));
+    if (ok) ok = fseek(f, (long)(mdat_pos + 8), SEEK_SET) == 0
+                 && fwrite(size_field, 1, 8, f) == 8 && fseek(f, 0, SEEK_END) == 0;
+
+    // --- Sample tables ---
+    uint64_t samples = (uint64_t)frames * FRAME_SAMPLES;
+    uint64_t duration_ms = samples * 1000 / spec.samplerate;
+    uint64_t duration_ns = samples * 1000000000ULL / spec.samplerate;
+    bool wide = offset > 0xFFFFFFFFULL;
+
+    BoxBuffer b;
+    size_t moov = b.begin("moov");
+    size_t mvhd = b.begin("mvhd");
+    b.full(0, 0);
+    b.u32(0); b.u32(0);
+    b.u32(1000);
+    b.u32((uint32_t)duration_ms);
+    b.u32(0x00010000);           // rate
+    b.u16(0x0100);               // volume
+    b.zeros(10);
+    write_matrix(b);
+    b.zeros(24);
+    b.u32(text_sizes.empty() ? 2 : 3); // next track ID
+    b.end(mvhd);
+
+    size_t trak = b.begin("trak");
+    size_t tkhd = b.begin("tkhd");
+    b.full(0, 7);                // enabled, in movie, in preview
+    b.u32(0); b.u32(0);
+    b.u32(1);                    // track ID
+    b.u32(0);
+    b.u32((uint32_t)duration_ms);
+    b.zeros(8);
+    b.u16(0); b.u16(0);          // layer, alternate group
+    b.u16(0x0100);               // volume
+    b.u16(0);
+    write_matrix(b);
+    b.u32(0); b.u32(0);          // width, height
+    b.end(tkhd);
+
+    if (!text_sizes.empty()) {
+        size_t tref = b.begin("tref");
+        size_t chap = b.begin("chap");
+        b.u32(2);
+        b.end(chap);
+        b.end(tref);
+    }
+
+    size_t mdia = b.begin("mdia");
+    size_t mdhd = b.begin("mdhd");
+    b.full(0, 0);
+    b.u32(0); b.u32(0);
+    b.u32(spec.samplerate);
+    b.u32((uint32_t)samples);
+    b.u16(0x55C4);               // "und"
+    b.u16(0);
+    b.end(mdhd);
+    size_t hdlr = b.begin("hdlr");
+    b.full(0, 0);
+    b.u32(0);
+    b.fourcc("soun");
+    b.zeros(12);
+    b.bytes("SoundHandler", 13);
+    b.end(hdlr);
+
+    size_t minf = b.begin("minf");
+    size_t smhd = b.begin("smhd");
+    b.full(0, 0);
+    b.u32(0);
+    b.end(smhd);
+    size_t dinf = b.begin("dinf");
+    size_t dref = b.begin("dref");
+    b.full(0, 0);
+    b.u32(1);
+    size_t url = b.begin("url ");
+    b.full(0, 1);                // media in this file
+    b.end(url);
+    b.end(dref);
+    b.end(dinf);
+
+    size_t stbl = b.begin("stbl");
+    size_t stsd = b.begin("stsd");
+    b.full(0, 0);
+    b.u32(1);
+    size_t mp4a = b.begin("mp4a");
+    b.zeros(6);
+    b.u16(1);                    // data reference index
+    b.u16(0); b.u16(0); b.u32(0);
+    b.u16(spec.channels);
+    b.u16(16);
+    b.u16(0); b.u16(0);
+    b.u32(spec.samplerate << 16);
+    write_esds(b, rate_index, spec.channels);
+    b.end(mp4a);
+    b.end(stsd);
+
+    size_t stts = b.begin("stts");
+    b.full(0, 0);
+    b.u32(1);
+    b.u32(frames);
+    b.u32(FRAME_SAMPLES);
+    b.end(stts);
+
+    size_t stsc = b.begin("stsc");
+    b.full(0, 0);
+    uint32_t last_chunk_frames = frames - (uint32_t)(chunk_offsets.size() - 1) * FRAMES_PER_CHUNK;
+    bool ragged = last_chunk_frames != FRAMES_PER_CHUNK && chunk_offsets.size() > 1;
+    b.u32(ragged ? 2 : 1);
+    b.u32(1);
+    b.u32(chunk_offsets.size() > 1 ? FRAMES_PER_CHUNK : last_chunk_frames);
+    b.u32(1);
+    if (ragged) {
+        b.u32((uint32_t)chunk_offsets.size());
+        b.u32(last_chunk_frames);
+        b.u32(1);
+    }
+    b.end(stsc);
+
+    size_t stsz = b.begin("stsz");
+    b.full(0, 0);
+    b.u32(0);
+    b.u32(frames);
+    for (size_t i = 0; i < sizes.size(); ++i) b.u32(sizes[i]);
+    b.end(stsz);
+
+    write_chunk_offsets(b, chunk_offsets, wide);
+
+    b.end(stbl);
+    b.end(minf);
+    b.end(mdia);
+    b.end(trak);
+
+    if (!text_sizes.empty()) {
+        write_text_track(b, text_sizes, text_offset, duration_ms, wide);
+    }
+
+    write_udta(b, spec, duration_ns);
+    b.end(moov);
+
+    if (ok) ok = fwrite(&b.data[0], 1, b.data.size(), f) == b.data.size();
+    if (fclose(f) != 0) ok = false;
+    if (!ok) remove(path);
+    return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef FIXTURE_WRITER_H
+#define FIXTURE_WRITER_H
+
+#include <stddef.h>
+#include <string>
+
+// Synthetic M4B books for benchmarks. The audio is real AAC-LC that FAAD
+// decodes through its normal path: speech-like bursts of perceptual noise
+// substitution (PNS) bands with an envelope, separated by silent frames, so
+// the decoder, the silence skipper and the loudness scan all see work.
+// Frames are generated on the fly and streamed out, so a 20-hour book needs
+// little memory; the sample tables follow the audio (moov at the end).
+struct FixtureSpec {
+    std::string title;
+    unsigned samplerate;   // 8000-48000; FAAD upsamples 24 kHz and below (implicit SBR)
+    unsigned channels;     // 1 or 2
+    double duration;       // seconds
+    unsigned chapters;     // evenly spaced Nero chapters, at most 255
+    unsigned text_chapters; // evenly spaced QuickTime text-track chapters (tref/chap)
+    size_t cover_bytes;    // size of the embedded JPEG cover, 0 for none
+
+    FixtureSpec() : samplerate(44100), channels(2), duration(60), chapters(0), text_chapters(0), cover_bytes(0) {}
+};
+
+// Write `spec` to `path`, replacing it. False on I/O error or a bad spec.
+bool fixture_write_m4b(const char* path, const FixtureSpec& spec);
+
+#endif // FIXTURE_WRITER_H
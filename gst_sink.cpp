@@ -0,0 +1,224 @@
+#include "gst_sink.h"
+#include "music_backend.h"
+#include "perf_stats.h"
+#include <gst/app/gstappsrc.h>
+
+GstSink::GstSink()
+    : decoder(NULL), pipeline(NULL), bus_watch_id(0), generation(0), chunk_bytes(8192),
+      stats(NULL), stopping(false), seek_pending(false) {
+    gst_init(NULL, NULL);
+}
+
+GstSink::~GstSink() {
+    close();
+}
+
+// User data of a pipeline's bus watch. The watch runs on the main loop and
+// may outlive the sink by one dispatch, so it carries copies, not the sink.
+struct BusWatch {
+    AudioSink::EventCallback callback;
+    void* user_data;
+    guint generation;
+};
+
+static void free_bus_watch(gpointer data) {
+    delete static_cast<BusWatch*>(data);
+}
+
+bool GstSink::open(Decoder* dec, size_t chunk, guint gen) {
+    close();
+    decoder = dec;
+    chunk_bytes = chunk;
+    generation = gen;
+    stopping = false;
+    seek_pending = false;
+
+    // The caps are whatever the decoder negotiated for this book
+    Decoder::Format format = decoder->get_format();
+    gchar *pipeline_desc = g_strdup_printf(
+        "appsrc name=pcmsrc caps=\"audio/x-raw-int, endianness=1234, signed=true, width=16, depth=16, rate=%u, channels=%u\" ! mixersink",
+        format.rate, format.channels
+    );
+    pipeline = gst_parse_launch(pipeline_desc, NULL);
+    g_free(pipeline_desc);
+
+    if (!pipeline) {
+        g_printerr("Backend: Failed to create pipeline\n");
+        return false;
+    }
+
+    // The decoder thread feeds appsrc through the ring. A seekable stream
+    // lets flushing seeks drop the audio already queued in the sink.
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "pcmsrc");
+    if (src) {
+        static GstAppSrcCallbacks callbacks = { need_data_cb, NULL, seek_data_cb, { NULL } };
+        gst_app_src_set_stream_type(GST_APP_SRC(src), GST_APP_STREAM_TYPE_SEEKABLE);
+        g_object_set(src, "format", GST_FORMAT_TIME, NULL);
+        gst_app_src_set_callbacks(GST_APP_SRC(src), &callbacks, this, NULL);
+        gst_object_unref(src);
+    }
+
+    // The watch runs on the main loop; it only forwards messages to the
+    // backend, tagged with this pipeline's generation
+    BusWatch* watch = new BusWatch;
+    watch->callback = event_callback;
+    watch->user_data = event_user_data;
+    watch->generation = generation;
+    GstBus *bus = gst_element_get_bus(pipeline);
+    bus_watch_id = gst_bus_add_watch_full(bus, G_PRIORITY_DEFAULT, bus_callback_func,
+                                          watch, free_bus_watch);
+    gst_object_unref(bus);
+
+    stats = perf_stats_slot("sink");
+    return true;
+}
+
+void GstSink::start() {
+    if (pipeline) gst_element_set_state(pipeline, GST_STATE_PLAYING);
+}
+
+void GstSink::set_paused(bool paused) {
+    // The playback clock stops by itself: a paused sink consumes nothing
+    if (pipeline) gst_element_set_state(pipeline, paused ? GST_STATE_PAUSED : GST_STATE_PLAYING);
+}
+
+bool GstSink::seek(gint64 position) {
+    if (!pipeline) return false;
+
+    // The flushing seek empties the sink and calls seek_data_cb(), which
+    // forwards the target to the decoder thread.
+    seek_pending = true;
+    if (gst_element_seek_simple(pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, position)) {
+        return true;
+    }
+    seek_pending = false;
+    return false;
+}
+
+// Ask the pipeline how much audio the sink holds past the point where it
+// releases our buffers; the playback clock subtracts it
+void GstSink::update_latency() {
+    if (!pipeline) return;
+    GstQuery *query = gst_query_new_latency();
+    if (gst_element_query(pipeline, query)) {
+        gboolean live;
+        GstClockTime min_latency, max_latency;
+        gst_query_parse_latency(query, &live, &min_latency, &max_latency);
+        if (GST_CLOCK_TIME_IS_VALID(min_latency)) {
+            decoder->get_clock().set_latency((gint64)min_latency);
+            g_print("Backend: Sink latency %lld ms\n", (long long)(min_latency / GST_MSECOND));
+        }
+    }
+    gst_query_unref(query);
+}
+
+void GstSink::close() {
+    // Wakes need_data_cb() so the streaming thread can be shut down
+    stopping = true;
+    if (bus_watch_id > 0) {
+        g_source_remove(bus_watch_id);
+        bus_watch_id = 0;
+    }
+    if (pipeline) {
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        pipeline = NULL;
+    }
+}
+
+// Runs on the main loop: hand the message to the backend thread
+gboolean GstSink::bus_callback_func(GstBus *bus, GstMessage *msg, gpointer data) {
+    (void)bus;
+    BusWatch* watch = static_cast<BusWatch*>(data);
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+        case GST_MESSAGE_EOS:
+            g_print("Backend: EOS reached.\n");
+            watch->callback(watch->user_data, SINK_EOS, watch->generation);
+            break;
+        case GST_MESSAGE_ERROR: {
+            GError *err;
+            gchar *debug;
+            gst_message_parse_error(msg, &err, &debug);
+            g_printerr("Backend: Error: %s\n", err->message);
+            g_error_free(err);
+            g_free(debug);
+            watch->callback(watch->user_data, SINK_ERROR, watch->generation);
+            break;
+        }
+        case GST_MESSAGE_ASYNC_DONE:
+        case GST_MESSAGE_LATENCY:
+            watch->callback(watch->user_data, SINK_LATENCY, watch->generation);
+            break;
+        default:
+            break;
+    }
+    return TRUE;
+}
+
+// Releases a ring region once the sink has finished with the buffer wrapping it
+struct PcmLease {
+    PcmRing* ring;
+    uint64_t end_pos;
+};
+
+static void release_pcm_lease(gpointer data) {
+    PcmLease* lease = static_cast<PcmLease*>(data);
+    lease->ring->release(lease->end_pos);
+    delete lease;
+}
+
+// Called on the appsrc streaming thread whenever it wants more audio.
+// Hands out ring memory directly (no copy) and blocks until data arrives.
+void GstSink::need_data_cb(GstAppSrc *src, guint length, gpointer data) {
+    (void)length;
+    GstSink* self = static_cast<GstSink*>(data);
+    PcmRing& ring = self->decoder->get_ring();
+    PerfSlot* stats = self->stats;
+    uint64_t asked_at = stats ? perf_now_ns() : 0;
+    bool starved = false;
+
+    while (!self->stopping) {
+        const uint8_t* pcm;
+        uint64_t end_pos;
+        size_t len = ring.acquire(&pcm, self->chunk_bytes, 100, &end_pos);
+        if (len > 0) {
+            if (stats) {
+                stats->time(PERF_SINK_WAIT, perf_now_ns() - asked_at);
+                stats->count(PERF_BUFFERS);
+                stats->fill_level(ring.fill(), ring.capacity());
+            }
+            PcmLease* lease = new PcmLease();
+            lease->ring = &ring;
+            lease->end_pos = end_pos;
+
+            GstBuffer* buffer = gst_buffer_new();
+            GST_BUFFER_DATA(buffer) = const_cast<guint8*>(pcm);
+            GST_BUFFER_SIZE(buffer) = (guint)len;
+            GST_BUFFER_MALLOCDATA(buffer) = reinterpret_cast<guint8*>(lease);
+            GST_BUFFER_FREE_FUNC(buffer) = release_pcm_lease;
+            gst_app_src_push_buffer(src, buffer);
+            return;
+        }
+        if (ring.at_end()) {
+            gst_app_src_end_of_stream(src);
+            return;
+        }
+        // A whole acquire timeout without audio: the listener hears a gap
+        // (a seek still being decoded looks the same, but rarely takes this long)
+        if (stats && !starved && !self->stopping) {
+            starved = true;
+            stats->count(PERF_UNDERRUNS);
+        }
+    }
+}
+
+gboolean GstSink::seek_data_cb(GstAppSrc *src, guint64 offset, gpointer data) {
+    (void)src;
+    GstSink* self = static_cast<GstSink*>(data);
+
+    // basesrc also seeks to 0 when the pipeline starts; the decoder is
+    // already positioned then, so only forward seeks we asked for.
+    if (!self->seek_pending.exchange(false)) return TRUE;
+    return self->decoder->seek((gint64)offset) ? TRUE : FALSE;
+}
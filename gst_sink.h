@@ -0,0 +1,42 @@
+#ifndef GST_SINK_H
+#define GST_SINK_H
+
+#include "audio_sink.h"
+#include <gst/gst.h>
+#include <atomic>
+
+typedef struct _GstAppSrc GstAppSrc;
+
+// GStreamer 0.10 output: appsrc ! mixersink. appsrc borrows ring memory
+// directly (no copy) and gives it back when the sink is done with it.
+class GstSink : public AudioSink {
+public:
+    GstSink();
+    ~GstSink();
+
+    const char* name() const { return "gst"; }
+    bool open(Decoder* decoder, size_t chunk_bytes, guint generation);
+    void start();
+    void set_paused(bool paused);
+    bool seek(gint64 position);
+    void update_latency();
+    void close();
+
+private:
+    Decoder* decoder;
+    GstElement* pipeline;
+    guint bus_watch_id;
+    guint generation;
+    size_t chunk_bytes;
+    PerfSlot* stats; // streaming thread's stats, NULL when off
+
+    std::atomic<bool> stopping;
+    std::atomic<bool> seek_pending; // seek_data_cb() should forward the next seek
+
+    static gboolean bus_callback_func(GstBus* bus, GstMessage* msg, gpointer data);
+    // appsrc callbacks, feeding the pipeline from the decoder's ring
+    static void need_data_cb(GstAppSrc* src, guint length, gpointer data);
+    static gboolean seek_data_cb(GstAppSrc* src, guint64 offset, gpointer data);
+};
+
+#endif // GST_SINK_H
@@ -0,0 +1,236 @@
+#include "history_dialog.h"
+#include "tree_columns.h"
+#include <time.h>
+
+// --- Lazy tree model over the history store ---
+// Rows are not copied anywhere: the model hands out row numbers as iters and
+// formats a cell only when the view asks for it. In fixed-height mode the
+// view asks for the rows on screen, so opening the dialog costs about the
+// same for ten books or ten thousand.
+
+enum {
+    COL_TITLE,
+    COL_PROGRESS,
+    COL_CHAPTER,
+    COL_PLAYED,
+    COL_PATH,
+    COL_COUNT
+};
+
+typedef struct {
+    GObject parent;
+    HistoryStore *store;
+    gint stamp; // the store's layout when the model was made
+} HistoryModel;
+
+typedef struct {
+    GObjectClass parent_class;
+} HistoryModelClass;
+
+static void history_model_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(HistoryModel, history_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, history_model_tree_model_init))
+
+#define HISTORY_MODEL(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), history_model_get_type(), HistoryModel))
+
+static void history_model_init(HistoryModel *model) {
+    model->store = NULL;
+    model->stamp = 0;
+}
+
+static void history_model_class_init(HistoryModelClass *klass) {
+    (void)klass;
+}
+
+// Row of `iter`, or -1 if it is stale or out of range
+static gint iter_row(HistoryModel *model, GtkTreeIter *iter) {
+    if (!iter || iter->stamp != model->stamp || model->stamp != (gint)model->store->layout()) return -1;
+    gint row = GPOINTER_TO_INT(iter->user_data);
+    return row < (gint)model->store->size() ? row : -1;
+}
+
+static gboolean set_row(HistoryModel *model, GtkTreeIter *iter, gint row) {
+    if (row < 0 || row >= (gint)model->store->size()) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    iter->stamp = model->stamp;
+    iter->user_data = GINT_TO_POINTER(row);
+    iter->user_data2 = NULL;
+    iter->user_data3 = NULL;
+    return TRUE;
+}
+
+static GtkTreeModelFlags history_model_get_flags(GtkTreeModel *) {
+    return (GtkTreeModelFlags)GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint history_model_get_n_columns(GtkTreeModel *) {
+    return COL_COUNT;
+}
+
+static GType history_model_get_column_type(GtkTreeModel *, gint) {
+    return G_TYPE_STRING;
+}
+
+static gboolean history_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    if (gtk_tree_path_get_depth(path) != 1) return FALSE;
+    return set_row(HISTORY_MODEL(tree_model), iter, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *history_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    gint row = iter_row(HISTORY_MODEL(tree_model), iter);
+    return row < 0 ? NULL : gtk_tree_path_new_from_indices(row, -1);
+}
+
+static gchar *format_played(int64_t updated) {
+    if (updated <= 0) return g_strdup("");
+    time_t t = (time_t)updated;
+    time_t now = time(NULL);
+    struct tm then_tm, now_tm;
+    localtime_r(&t, &then_tm);
+    localtime_r(&now, &now_tm);
+    char buf[32];
+    if (then_tm.tm_year == now_tm.tm_year && then_tm.tm_yday == now_tm.tm_yday) {
+        strftime(buf, sizeof(buf), "Today %H:%M", &then_tm);
+    } else {
+        strftime(buf, sizeof(buf), "%Y-%m-%d", &then_tm);
+    }
+    return g_strdup(buf);
+}
+
+static void history_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    HistoryModel *model = HISTORY_MODEL(tree_model);
+    g_value_init(value, G_TYPE_STRING);
+    gint row = iter_row(model, iter);
+    if (row < 0) return;
+
+    const HistoryStore::Entry &entry = model->store->at(row);
+    switch (column) {
+        case COL_TITLE: {
+            // The file name, without directory and extension
+            size_t slash = entry.path.rfind('/');
+            size_t start = slash == std::string::npos ? 0 : slash + 1;
+            size_t dot = entry.path.rfind('.');
+            size_t len = (dot == std::string::npos || dot < start) ? std::string::npos : dot - start;
+            g_value_set_string(value, entry.path.substr(start, len).c_str());
+            break;
+        }
+        case COL_PROGRESS: {
+            int percent = entry.progress();
+            if (percent >= 0) g_value_take_string(value, g_strdup_printf("%d%%", percent));
+            break;
+        }
+        case COL_CHAPTER:
+            if (entry.chapter >= 0) g_value_take_string(value, g_strdup_printf("Ch. %d", entry.chapter + 1));
+            break;
+        case COL_PLAYED:
+            g_value_take_string(value, format_played(entry.updated));
+            break;
+        case COL_PATH:
+            g_value_set_string(value, entry.path.c_str());
+            break;
+    }
+}
+
+static gboolean history_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    HistoryModel *model = HISTORY_MODEL(tree_model);
+    gint row = iter_row(model, iter);
+    return set_row(model, iter, row < 0 ? -1 : row + 1);
+}
+
+static gboolean history_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    return parent ? FALSE : set_row(HISTORY_MODEL(tree_model), iter, 0);
+}
+
+static gboolean history_model_iter_has_child(GtkTreeModel *, GtkTreeIter *) {
+    return FALSE;
+}
+
+static gint history_model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return iter ? 0 : (gint)HISTORY_MODEL(tree_model)->store->size();
+}
+
+static gboolean history_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                                             GtkTreeIter *parent, gint n) {
+    return parent ? FALSE : set_row(HISTORY_MODEL(tree_model), iter, n);
+}
+
+static gboolean history_model_iter_parent(GtkTreeModel *, GtkTreeIter *, GtkTreeIter *) {
+    return FALSE;
+}
+
+static void history_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = history_model_get_flags;
+    iface->get_n_columns = history_model_get_n_columns;
+    iface->get_column_type = history_model_get_column_type;
+    iface->get_iter = history_model_get_iter;
+    iface->get_path = history_model_get_path;
+    iface->get_value = history_model_get_value;
+    iface->iter_next = history_model_iter_next;
+    iface->iter_children = history_model_iter_children;
+    iface->iter_has_child = history_model_iter_has_child;
+    iface->iter_n_children = history_model_iter_n_children;
+    iface->iter_nth_child = history_model_iter_nth_child;
+    iface->iter_parent = history_model_iter_parent;
+}
+
+static GtkTreeModel *history_model_new(HistoryStore *store) {
+    HistoryModel *model = HISTORY_MODEL(g_object_new(history_model_get_type(), NULL));
+    model->store = store;
+    model->stamp = (gint)store->layout();
+    return GTK_TREE_MODEL(model);
+}
+
+// --- Dialog ---
+
+static void add_column(GtkWidget *tree_view, const char *title, int column, int width) {
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    GtkTreeViewColumn *col = append_fixed_column(tree_view, title, width, renderer);
+    gtk_tree_view_column_add_attribute(col, renderer, "text", column);
+}
+
+std::string show_history_dialog(GtkWindow *parent, HistoryStore &history) {
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("L:A_N:application_PC:TS_ID:com.kbarni.m4bplayer",
+                                                     parent,
+                                                     GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                     GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                                     GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT,
+                                                     NULL);
+
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    GtkWidget *tree_view = gtk_tree_view_new();
+    add_column(tree_view, "Book", COL_TITLE, 260);
+    add_column(tree_view, "Done", COL_PROGRESS, 70);
+    add_column(tree_view, "Chapter", COL_CHAPTER, 90);
+    add_column(tree_view, "Played", COL_PLAYED, 120);
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(tree_view), TRUE);
+
+    GtkTreeModel *model = history_model_new(&history);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(tree_view), model);
+
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(scroll, 560, 600);
+    gtk_container_add(GTK_CONTAINER(scroll), tree_view);
+    gtk_container_add(GTK_CONTAINER(content_area), scroll);
+    gtk_widget_show_all(dialog);
+
+    std::string chosen;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree_view));
+        GtkTreeIter iter;
+        GtkTreeModel *selected_model;
+        if (gtk_tree_selection_get_selected(selection, &selected_model, &iter)) {
+            char *file = NULL;
+            gtk_tree_model_get(selected_model, &iter, COL_PATH, &file, -1);
+            if (file) chosen = file;
+            g_free(file);
+        }
+    }
+
+    gtk_widget_destroy(dialog);
+    g_object_unref(model);
+    return chosen;
+}
@@ -0,0 +1,12 @@
+#ifndef HISTORY_DIALOG_H
+#define HISTORY_DIALOG_H
+
+#include <gtk/gtk.h>
+#include <string>
+#include "history_store.h"
+
+// Recently played books, newest first. Returns the path of the book picked,
+// or an empty string.
+std::string show_history_dialog(GtkWindow *parent, HistoryStore &history);
+
+#endif // HISTORY_DIALOG_H
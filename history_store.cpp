@@ -0,0 +1,90 @@
+#include "history_store.h"
+#include <time.h>
+#include <algorithm>
+
+int HistoryStore::Entry::progress() const {
+    if (duration <= 0) return -1;
+    int64_t percent = position * 100 / duration;
+    return (int)std::max<int64_t>(0, std::min<int64_t>(100, percent));
+}
+
+HistoryStore::HistoryStore() : layout_stamp(0) {
+}
+
+bool HistoryStore::open(const std::string& journal_path) {
+    close();
+    bool ok = journal.open(journal_path);
+
+    std::vector<PlaybackJournal::Entry> books = journal.entries();
+    entries.reserve(books.size());
+    for (size_t i = 0; i < books.size(); ++i) {
+        Entry entry = { books[i].path, books[i].position, books[i].duration,
+                        books[i].chapter, books[i].updated };
+        index[entry.path] = entries.size();
+        entries.push_back(entry);
+        order.push_back(i);
+    }
+    // Sorted once here; from then on a book only ever moves to the front.
+    // The journal's current book wins ties within the same second.
+    std::string current_path = journal.current();
+    std::sort(order.begin(), order.end(), [this, &current_path](size_t a, size_t b) {
+        if (entries[a].updated != entries[b].updated) return entries[a].updated > entries[b].updated;
+        return entries[a].path == current_path && entries[b].path != current_path;
+    });
+    layout_stamp++;
+    return ok;
+}
+
+void HistoryStore::close() {
+    journal.close();
+    entries.clear();
+    index.clear();
+    order.clear();
+    layout_stamp++;
+}
+
+const HistoryStore::Entry* HistoryStore::find(const std::string& path) const {
+    std::unordered_map<std::string, size_t>::const_iterator it = index.find(path);
+    return it != index.end() ? &entries[it->second] : NULL;
+}
+
+std::string HistoryStore::current() const {
+    return order.empty() ? std::string() : entries[order[0]].path;
+}
+
+void HistoryStore::record(const std::string& path, int64_t position_ms, int chapter) {
+    if (path.empty()) return;
+    int64_t now = (int64_t)time(NULL);
+    journal.record(path, position_ms, chapter, now);
+
+    std::unordered_map<std::string, size_t>::iterator it = index.find(path);
+    size_t i;
+    if (it == index.end()) {
+        Entry entry = { path, position_ms, 0, chapter, now };
+        i = entries.size();
+        index[path] = i;
+        entries.push_back(entry);
+        order.insert(order.begin(), i);
+        layout_stamp++;
+    } else {
+        i = it->second;
+        Entry& entry = entries[i];
+        entry.position = position_ms;
+        entry.chapter = chapter;
+        entry.updated = now;
+        // Checkpoints of the book being played find it in front already;
+        // only switching books moves a row
+        if (order[0] != i) {
+            order.erase(std::find(order.begin(), order.end(), i));
+            order.insert(order.begin(), i);
+            layout_stamp++;
+        }
+    }
+}
+
+void HistoryStore::set_duration(const std::string& path, int64_t duration_ms) {
+    std::unordered_map<std::string, size_t>::iterator it = index.find(path);
+    if (it == index.end() || duration_ms <= 0) return;
+    entries[it->second].duration = duration_ms;
+    journal.set_duration(path, duration_ms);
+}
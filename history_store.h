@@ -0,0 +1,63 @@
+#ifndef HISTORY_STORE_H
+#define HISTORY_STORE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "playback_journal.h"
+
+// Every book ever played: where it was left, how far along that is, the
+// chapter, and when. Rows are kept in last-played order (row 0 is the most
+// recent book), so a list of thousands can be shown a screenful at a time
+// without sorting. Backed by a PlaybackJournal, which makes each change
+// durable.
+class HistoryStore {
+public:
+    struct Entry {
+        std::string path;
+        int64_t position; // milliseconds
+        int64_t duration; // milliseconds, 0 until the book's metadata was read
+        int chapter;      // -1 if the book has no chapters
+        int64_t updated;  // wall-clock seconds it was last played
+
+        // Percent of the book heard, -1 if its length is not known
+        int progress() const;
+    };
+
+    HistoryStore();
+
+    // Load the journal at `journal_path`, creating it if needed
+    bool open(const std::string& journal_path);
+    void close();
+
+    size_t size() const { return order.size(); }
+    bool empty() const { return order.empty(); }
+    const Entry& at(size_t row) const { return entries[order[row]]; }
+    const Entry* find(const std::string& path) const;
+    // The most recently played book; empty if none
+    std::string current() const;
+
+    // Checkpoint `path` and make it the most recent book
+    void record(const std::string& path, int64_t position_ms, int chapter = -1);
+    void set_duration(const std::string& path, int64_t duration_ms);
+    // Force everything recorded so far to disk
+    void sync() { journal.sync(); }
+
+    // Changes whenever rows are added or reordered, not when only their
+    // values change; models over the store use it to tell stale rows apart
+    unsigned layout() const { return layout_stamp; }
+
+private:
+    PlaybackJournal journal;
+    std::vector<Entry> entries; // append-only, so indices stay valid
+    std::unordered_map<std::string, size_t> index; // path -> entries
+    std::vector<size_t> order;  // entries, most recently played first
+    unsigned layout_stamp;
+
+    HistoryStore(const HistoryStore&);
+    HistoryStore& operator=(const HistoryStore&);
+};
+
+#endif // HISTORY_STORE_H
@@ -0,0 +1,571 @@
+/* lark_bench.cpp - headless benchmark of the decoder and backend.
+ *
+ * Runs without a screen or audio device: PCM goes to a null sink that
+ * drains the decoder's ring. For every book it reports, as one JSON object
+ * per line on stdout:
+ *   - decode speed (seconds of audio per wall-clock second)
+ *   - time to first PCM from opening the book, as after picking it in the player
+ *   - seek latency distributions for random and chapter seeks
+ *   - read_metadata latency, cold (cache miss, moov parsed; no seek index
+ *     is built) and warm (cache hit)
+ *   - with --power, the decoder's wakeups per minute and duty cycle while
+ *     playing in real time, with the default ring and in power-saving mode
+ *   - peak RSS
+ * Log output goes to stderr.
+ *
+ * Usage: lark-bench [--fixtures DIR] [--max-audio SECONDS] [--seeks N]
+ *                   [--power SECONDS] [--stats FILE] [book.m4b ...]
+ *        lark-bench --scan DIR [--threads N]
+ * Without books, the standard fixtures are generated in DIR (once) and used.
+ * --power plays every book for SECONDS of wall time in each mode, so a run
+ * takes twice that per book; several power-saving cycles need minutes.
+ * --stats records the decoder's per-frame timings (at a small cost to the
+ * numbers above) and writes them to FILE at the end.
+ * --scan measures the library scanner on DIR instead: files per second for a
+ * cold scan (every book parsed), one served from the metadata cache, and an
+ * unchanged rescan.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include "music_backend.h"
+#include "fixture_writer.h"
+#include "lark_paths.h"
+#include "perf_stats.h"
+#include "library.h"
+
+// Ring used while benchmarking, as in normal playback
+static const int BENCH_BUFFER_MS = 2000;
+// Longest wait for audio after an open or a seek
+static const gint64 FIRST_PCM_TIMEOUT_US = 10 * 1000 * 1000;
+
+static gint64 now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void print_to_stderr(const gchar* message) {
+    fputs(message, stderr);
+}
+
+// --- Null sink ---
+
+// Consumes the decoder's ring like the appsrc callback would, without
+// playing anything. Either drains everything as fast as it is decoded, or
+// takes a single region (to time a seek) and then leaves the ring full so
+// the decoder parks instead of running to the end of the book, or consumes
+// at the pace of real playback.
+class NullSink {
+public:
+    enum Mode { IDLE, PROBE, DRAIN, PACED };
+
+    explicit NullSink(PcmRing& ring)
+        : ring(ring), mode(IDLE), idle(true), quit(false), first_data(0), bytes(0),
+          region_bytes(64 * 1024), bytes_per_second(0) {
+        thread = std::thread(&NullSink::loop, this);
+    }
+    ~NullSink() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+            cond.notify_all();
+        }
+        thread.join();
+    }
+
+    // Forget the last arrival and consume in `m` mode from now on
+    void arm(Mode m) {
+        std::lock_guard<std::mutex> lock(mutex);
+        first_data = 0;
+        mode = m;
+        cond.notify_all();
+    }
+    // Consume `rate` bytes per second in regions of up to `region`, holding
+    // each for as long as a device would take to play it
+    void arm_paced(uint64_t rate, size_t region) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bytes_per_second = rate;
+            region_bytes = region;
+        }
+        arm(PACED);
+    }
+    // Stop consuming and wait until the ring is left alone, so it can be
+    // reset or reconfigured
+    void pause() {
+        std::unique_lock<std::mutex> lock(mutex);
+        mode = IDLE;
+        cond.wait(lock, [this] { return idle; });
+    }
+    // Wait for data after arm(); the arrival time in monotonic us, 0 on timeout
+    gint64 wait_first_data(gint64 timeout_us) {
+        gint64 deadline = now_us() + timeout_us;
+        while (first_data == 0 && now_us() < deadline) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return first_data;
+    }
+    uint64_t consumed() const { return bytes; }
+    bool finished() const { return ring.at_end(); }
+
+private:
+    PcmRing& ring;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<int> mode;
+    bool idle; // the loop is parked and not touching the ring
+    std::atomic<bool> quit;
+    std::atomic<gint64> first_data;
+    std::atomic<uint64_t> bytes;
+    size_t region_bytes;       // PACED only, set before arming
+    uint64_t bytes_per_second;
+
+    void loop() {
+        gint64 origin = 0;
+        uint64_t taken = 0;
+        while (!quit) {
+            if (mode == IDLE) {
+                std::unique_lock<std::mutex> lock(mutex);
+                idle = true;
+                cond.notify_all();
+                cond.wait(lock, [this] { return mode != IDLE || quit; });
+                idle = false;
+                origin = 0;
+                continue;
+            }
+            bool paced = mode == PACED;
+            const uint8_t* data;
+            uint64_t end_pos;
+            size_t len = ring.acquire(&data, paced ? region_bytes : 64 * 1024, 20, &end_pos);
+            if (len == 0) continue;
+            if (first_data == 0) first_data = now_us();
+            bytes += len;
+            if (paced) {
+                if (origin == 0) {
+                    origin = now_us();
+                    taken = 0;
+                }
+                taken += len;
+                gint64 due = origin + (gint64)(taken * 1000000 / bytes_per_second);
+                while (!quit && mode == PACED && now_us() < due) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+            }
+            ring.release(end_pos);
+            if (mode == PROBE) mode = IDLE;
+        }
+    }
+};
+
+// --- Statistics ---
+
+struct Distribution {
+    std::vector<gint64> values;
+    int failures;
+
+    Distribution() : failures(0) {}
+
+    gint64 percentile(double p) const {
+        std::vector<gint64> sorted(values);
+        std::sort(sorted.begin(), sorted.end());
+        size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+        return sorted[i];
+    }
+
+    std::string json() const {
+        char buf[256];
+        if (values.empty()) {
+            snprintf(buf, sizeof(buf), "{\"n\":0,\"failures\":%d}", failures);
+            return buf;
+        }
+        double sum = 0;
+        for (size_t i = 0; i < values.size(); ++i) sum += values[i];
+        snprintf(buf, sizeof(buf),
+                 "{\"n\":%zu,\"failures\":%d,\"min\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,"
+                 "\"max\":%lld,\"mean\":%.0f}",
+                 values.size(), failures, (long long)percentile(0), (long long)percentile(0.5),
+                 (long long)percentile(0.9), (long long)percentile(0.99), (long long)percentile(1),
+                 sum / values.size());
+        return buf;
+    }
+};
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// --- Metadata ---
+
+static GMainLoop* main_loop = NULL;
+
+static void on_metadata(void*) {
+    g_main_loop_quit(main_loop);
+}
+
+static gint64 time_read_metadata(MusicBackend& backend, const std::string& path) {
+    backend.read_metadata(path.c_str());
+    g_main_loop_run(main_loop);
+    return backend.get_last_open_latency();
+}
+
+// --- Decoder runs ---
+
+struct Result {
+    unsigned rate;
+    unsigned channels;
+    double audio_seconds;
+    double decode_x_realtime;
+    gint64 first_pcm_us;
+    Distribution random_seeks;
+    Distribution chapter_seeks;
+};
+
+struct PowerResult {
+    double wakeups_per_minute;
+    double duty_cycle;
+
+    PowerResult() : wakeups_per_minute(0), duty_cycle(0) {}
+
+    std::string json() const {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "{\"wakeups_per_min\":%.1f,\"duty_cycle\":%.4f}",
+                 wakeups_per_minute, duty_cycle);
+        return buf;
+    }
+};
+
+static void configure_ring(Decoder& decoder) {
+    Decoder::Format format = decoder.get_format();
+    size_t bytes_per_ms = (size_t)format.rate * format.channels * 2 / 1000;
+    decoder.get_ring().configure(BENCH_BUFFER_MS * bytes_per_ms, BENCH_BUFFER_MS / 2 * bytes_per_ms,
+                                 BENCH_BUFFER_MS * bytes_per_ms);
+}
+
+// Open `path` and start decoding from the beginning; the time until the
+// sink sees PCM, -1 on failure
+static gint64 start_decoder(Decoder& decoder, NullSink& sink, const std::string& path, NullSink::Mode mode) {
+    sink.pause();
+    gint64 started = now_us();
+    if (!decoder.open(path.c_str(), 0)) return -1;
+    configure_ring(decoder);
+    if (!decoder.run()) return -1;
+    sink.arm(mode);
+    gint64 first = sink.wait_first_data(FIRST_PCM_TIMEOUT_US);
+    return first ? first - started : -1;
+}
+
+// Seek the running decoder and time until the sink gets the new audio
+static void time_seek(Decoder& decoder, NullSink& sink, gint64 position, Distribution* dist) {
+    sink.pause();
+    gint64 started = now_us();
+    if (!decoder.seek(position)) {
+        dist->failures++;
+        return;
+    }
+    // Audio from before the seek is held back by the ring from here on
+    sink.arm(NullSink::PROBE);
+    gint64 first = sink.wait_first_data(FIRST_PCM_TIMEOUT_US);
+    if (first) dist->values.push_back(first - started);
+    else dist->failures++;
+}
+
+static bool run_decoder(const std::string& path, double max_audio, int seeks, Result* r) {
+    Decoder decoder;
+    NullSink sink(decoder.get_ring());
+
+    // Throughput, from the start of the book
+    r->first_pcm_us = start_decoder(decoder, sink, path, NullSink::DRAIN);
+    if (r->first_pcm_us < 0) return false;
+    Decoder::Format format = decoder.get_format();
+    r->rate = format.rate;
+    r->channels = format.channels;
+    double bytes_per_second = (double)format.rate * format.channels * 2;
+
+    gint64 started = now_us();
+    while (!sink.finished() && (max_audio <= 0 || sink.consumed() < max_audio * bytes_per_second)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    double wall = (now_us() - started) / 1e6;
+    r->audio_seconds = sink.consumed() / bytes_per_second;
+    r->decode_x_realtime = wall > 0 ? r->audio_seconds / wall : 0;
+    decoder.stop();
+
+    // Seeks into a running decoder that is parked on a full ring, as it is
+    // during playback
+    if (start_decoder(decoder, sink, path, NullSink::PROBE) < 0) return false;
+
+    Mp4Demuxer tags;
+    std::vector<gint64> chapters;
+    gint64 duration = 0;
+    if (tags.open_metadata(path.c_str())) {
+        duration = tags.get_duration();
+        for (size_t i = 0; i < tags.get_chapters().size(); ++i) {
+            chapters.push_back((gint64)tags.get_chapters()[i].timestamp * 100);
+        }
+        tags.close();
+    }
+
+    srand(1);
+    for (int i = 0; i < seeks && duration > 0; ++i) {
+        double f = (double)rand() / RAND_MAX;
+        time_seek(decoder, sink, (gint64)(f * duration * 0.99), &r->random_seeks);
+    }
+    // Every chapter start, spread over the book when there are too many
+    for (int i = 0; i < seeks && !chapters.empty(); ++i) {
+        size_t c = chapters.size() <= (size_t)seeks ? (size_t)i : (size_t)i * chapters.size() / seeks;
+        if (c >= chapters.size()) break;
+        time_seek(decoder, sink, chapters[c], &r->chapter_seeks);
+    }
+    decoder.stop();
+    return true;
+}
+
+// Play `path` from the start in real time for `seconds` and report the
+// decoder's power profile, with the ring sized the way MusicBackend sizes it
+static bool run_power(const std::string& path, bool power_save, double seconds, PowerResult* r) {
+    Decoder decoder;
+    NullSink sink(decoder.get_ring());
+    sink.pause();
+    decoder.set_read_ahead(power_save ? MusicBackend::POWER_SAVE_DEPTH_MS : BENCH_BUFFER_MS);
+    if (!decoder.open(path.c_str(), 0)) return false;
+
+    Decoder::Format format = decoder.get_format();
+    size_t frame_bytes = format.channels * 2;
+    size_t bytes_per_ms = (size_t)format.rate * frame_bytes / 1000;
+    size_t region = MusicBackend::PUSH_BYTES;
+    if (power_save) {
+        decoder.get_ring().configure(MusicBackend::POWER_SAVE_DEPTH_MS * bytes_per_ms / frame_bytes * frame_bytes,
+                                     MusicBackend::POWER_SAVE_LOW_MS * bytes_per_ms,
+                                     MusicBackend::POWER_SAVE_DEPTH_MS * bytes_per_ms);
+        region = MusicBackend::POWER_SAVE_PUSH_BYTES;
+    } else {
+        configure_ring(decoder);
+    }
+    if (!decoder.run()) return false;
+    sink.arm_paced((uint64_t)format.rate * frame_bytes, region / frame_bytes * frame_bytes);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds((gint64)(seconds * 1000)));
+    bool ok = decoder.get_power_stats(&r->wakeups_per_minute, &r->duty_cycle);
+    sink.pause();
+    decoder.stop();
+    return ok;
+}
+
+// --- Fixtures ---
+
+struct Fixture {
+    const char* name;
+    FixtureSpec spec;
+};
+
+static std::vector<Fixture> standard_fixtures() {
+    std::vector<Fixture> set;
+    Fixture f;
+
+    f.name = "short";
+    f.spec = FixtureSpec();
+    f.spec.title = "Short";
+    f.spec.duration = 10 * 60;
+    f.spec.chapters = 12;
+    f.spec.cover_bytes = 40 * 1024;
+    set.push_back(f);
+
+    // Mono at 22.05 kHz: the usual low-bitrate audiobook (FAAD upsamples it)
+    f.name = "long";
+    f.spec = FixtureSpec();
+    f.spec.title = "Twenty Hours";
+    f.spec.samplerate = 22050;
+    f.spec.channels = 1;
+    f.spec.duration = 20 * 3600;
+    f.spec.chapters = 60;
+    f.spec.cover_bytes = 120 * 1024;
+    set.push_back(f);
+
+    f.name = "chapters";
+    f.spec = FixtureSpec();
+    f.spec.title = "Many Chapters";
+    f.spec.duration = 4 * 3600;
+    f.spec.chapters = 255; // the most chpl can hold
+    set.push_back(f);
+
+    // Audible-style chapters in a text track, more than chpl could hold
+    f.name = "text-chapters";
+    f.spec = FixtureSpec();
+    f.spec.title = "Text Chapters";
+    f.spec.duration = 4 * 3600;
+    f.spec.text_chapters = 3000;
+    set.push_back(f);
+
+    f.name = "cover";
+    f.spec = FixtureSpec();
+    f.spec.title = "Large Cover";
+    f.spec.duration = 30 * 60;
+    f.spec.chapters = 8;
+    f.spec.cover_bytes = 6 * 1024 * 1024;
+    set.push_back(f);
+    return set;
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '"' || s[i] == '\\') out += '\\';
+        if ((unsigned char)s[i] >= 0x20) out += s[i];
+    }
+    return out;
+}
+
+// Three scans of `dir`: cold, from the metadata cache, and unchanged
+static int run_scan_bench(const std::string& dir, unsigned threads) {
+    std::vector<std::string> dirs(1, dir);
+    MetaCache cache; // in memory: the first scan parses everything
+    Library cold(cache);
+    Library::ScanStats first = cold.scan(dirs, threads);
+    Library::ScanStats unchanged = cold.scan(dirs, threads);
+    Library warm(cache);
+    Library::ScanStats cached = warm.scan(dirs, threads);
+
+    printf("{\"scan\":\"%s\",\"books\":%u,\"folders\":%u,\"unreadable\":%u,\"threads\":%u,"
+           "\"cold_files_per_s\":%.0f,\"cached_files_per_s\":%.0f,\"unchanged_files_per_s\":%.0f,"
+           "\"cold_ms\":%.1f,\"peak_rss_kb\":%ld}\n",
+           json_escape(dir).c_str(), first.files, first.dirs, first.failed, first.threads,
+           first.files_per_second(), cached.files_per_second(), unchanged.files_per_second(),
+           first.elapsed_us / 1000.0, peak_rss_kb());
+    return first.files > 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    std::string fixture_dir = "bench-fixtures";
+    double max_audio = 3600;
+    int seeks = 50;
+    double power_seconds = 0; // no power runs
+    std::string stats_path;
+    std::string scan_dir;
+    unsigned scan_threads = 0; // one per CPU
+    std::vector<std::pair<std::string, std::string> > books; // name, path
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--fixtures") == 0 && i + 1 < argc) {
+            fixture_dir = argv[++i];
+        } else if (strcmp(argv[i], "--max-audio") == 0 && i + 1 < argc) {
+            max_audio = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seeks") == 0 && i + 1 < argc) {
+            seeks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--power") == 0 && i + 1 < argc) {
+            power_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--scan") == 0 && i + 1 < argc) {
+            scan_dir = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            scan_threads = (unsigned)atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [--fixtures DIR] [--max-audio SECONDS] [--seeks N] "
+                    "[--power SECONDS] [--stats FILE] [book.m4b ...]\n"
+                    "       %s --scan DIR [--threads N]\n", argv[0], argv[0]);
+            return 2;
+        } else {
+            books.push_back(std::make_pair(std::string(argv[i]), std::string(argv[i])));
+        }
+    }
+
+    g_set_print_handler(print_to_stderr);
+    if (!scan_dir.empty()) {
+        return run_scan_bench(scan_dir, scan_threads);
+    }
+    mkdir(fixture_dir.c_str(), 0755);
+
+    if (books.empty()) {
+        std::vector<Fixture> fixtures = standard_fixtures();
+        for (size_t i = 0; i < fixtures.size(); ++i) {
+            std::string path = fixture_dir + "/" + fixtures[i].name + ".m4b";
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                fprintf(stderr, "Bench: Generating %s\n", path.c_str());
+                if (!fixture_write_m4b(path.c_str(), fixtures[i].spec)) {
+                    fprintf(stderr, "Bench: Failed to write %s\n", path.c_str());
+                    return 1;
+                }
+            }
+            books.push_back(std::make_pair(std::string(fixtures[i].name), path));
+        }
+    }
+
+    // Keep the metadata cache and seek indexes in the fixture directory, and
+    // start them empty so the first open of every book is a cold one
+    setenv("HOME", fixture_dir.c_str(), 1);
+    unlink((fixture_dir + "/.lark_meta").c_str());
+    for (size_t i = 0; i < books.size(); ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "/.lark_index/%016llx.idx", lark_hash64(books[i].second));
+        unlink((fixture_dir + name).c_str());
+    }
+
+    if (!stats_path.empty()) perf_stats_enable(true);
+    main_loop = g_main_loop_new(NULL, FALSE);
+    MusicBackend backend;
+    backend.set_metadata_callback(on_metadata, NULL);
+
+    int failed = 0;
+    for (size_t i = 0; i < books.size(); ++i) {
+        const std::string& path = books[i].second;
+        fprintf(stderr, "Bench: %s\n", path.c_str());
+
+        gint64 meta_cold = time_read_metadata(backend, path);
+        gint64 meta_warm = time_read_metadata(backend, path);
+
+        Result r;
+        if (!run_decoder(path, max_audio, seeks, &r)) {
+            fprintf(stderr, "Bench: Failed to decode %s\n", path.c_str());
+            printf("{\"book\":\"%s\",\"error\":\"decode\"}\n", json_escape(books[i].first).c_str());
+            failed++;
+            continue;
+        }
+
+        std::string power;
+        if (power_seconds > 0) {
+            PowerResult normal, saving;
+            if (run_power(path, false, power_seconds, &normal) && run_power(path, true, power_seconds, &saving)) {
+                power = ",\"power\":{\"default\":" + normal.json() + ",\"power_save\":" + saving.json() + "}";
+            } else {
+                fprintf(stderr, "Bench: No power stats for %s\n", path.c_str());
+            }
+        }
+
+        printf("{\"book\":\"%s\",\"path\":\"%s\",\"duration_s\":%.1f,\"rate\":%u,\"channels\":%u,"
+               "\"audio_s\":%.1f,\"decode_x_realtime\":%.1f,"
+               "\"first_pcm_us\":%lld,"
+               "\"seek_random_us\":%s,\"seek_chapter_us\":%s,"
+               "\"metadata_cold_us\":%lld,\"metadata_warm_us\":%lld%s,\"peak_rss_kb\":%ld}\n",
+               json_escape(books[i].first).c_str(), json_escape(path).c_str(),
+               backend.get_duration() / 1e9, r.rate, r.channels,
+               r.audio_seconds, r.decode_x_realtime,
+               (long long)r.first_pcm_us,
+               r.random_seeks.json().c_str(), r.chapter_seeks.json().c_str(),
+               (long long)meta_cold, (long long)meta_warm, power.c_str(), peak_rss_kb());
+        fflush(stdout);
+    }
+
+    if (!stats_path.empty() && !perf_stats_dump(stats_path)) {
+        fprintf(stderr, "Bench: Failed to write %s\n", stats_path.c_str());
+    }
+    g_main_loop_unref(main_loop);
+    return failed ? 1 : 0;
+}
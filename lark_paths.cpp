@@ -0,0 +1,44 @@
+#include "lark_paths.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pwd.h>
+
+std::string lark_home_dir() {
+    const char *home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        if (pw) home = pw->pw_dir;
+    }
+    return std::string(home ? home : ".");
+}
+
+std::string lark_data_path(const char* name) {
+    return lark_home_dir() + "/" + name;
+}
+
+std::string lark_cache_dir(const char* name) {
+    std::string dir = lark_data_path(name);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        return std::string();
+    }
+    return dir;
+}
+
+unsigned long long lark_hash64(const std::string& data) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < data.size(); ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void lark_set_background_priority() {
+    // Per thread: on Linux, setpriority() on a thread id affects that thread only
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+}
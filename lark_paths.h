@@ -0,0 +1,24 @@
+#ifndef LARK_PATHS_H
+#define LARK_PATHS_H
+
+#include <string>
+
+// Home directory of the current user ($HOME, falling back to the passwd entry)
+std::string lark_home_dir();
+
+// Path of a per-user data file or directory, e.g. lark_data_path(".lark_history")
+std::string lark_data_path(const char* name);
+
+// Directory for a named cache under the home directory (created on demand).
+// Returns an empty string if it cannot be created.
+std::string lark_cache_dir(const char* name);
+
+// Stable 64-bit FNV-1a hash, used to name per-file cache entries
+unsigned long long lark_hash64(const std::string& data);
+
+// Drop the calling thread to the lowest scheduling priority, for background
+// work (library scans, loudness scans) that must never hold up playback or
+// the UI
+void lark_set_background_priority();
+
+#endif // LARK_PATHS_H
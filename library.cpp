@@ -0,0 +1,531 @@
+#include "library.h"
+#include "meta_cache.h"
+#include "mp4_demuxer.h"
+#include "perf_stats.h"
+#include "lark_paths.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <set>
+
+// After a change in a watched directory, wait until it has been quiet this
+// long (a book being copied in fires an event per write)
+static const int RESCAN_QUIET_MS = 3000;
+static const unsigned MAX_SCAN_THREADS = 4;
+
+static bool is_book_name(const char* name) {
+    const char* dot = strrchr(name, '.');
+    return dot && (strcasecmp(dot, ".m4b") == 0 || strcasecmp(dot, ".m4a") == 0
+                   || strcasecmp(dot, ".mp4") == 0);
+}
+
+static bool contains_nocase(const std::string& haystack, const std::string& needle) {
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(),
+                       [](char a, char b) { return tolower((unsigned char)a) == tolower((unsigned char)b); })
+        != haystack.end();
+}
+
+double Library::ScanStats::files_per_second() const {
+    return elapsed_us > 0 ? files * 1e6 / elapsed_us : 0.0;
+}
+
+// --- Scanner pool ---
+
+struct ScanItem {
+    std::string path;
+    bool dir;
+};
+
+struct ScanWorker {
+    std::mutex mutex;
+    std::deque<ScanItem> items; // the owner works at the back, thieves at the front
+    pthread_t thread;
+
+    // Results, merged once all workers are done
+    std::vector<Library::Book> books;
+    std::vector<std::string> dirs;
+    std::vector<std::pair<std::string, std::pair<uint64_t, int64_t> > > unreadable;
+    Library::ScanStats stats;
+};
+
+struct LibraryScan {
+    Library* library;
+    ScanWorker* workers;
+    unsigned count;
+    std::unordered_map<std::string, const Library::Book*> previous;
+
+    std::atomic<unsigned> outstanding; // items queued or being worked on
+    std::atomic<unsigned> idle;
+    std::mutex idle_mutex;
+    std::condition_variable idle_cond;
+
+    std::mutex seen_mutex;
+    std::set<std::pair<dev_t, ino_t> > seen_dirs; // symlink loops end here
+
+    void push(unsigned worker, const std::string& path, bool dir);
+    bool take(unsigned worker, ScanItem* item);
+    void run(unsigned worker);
+    void scan_dir(ScanWorker& w, unsigned worker, const std::string& path);
+    void scan_book(ScanWorker& w, Mp4Demuxer& demuxer, const std::string& path);
+};
+
+void LibraryScan::push(unsigned worker, const std::string& path, bool dir) {
+    ScanItem item = { path, dir };
+    outstanding.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(workers[worker].mutex);
+        workers[worker].items.push_back(item);
+    }
+    if (idle.load() > 0) idle_cond.notify_one();
+}
+
+bool LibraryScan::take(unsigned worker, ScanItem* item) {
+    {
+        // Newest first: stay deep in the tree the owner is walking
+        ScanWorker& own = workers[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.items.empty()) {
+            *item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    // Steal the oldest item of another worker: the biggest piece of work left
+    for (unsigned k = 1; k < count; ++k) {
+        ScanWorker& victim = workers[(worker + k) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            *item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void LibraryScan::run(unsigned worker) {
+    // Every thread parses with its own demuxer, reused from book to book
+    Mp4Demuxer demuxer;
+    ScanItem item;
+    while (!library->cancel) {
+        if (take(worker, &item)) {
+            if (item.dir) {
+                scan_dir(workers[worker], worker, item.path);
+            } else {
+                scan_book(workers[worker], demuxer, item.path);
+            }
+            if (outstanding.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(idle_mutex);
+                idle_cond.notify_all();
+            }
+            continue;
+        }
+        if (outstanding.load() == 0) break;
+
+        // Nothing to steal right now, but a busy worker may still find more
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle.fetch_add(1);
+        idle_cond.wait_for(lock, std::chrono::milliseconds(20));
+        idle.fetch_sub(1);
+    }
+}
+
+void LibraryScan::scan_dir(ScanWorker& w, unsigned worker, const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return;
+    {
+        std::lock_guard<std::mutex> lock(seen_mutex);
+        if (!seen_dirs.insert(std::make_pair(st.st_dev, st.st_ino)).second) return;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    w.stats.dirs++;
+    w.dirs.push_back(path);
+
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL) {
+        // Skips . and .., and hidden directories such as our own caches
+        if (e->d_name[0] == '.') continue;
+        std::string child = path + "/" + e->d_name;
+        bool is_dir = e->d_type == DT_DIR;
+        bool is_file = e->d_type == DT_REG;
+        if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+            if (stat(child.c_str(), &st) != 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        }
+        if (is_dir) {
+            push(worker, child, true);
+        } else if (is_file && is_book_name(e->d_name)) {
+            push(worker, child, false);
+        }
+    }
+    closedir(dir);
+}
+
+void LibraryScan::scan_book(ScanWorker& w, Mp4Demuxer& demuxer, const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return;
+    uint64_t size = (uint64_t)st.st_size;
+    int64_t mtime = (int64_t)st.st_mtime;
+
+    std::unordered_map<std::string, const Library::Book*>::const_iterator it = previous.find(path);
+    if (it != previous.end() && it->second->file_size == size && it->second->file_mtime == mtime) {
+        w.books.push_back(*it->second);
+        w.stats.files++;
+        w.stats.unchanged++;
+        return;
+    }
+    // Known not to be a book, and not touched since
+    std::unordered_map<std::string, std::pair<uint64_t, int64_t> >::const_iterator bad =
+        library->unreadable.find(path);
+    if (bad != library->unreadable.end() && bad->second == std::make_pair(size, mtime)) {
+        w.unreadable.push_back(*bad);
+        w.stats.failed++;
+        return;
+    }
+
+    MetaCache::Entry entry;
+    if (library->cache.lookup(path, size, mtime, &entry)) {
+        w.stats.cached++;
+    } else if (meta_cache_read_book(path.c_str(), demuxer, &entry)) {
+        library->cache.store(path, size, mtime, &entry);
+        demuxer.close();
+        w.stats.parsed++;
+    } else {
+        demuxer.close();
+        w.unreadable.push_back(std::make_pair(path, std::make_pair(size, mtime)));
+        w.stats.failed++;
+        return;
+    }
+
+    Library::Book book;
+    book.path = path;
+    book.title = entry.title;
+    if (book.title.empty()) {
+        size_t slash = path.rfind('/');
+        book.title = path.substr(slash + 1, path.rfind('.') - slash - 1);
+    }
+    book.artist = entry.artist;
+    book.album = entry.album;
+    book.duration = entry.duration;
+    book.chapters = (uint32_t)entry.chapters.size();
+    book.file_size = size;
+    book.file_mtime = mtime;
+    w.books.push_back(book);
+    w.stats.files++;
+}
+
+static void* scan_worker_func(void* arg) {
+    std::pair<LibraryScan*, unsigned>* job = static_cast<std::pair<LibraryScan*, unsigned>*>(arg);
+    lark_set_background_priority();
+    job->first->run(job->second);
+    return NULL;
+}
+
+static bool book_before(const Library::Book& a, const Library::Book& b) {
+    int order = strcasecmp(a.title.c_str(), b.title.c_str());
+    return order != 0 ? order < 0 : a.path < b.path;
+}
+
+// --- Library ---
+
+Library::Library(MetaCache& cache)
+    : cache(cache), snapshot(new std::vector<Book>()), update_callback(NULL), update_user_data(NULL),
+      watch_threads(0), thread(0), thread_started(false), inotify_fd(-1),
+      scanning(false), cancel(false) {
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+Library::~Library() {
+    stop();
+}
+
+void Library::set_update_callback(UpdateCallback callback, void* user_data) {
+    update_callback = callback;
+    update_user_data = user_data;
+}
+
+Library::Snapshot Library::books() const {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return snapshot;
+}
+
+std::vector<Library::Book> Library::search(const std::string& text) const {
+    Snapshot all = books();
+    std::vector<Book> found;
+    for (size_t i = 0; i < all->size(); ++i) {
+        const Book& book = (*all)[i];
+        if (contains_nocase(book.title, text) || contains_nocase(book.artist, text)
+            || contains_nocase(book.album, text)) {
+            found.push_back(book);
+        }
+    }
+    return found;
+}
+
+Library::ScanStats Library::last_scan() const {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return stats;
+}
+
+Library::ScanStats Library::scan(const std::vector<std::string>& dirs, unsigned threads) {
+    return run_scan(dirs, threads, NULL);
+}
+
+Library::ScanStats Library::run_scan(const std::vector<std::string>& dirs, unsigned threads,
+                                     std::vector<std::string>* found_dirs) {
+    std::lock_guard<std::mutex> scan_lock(scan_mutex);
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        // Parsing mostly waits for flash, so two threads help even on one core
+        threads = (unsigned)std::max(2L, std::min((long)MAX_SCAN_THREADS, cpus));
+    }
+    scanning = true;
+    gint64 started = (gint64)(perf_now_ns() / 1000);
+
+    Snapshot old = books();
+    LibraryScan scan;
+    scan.library = this;
+    scan.workers = new ScanWorker[threads];
+    scan.count = threads;
+    scan.outstanding = 0;
+    scan.idle = 0;
+    for (size_t i = 0; i < old->size(); ++i) {
+        scan.previous[(*old)[i].path] = &(*old)[i];
+    }
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        std::string dir = dirs[i];
+        while (dir.size() > 1 && dir[dir.size() - 1] == '/') dir.erase(dir.size() - 1);
+        scan.push((unsigned)(i % threads), dir, true);
+    }
+
+    // The calling thread is worker 0
+    std::vector<std::pair<LibraryScan*, unsigned> > jobs(threads);
+    unsigned started_threads = 1;
+    for (unsigned i = 1; i < threads; ++i) {
+        jobs[i] = std::make_pair(&scan, i);
+        if (pthread_create(&scan.workers[i].thread, NULL, scan_worker_func, &jobs[i]) != 0) {
+            perror("Library: Failed to create scanner thread");
+            break;
+        }
+        started_threads++;
+    }
+    scan.run(0);
+    for (unsigned i = 1; i < started_threads; ++i) {
+        pthread_join(scan.workers[i].thread, NULL);
+    }
+
+    ScanStats result;
+    std::vector<Book>* found = new std::vector<Book>();
+    unreadable.clear();
+    for (unsigned i = 0; i < threads; ++i) {
+        ScanWorker& w = scan.workers[i];
+        found->insert(found->end(), w.books.begin(), w.books.end());
+        if (found_dirs) found_dirs->insert(found_dirs->end(), w.dirs.begin(), w.dirs.end());
+        unreadable.insert(w.unreadable.begin(), w.unreadable.end());
+        result.files += w.stats.files;
+        result.unchanged += w.stats.unchanged;
+        result.cached += w.stats.cached;
+        result.parsed += w.stats.parsed;
+        result.failed += w.stats.failed;
+        result.dirs += w.stats.dirs;
+    }
+    delete[] scan.workers;
+    std::sort(found->begin(), found->end(), book_before);
+    result.threads = started_threads;
+    result.elapsed_us = (gint64)(perf_now_ns() / 1000) - started;
+
+    // An interrupted scan is incomplete: keep the old index
+    bool changed = !cancel && (result.unchanged != result.files || result.files != old->size());
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        if (!cancel) stats = result;
+        if (changed) snapshot = Snapshot(found);
+    }
+    if (!changed) delete found;
+    scanning = false;
+
+    if (!cancel) {
+        g_print("Library: %u books in %u folders in %lld ms (%.0f files/s, %u threads): "
+                "%u parsed, %u from cache, %u unchanged, %u unreadable\n",
+                result.files, result.dirs, (long long)(result.elapsed_us / 1000),
+                result.files_per_second(), result.threads,
+                result.parsed, result.cached, result.unchanged, result.failed);
+    }
+    if (changed && update_callback) {
+        g_idle_add(notify_update_cb, this);
+    }
+    return result;
+}
+
+gboolean Library::notify_update_cb(gpointer data) {
+    Library* self = static_cast<Library*>(data);
+    if (self->update_callback) {
+        self->update_callback(self->update_user_data);
+    }
+    return FALSE;
+}
+
+// --- Background scans ---
+
+bool Library::start(const std::vector<std::string>& dirs, unsigned threads) {
+    if (thread_started) return true;
+    if (pipe(wake_pipe) != 0) {
+        perror("Library: Failed to create pipe");
+        return false;
+    }
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    if (inotify_fd < 0) {
+        g_printerr("Library: Not watching for changes: %s\n", strerror(errno));
+    }
+
+    watch_dirs = dirs;
+    watch_threads = threads;
+    cancel = false;
+    if (pthread_create(&thread, NULL, thread_func, this) != 0) {
+        perror("Library: Failed to create thread");
+        stop();
+        return false;
+    }
+    thread_started = true;
+    return true;
+}
+
+void Library::stop() {
+    if (thread_started) {
+        cancel = true;
+        char c = 'q';
+        if (write(wake_pipe[1], &c, 1) != 1) {
+            g_printerr("Library: Failed to stop scanner\n");
+        }
+        pthread_join(thread, NULL);
+        thread_started = false;
+        cancel = false;
+    }
+    if (inotify_fd >= 0) close(inotify_fd);
+    if (wake_pipe[0] >= 0) close(wake_pipe[0]);
+    if (wake_pipe[1] >= 0) close(wake_pipe[1]);
+    inotify_fd = wake_pipe[0] = wake_pipe[1] = -1;
+    watches.clear();
+}
+
+void Library::rescan() {
+    if (!thread_started) return;
+    char c = 'r';
+    if (write(wake_pipe[1], &c, 1) < 0) {
+        // pipe full: a rescan is already pending
+    }
+}
+
+void* Library::thread_func(void* arg) {
+    lark_set_background_priority();
+    static_cast<Library*>(arg)->watch_loop();
+    return NULL;
+}
+
+// Blocks in poll() between scans: no periodic wakeups
+void Library::watch_loop() {
+    bool scan_due = true;
+    bool changed = false;
+    while (!cancel) {
+        if (scan_due) {
+            scan_due = false;
+            std::vector<std::string> found_dirs;
+            run_scan(watch_dirs, watch_threads, &found_dirs);
+            if (cancel) break;
+            watch_dirs_of(found_dirs);
+        }
+
+        struct pollfd fds[2] = {
+            { wake_pipe[0], POLLIN, 0 },
+            { inotify_fd, POLLIN, 0 },
+        };
+        int n = poll(fds, inotify_fd >= 0 ? 2 : 1, changed ? RESCAN_QUIET_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0) {
+            // Quiet for a while after a change
+            changed = false;
+            scan_due = true;
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char c = 0;
+            if (read(wake_pipe[0], &c, 1) == 1 && c == 'q') break;
+            scan_due = true;
+        }
+        if (inotify_fd >= 0 && (fds[1].revents & POLLIN) && drain_events()) {
+            changed = true;
+        }
+    }
+}
+
+void Library::watch_dirs_of(const std::vector<std::string>& dirs) {
+#ifdef __linux__
+    if (inotify_fd < 0) return;
+    const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                          | IN_DELETE_SELF | IN_ONLYDIR;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        // Watching a directory twice returns the same descriptor
+        int wd = inotify_add_watch(inotify_fd, dirs[i].c_str(), mask);
+        if (wd >= 0) {
+            watches[wd] = dirs[i];
+        } else if (errno == ENOSPC) {
+            g_printerr("Library: Out of inotify watches at %s\n", dirs[i].c_str());
+            return;
+        }
+    }
+#else
+    (void)dirs;
+#endif
+}
+
+// Read all pending events; true if any of them can change the index
+bool Library::drain_events() {
+    bool relevant = false;
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) break;
+        for (char* p = buffer; p < buffer + len; ) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_IGNORED) {
+                watches.erase(event->wd);
+            } else if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF)) {
+                relevant = true;
+            } else if (event->len > 0 && event->name[0] != '.'
+                       && ((event->mask & IN_ISDIR) || is_book_name(event->name))) {
+                // Other files come and go (our own caches live in $HOME)
+                relevant = true;
+            }
+        }
+    }
+#endif
+    return relevant;
+}
@@ -0,0 +1,129 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <glib.h>
+
+class MetaCache;
+
+// Index of the books under the configured library directories.
+//
+// Scans run on a pool of scanner threads that share the walk by work
+// stealing: each thread queues the directories and books it finds on its own
+// deque and takes from its back, and idle threads steal from the front of the
+// others', so one folder holding hundreds of books is still spread over all of
+// them. Each thread parses with its own Mp4Demuxer. Scans are incremental: a
+// book with the size and mtime of the last scan costs one stat(), and one the
+// metadata cache knows is not parsed either. Between scans the directories are
+// watched with inotify where available, and changes trigger a rescan.
+//
+// The index is published as an immutable snapshot, so the UI can list or
+// search it at any time without waiting for a scan.
+class Library {
+public:
+    struct Book {
+        std::string path;
+        std::string title;  // file name when the book has no title tag
+        std::string artist;
+        std::string album;
+        int64_t duration;   // nanoseconds
+        uint32_t chapters;
+        uint64_t file_size;
+        int64_t file_mtime;
+
+        Book() : duration(0), chapters(0), file_size(0), file_mtime(0) {}
+    };
+    // Sorted by title
+    typedef std::shared_ptr<const std::vector<Book> > Snapshot;
+
+    struct ScanStats {
+        unsigned files;     // books found
+        unsigned unchanged; // same size and mtime as in the last scan
+        unsigned cached;    // changed or new, but known to the metadata cache
+        unsigned parsed;    // read with the MP4 parser
+        unsigned failed;    // not a readable MP4 audio file
+        unsigned dirs;
+        unsigned threads;
+        int64_t elapsed_us;
+
+        ScanStats() : files(0), unchanged(0), cached(0), parsed(0), failed(0), dirs(0),
+                      threads(0), elapsed_us(0) {}
+        double files_per_second() const;
+    };
+
+    // Called on the GTK main loop after every scan that changed the index
+    typedef void (*UpdateCallback)(void* user_data);
+
+    // Metadata is looked up in and added to `cache`, which must outlive
+    // the library
+    explicit Library(MetaCache& cache);
+    ~Library();
+
+    void set_update_callback(UpdateCallback callback, void* user_data);
+
+    // Scan `dirs` on a background thread now and again whenever they change.
+    // `threads` scanner threads (0 = one per CPU, two to four).
+    bool start(const std::vector<std::string>& dirs, unsigned threads = 0);
+    void stop();
+    // Ask the background thread for another scan
+    void rescan();
+
+    // Scan `dirs` on the calling thread (plus the pool) and publish the
+    // result; what start() runs in the background
+    ScanStats scan(const std::vector<std::string>& dirs, unsigned threads = 0);
+
+    // The current index; never waits for a running scan
+    Snapshot books() const;
+    // Books whose title, artist or album contains `text`, ignoring case
+    std::vector<Book> search(const std::string& text) const;
+
+    bool is_scanning() const { return scanning; }
+    ScanStats last_scan() const;
+
+private:
+    MetaCache& cache;
+
+    mutable std::mutex snapshot_mutex; // held only to copy or swap these
+    Snapshot snapshot;
+    ScanStats stats;
+
+    UpdateCallback update_callback;
+    void* update_user_data;
+
+    // One scan at a time; these carry over from one to the next
+    std::mutex scan_mutex;
+    std::unordered_map<std::string, std::pair<uint64_t, int64_t> > unreadable; // size, mtime
+
+    // Background scanning and watching
+    std::vector<std::string> watch_dirs;
+    unsigned watch_threads;
+    pthread_t thread;
+    bool thread_started;
+    int wake_pipe[2];
+    int inotify_fd;
+    std::unordered_map<int, std::string> watches; // descriptor -> directory
+    std::atomic<bool> scanning;
+    std::atomic<bool> cancel;
+
+    ScanStats run_scan(const std::vector<std::string>& dirs, unsigned threads,
+                       std::vector<std::string>* found_dirs);
+    static void* thread_func(void* arg);
+    void watch_loop();
+    void watch_dirs_of(const std::vector<std::string>& dirs);
+    bool drain_events();
+    static gboolean notify_update_cb(gpointer data);
+
+    friend struct LibraryScan;
+
+    Library(const Library&);
+    Library& operator=(const Library&);
+};
+
+#endif // LIBRARY_H
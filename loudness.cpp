@@ -0,0 +1,229 @@
+#include "loudness.h"
+#include "mp4_demuxer.h"
+#include <math.h>
+
+extern "C" {
+#include <faad/neaacdec.h>
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const double ABSOLUTE_GATE = -70.0; // LUFS
+static const double RELATIVE_GATE = -10.0; // LU below the ungated level
+
+// Sampled scan of long books
+static const int EXCERPTS = 40;
+static const int64_t EXCERPT_NS = 30LL * 1000000000LL;
+
+// --- Meter ---
+
+LoudnessMeter::LoudnessMeter()
+    : samplerate(0), channels(0), step_frames(0), step_fill(0), step_energy(0), steps_seen(0) {
+    configure(44100, 2);
+}
+
+void LoudnessMeter::configure(unsigned rate, unsigned channel_count) {
+    samplerate = rate > 0 ? rate : 44100;
+    channels = channel_count > 0 ? channel_count : 1;
+
+    // K-weighting from its analog prototype, so any sample rate works:
+    // a +4 dB high shelf (head) followed by a 38 Hz high-pass (RLB)
+    double f0 = 1681.974450955533, gain_db = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / samplerate);
+    double vh = pow(10.0, gain_db / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / samplerate);
+    a0 = 1.0 + k / q + k * k;
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass.a2 = (1.0 - k / q + k * k) / a0;
+
+    step_frames = samplerate / 10;
+    blocks.clear();
+    break_segment();
+}
+
+void LoudnessMeter::break_segment() {
+    state.assign(channels * 4, 0.0);
+    step_fill = 0;
+    step_energy = 0;
+    steps_seen = 0;
+}
+
+// Transposed direct form II
+static inline double run_biquad(double x, double b0, double b1, double b2,
+                                double a1, double a2, double* s) {
+    double y = b0 * x + s[0];
+    s[0] = b1 * x - a1 * y + s[1];
+    s[1] = b2 * x - a2 * y;
+    return y;
+}
+
+void LoudnessMeter::add(const int16_t* pcm, size_t frames) {
+    const Biquad& f1 = shelf;
+    const Biquad& f2 = highpass;
+    for (size_t i = 0; i < frames; ++i) {
+        for (unsigned ch = 0; ch < channels; ++ch) {
+            double* s = &state[ch * 4];
+            double x = pcm[i * channels + ch] / 32768.0;
+            double y = run_biquad(x, f1.b0, f1.b1, f1.b2, f1.a1, f1.a2, s);
+            y = run_biquad(y, f2.b0, f2.b1, f2.b2, f2.a1, f2.a2, s + 2);
+            step_energy += y * y;
+        }
+        if (++step_fill < step_frames) continue;
+
+        // A 100 ms step is done; every full 400 ms window makes a block
+        steps[steps_seen % 4] = step_energy / step_frames;
+        steps_seen++;
+        step_fill = 0;
+        step_energy = 0;
+        if (steps_seen >= 4) {
+            blocks.push_back((steps[0] + steps[1] + steps[2] + steps[3]) / 4.0);
+        }
+    }
+}
+
+static double block_lufs(double mean_square) {
+    return -0.691 + 10.0 * log10(mean_square);
+}
+
+bool LoudnessMeter::integrated(double* lufs) const {
+    // Absolute gate, then a relative gate below the absolutely gated mean
+    double sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (blocks[i] > 0 && block_lufs(blocks[i]) > ABSOLUTE_GATE) {
+            sum += blocks[i];
+            count++;
+        }
+    }
+    if (count == 0) return false;
+
+    double gate = block_lufs(sum / count) + RELATIVE_GATE;
+    sum = 0;
+    count = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (blocks[i] > 0 && block_lufs(blocks[i]) > ABSOLUTE_GATE && block_lufs(blocks[i]) > gate) {
+            sum += blocks[i];
+            count++;
+        }
+    }
+    if (count == 0) return false;
+    *lufs = block_lufs(sum / count);
+    return true;
+}
+
+// --- Scan ---
+
+bool loudness_scan(const char* filepath, double* lufs, const std::atomic<bool>* cancel) {
+    // Own instance: runs next to the playing decoder without sharing state
+    Mp4Demuxer demuxer;
+    if (!demuxer.open(filepath, false)) return false;
+
+    NeAACDecHandle hDecoder = NeAACDecOpen();
+    if (!hDecoder) return false;
+    NeAACDecConfigurationPtr config = NeAACDecGetCurrentConfiguration(hDecoder);
+    config->outputFormat = FAAD_FMT_16BIT;
+    config->downMatrix = 1;
+    NeAACDecSetConfiguration(hDecoder, config);
+
+    std::vector<uint8_t> asc = demuxer.get_asc();
+    unsigned long samplerate;
+    unsigned char channels;
+    if (NeAACDecInit2(hDecoder, &asc[0], asc.size(), &samplerate, &channels) < 0) {
+        NeAACDecClose(hDecoder);
+        return false;
+    }
+
+    LoudnessMeter meter;
+    meter.configure(samplerate, channels);
+
+    // Whole book if it is short, else excerpts from all over it
+    const SeekIndex& index = demuxer.get_index();
+    int64_t duration = demuxer.get_duration();
+    int excerpts = duration > EXCERPTS * EXCERPT_NS ? EXCERPTS : 1;
+    int64_t length = excerpts > 1 ? EXCERPT_NS : duration;
+
+    bool ok = true;
+    for (int e = 0; e < excerpts && ok; ++e) {
+        int64_t start = excerpts > 1 ? duration / excerpts * e + (duration / excerpts - length) / 2 : 0;
+        uint32_t first = index.frame_for_time(start);
+        uint32_t last = index.frame_for_time(start + length);
+        // Decode one frame ahead to prime FAAD's overlap, as a seek does
+        uint32_t prime = first > 0 ? first - 1 : 0;
+        if (!demuxer.seek(prime)) break;
+        NeAACDecPostSeekReset(hDecoder, (long)prime);
+        meter.break_segment();
+
+        for (uint32_t f = prime; f <= last; ++f) {
+            if (cancel && cancel->load()) {
+                ok = false;
+                break;
+            }
+            if (!demuxer.read_frame()) break;
+            NeAACDecFrameInfo info;
+            void* pcm = NeAACDecDecode(hDecoder, &info, const_cast<unsigned char*>(demuxer.frame_data()),
+                                       demuxer.frame_size());
+            bool priming = f == prime && prime != first;
+            if (info.error > 0 || info.samples == 0 || priming) continue;
+            unsigned long ch = info.channels > 0 ? info.channels : 1;
+            if (ch != channels || info.samplerate != samplerate) {
+                // HE-AAC reports its real output format only on the first frame
+                channels = (unsigned char)ch;
+                samplerate = info.samplerate;
+                meter.configure(samplerate, channels);
+            }
+            meter.add(static_cast<const int16_t*>(pcm), info.samples / ch);
+        }
+    }
+
+    NeAACDecClose(hDecoder);
+    return ok && meter.integrated(lufs);
+}
+
+// --- Gain ---
+
+void loudness_apply_gain(int16_t* pcm, size_t samples, int32_t gain_q12) {
+    size_t i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int16x4_t g = vdup_n_s16((int16_t)gain_q12);
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vld1q_s16(pcm + i);
+        // Widening multiply, then rounding saturating narrow: gain and clip
+        int16x4_t lo = vqrshrn_n_s32(vmull_s16(vget_low_s16(v), g), 12);
+        int16x4_t hi = vqrshrn_n_s32(vmull_s16(vget_high_s16(v), g), 12);
+        vst1q_s16(pcm + i, vcombine_s16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i g = _mm_set1_epi16((int16_t)gain_q12);
+    __m128i round = _mm_set1_epi32(1 << 11);
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pcm + i));
+        __m128i plo = _mm_mullo_epi16(v, g);
+        __m128i phi = _mm_mulhi_epi16(v, g);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(plo, phi), round), 12);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(plo, phi), round), 12);
+        // Saturating pack does the clipping
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pcm + i), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for (; i < samples; ++i) {
+        int32_t v = (pcm[i] * gain_q12 + (1 << 11)) >> 12;
+        pcm[i] = (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Integrated loudness after ITU-R BS.1770 / EBU R128: K-weighting, 400 ms
+// blocks every 100 ms, an absolute gate at -70 LUFS and a relative gate
+// 10 LU below the ungated level. Input is interleaved 16-bit PCM; every
+// channel is weighted 1.0 (audiobooks are mono or stereo).
+class LoudnessMeter {
+public:
+    LoudnessMeter();
+
+    void configure(unsigned samplerate, unsigned channels);
+    void add(const int16_t* pcm, size_t frames);
+    // The next add() continues elsewhere in the file: restart the filters
+    // and the block in progress, keep what was measured
+    void break_segment();
+
+    // Integrated loudness in LUFS; false if nothing above the gates
+    bool integrated(double* lufs) const;
+
+private:
+    struct Biquad {
+        double b0, b1, b2, a1, a2;
+    };
+    unsigned samplerate;
+    unsigned channels;
+    Biquad shelf;
+    Biquad highpass;
+    std::vector<double> state; // two per filter and channel
+
+    size_t step_frames;        // 100 ms
+    size_t step_fill;
+    double step_energy;        // sum of squares in the current 100 ms
+    double steps[4];           // the last four 100 ms energies
+    size_t steps_seen;
+    std::vector<double> blocks; // mean square of each 400 ms block
+};
+
+// Measure `filepath` with its own demuxer and decoder. Long books are
+// sampled: up to 40 evenly spaced 30-second excerpts. Returns false on
+// error, when `cancel` is set, or if the book is all silence.
+bool loudness_scan(const char* filepath, double* lufs, const std::atomic<bool>* cancel);
+
+// Normalization gain in Q12 (4096 = unity) applied to PCM in place, with
+// saturation. One fused NEON/SSE2 multiply, round, shift and clip per sample.
+static const int32_t LOUDNESS_UNITY_GAIN = 4096;
+void loudness_apply_gain(int16_t* pcm, size_t samples, int32_t gain_q12);
+
+#endif // LOUDNESS_H
@@ -11,9 +11,15 @@
 #include <fstream>
 
 //#include <iostream>
-#include <map>
 
 #include "music_backend.h"
+#include "library.h"
+#include "history_store.h"
+#include "history_dialog.h"
+#include "chapters_dialog.h"
+#include "lark_paths.h"
+#include "cover_cache.h"
+#include "perf_stats.h"
 #include "openlipc/openlipc.h"
 
 // Assets
@@ -30,8 +36,11 @@
 
 #define DESKTOP_W_SIZE 600
 #define DESKTOP_H_SIZE 800
+#define COVER_W_SIZE 350
+#define COVER_H_SIZE 450
 
 MusicBackend backend;
+Library library(backend.get_meta_cache());
 GtkWidget *window;
 GtkWidget *progress_bar;
 GtkWidget *time_label;
@@ -39,12 +48,12 @@ GtkWidget *cover_image;
 GtkWidget *title_label;
 GtkWidget *artist_label;
 GtkWidget *album_label;
+GtkWidget *chapter_button;
 GtkWidget *play_pause_btn;
 
 bool user_is_seeking = false;
 std::string current_file;
 int last_timestamp = 0;
-std::map<std::string, int> playback_history;
 int flIntensity = 0;
 bool dispUpdate=true;
 
@@ -105,67 +114,93 @@ void set_button_icon(GtkWidget *button, const unsigned char *icon_data) {
     gtk_widget_show(image); // Important to show the new image
 }
 
-// State file path
-std::string get_history_file_path() {
-    const char *home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        if (pw) home = pw->pw_dir;
+// --- Playback history ---
+// Positions go to an append-only journal (see HistoryStore and
+// PlaybackJournal): checkpointed every few seconds while playing, and on
+// pause, book change and exit.
+
+#define CHECKPOINT_SECONDS 5
+
+HistoryStore history;
+static guint checkpoint_source = 0;
+
+// History before the journal: "last played file" (or NONE), then "path|seconds"
+static void import_legacy_history(const std::string& path) {
+    std::ifstream in(path);
+    if (!in.is_open()) return;
+    std::string line;
+    std::string last;
+    long last_seconds = 0;
+    if (std::getline(in, line) && line != "NONE") last = line;
+    while (std::getline(in, line)) {
+        size_t delimiter = line.rfind('|');
+        if (delimiter == std::string::npos) continue;
+        char *end;
+        long seconds = strtol(line.c_str() + delimiter + 1, &end, 10);
+        if (end == line.c_str() + delimiter + 1 || seconds < 0) continue;
+        std::string file = line.substr(0, delimiter);
+        if (file != last) history.record(file, (int64_t)seconds * 1000);
+        else last_seconds = seconds;
     }
-    return std::string(home ? home : ".") + "/.lark_history";
+    // The last played file goes last: that makes it the current one
+    if (!last.empty()) history.record(last, (int64_t)last_seconds * 1000);
+    history.sync();
+    g_print("Imported playback history from %s\n", path.c_str());
 }
 
-void save_history() {
-    // Update current file in history
-    if (!current_file.empty()) {
-        gint64 pos = backend.get_position() / GST_SECOND;
-        playback_history[current_file] = (int)pos;
-    }
-    g_print("Saving playback history to disk %s %d\n",current_file.c_str(), last_timestamp);
-    std::string path = get_history_file_path();
-    std::ofstream out(path);
-    if (out.is_open()) {
-        // Write the last played file first (as a simple convention or separate line?)
-        // Requirement: "reopen the last played file".
-        // Let's print the current_file name on the first line as a marker, then the list.
-        out << (current_file.empty() ? "NONE" : current_file) << "\n";
-        
-        for (auto const& item : playback_history) {
-            out << item.first << "|" << item.second << "\n";
-        }
-        out.close();
+// Record where the current book is; cheap enough to run every few seconds
+void checkpoint_position() {
+    if (current_file.empty() || !(backend.is_playing || backend.is_paused)) return;
+    gint64 pos = backend.get_position();
+    int chapter = backend.meta_filepath == current_file ? backend.chapters.find(pos) : -1;
+    history.record(current_file, pos / GST_MSECOND, chapter);
+}
+
+static gboolean on_checkpoint_timer(gpointer data) {
+    (void)data;
+    checkpoint_position();
+    return TRUE;
+}
+
+// Checkpoint while audio plays; on pause or stop record once more and sync
+void schedule_checkpoint() {
+    bool wanted = backend.is_playing && !backend.is_paused;
+    if (wanted && checkpoint_source == 0) {
+        checkpoint_source = g_timeout_add_seconds(CHECKPOINT_SECONDS, on_checkpoint_timer, NULL);
+    } else if (!wanted && checkpoint_source != 0) {
+        g_source_remove(checkpoint_source);
+        checkpoint_source = 0;
+        checkpoint_position();
+        history.sync();
     }
 }
 
+void save_history() {
+    checkpoint_position();
+    g_print("Saving playback history to disk %s %d\n", current_file.c_str(), last_timestamp);
+    history.sync();
+}
+
 void load_history() {
-    std::string path = get_history_file_path();
-    std::ifstream in(path);
-    if (in.is_open()) {
-        std::string line;
-        // First line is last played file
-        if (std::getline(in, line)) {
-            if (line != "NONE") {
-                current_file = line;
-            }
-        }
-        
-        while (std::getline(in, line)) {
-            size_t delimiter = line.find('|');
-            if (delimiter != std::string::npos) {
-                std::string file = line.substr(0, delimiter);
-                int time = std::stoi(line.substr(delimiter + 1));
-                playback_history[file] = time;
-            }
-        }
-        in.close();
+    history.open(lark_data_path(".lark_journal"));
+    if (history.empty()) {
+        import_legacy_history(lark_data_path(".lark_history"));
     }
-    
+    current_file = history.current();
+
     // Set last_timestamp if current_file exists in history
-    if (!current_file.empty() && playback_history.count(current_file)) {
-        last_timestamp = playback_history[current_file];
+    const HistoryStore::Entry *entry = history.find(current_file);
+    if (entry) {
+        last_timestamp = (int)(entry->position / 1000);
     }
 }
 
+static void on_cover_ready(GdkPixbuf *cover, gpointer) {
+    if (!cover) return;
+    gtk_image_set_from_pixbuf(GTK_IMAGE(cover_image), cover);
+    g_object_unref(cover);
+}
+
 void update_metadata_ui() {
     if (!backend.meta_title.empty()) {
         char *markup = g_markup_printf_escaped("<span font_desc='Sans Bold 24'>%s</span>", backend.meta_title.c_str());
@@ -183,45 +218,141 @@ void update_metadata_ui() {
         gtk_label_set_text(GTK_LABEL(artist_label), "");
     }
 
-    if (!backend.cover_art.empty()) {
-        GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
-        gdk_pixbuf_loader_write(loader, backend.cover_art.data(), backend.cover_art.size(), NULL);
-        gdk_pixbuf_loader_close(loader, NULL);
-        GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
-        if (pixbuf) {
-            // Scale to fit nice and large
-            GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pixbuf, 350, 450, GDK_INTERP_BILINEAR);
-            gtk_image_set_from_pixbuf(GTK_IMAGE(cover_image), scaled);
-            g_object_unref(scaled);
-        }
-        g_object_unref(loader);
-    } else {
-        gtk_image_clear(GTK_IMAGE(cover_image));
+    // Fetched, decoded at display size and dithered on a background thread;
+    // on_cover_ready() shows it once it is there
+    gtk_image_clear(GTK_IMAGE(cover_image));
+    if (backend.cover_size > 0) {
+        cover_cache_get_async(backend.meta_filepath, backend.cover_offset, backend.cover_size,
+                              COVER_W_SIZE, COVER_H_SIZE, on_cover_ready, NULL);
     }
 }
 
-gboolean update_ui(gpointer data) {
-    if (!backend.is_playing && !backend.is_paused) return TRUE;
+// --- UI refresh ---
+// The time label is refreshed by a timer that only runs while audio is
+// actually playing and the screen is on; every state change refreshes once
+// right away. Text that did not change is not set again, since each label
+// update costs an e-ink redraw and a CPU wakeup.
 
-    gint64 pos = backend.get_position();
-    gint64 len = backend.get_duration();
+#define UI_REFRESH_SECONDS 1
+
+static guint refresh_period = UI_REFRESH_SECONDS; // seconds, LARK_REFRESH_SECONDS
+static guint refresh_source = 0;
+static bool screen_on = true;
+static std::string shown_time;
+static std::string shown_chapter;
 
-    // Format: 00:01:23 / 02:10:20
+static void format_time(char *buf, size_t size, gint64 pos, gint64 len) {
     int pos_sec = pos / GST_SECOND;
     int len_sec = len / GST_SECOND;
+    if (refresh_period >= 60) {
+        // Seconds would be stale most of the time: 01:23 / 02:10
+        snprintf(buf, size, "%02d:%02d / %02d:%02d",
+                 pos_sec / 3600, (pos_sec % 3600) / 60,
+                 len_sec / 3600, (len_sec % 3600) / 60);
+    } else {
+        // Format: 00:01:23 / 02:10:20
+        snprintf(buf, size, "%02d:%02d:%02d / %02d:%02d:%02d",
+                 pos_sec / 3600, (pos_sec % 3600) / 60, pos_sec % 60,
+                 len_sec / 3600, (len_sec % 3600) / 60, len_sec % 60);
+    }
+}
+
+// "Title  00:04:12 / 00:21:30" for the chapter at `pos`, empty outside any
+static std::string format_chapter(gint64 pos) {
+    if (backend.meta_filepath != current_file) return std::string();
+    int index = backend.chapters.find(pos);
+    if (index < 0) return std::string();
     char buf[64];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d / %02d:%02d:%02d", 
-             pos_sec / 3600, (pos_sec % 3600) / 60, pos_sec % 60,
-             len_sec / 3600, (len_sec % 3600) / 60, len_sec % 60);
-    
-    // Update the label inside the frame
-    if(dispUpdate)
+    format_time(buf, sizeof(buf), backend.chapters.offset(pos), backend.chapters.length(index));
+    return backend.chapters.title(index) + "  " + buf;
+}
+
+void refresh_ui() {
+    char buf[64];
+    std::string chapter;
+    if (!dispUpdate) {
+        snprintf(buf, sizeof(buf), "          ");
+    } else {
+        gint64 pos = (backend.is_playing || backend.is_paused) ? backend.get_position()
+                                                                : (gint64)last_timestamp * GST_SECOND;
+        format_time(buf, sizeof(buf), pos, backend.get_duration());
+        chapter = format_chapter(pos);
+    }
+    if (shown_time == buf && shown_chapter == chapter) return;
+
+    // Everything changed in one refresh goes out as a single redraw; a
+    // label set to the text it already shows would still be redrawn
+    GdkWindow *gdk_window = gtk_widget_get_window(window);
+    if (gdk_window) gdk_window_freeze_updates(gdk_window);
+    if (shown_time != buf) {
+        shown_time = buf;
         gtk_label_set_text(GTK_LABEL(time_label), buf);
-    else
-        gtk_label_set_text(GTK_LABEL(time_label), "          ");
+    }
+    if (shown_chapter != chapter) {
+        shown_chapter = chapter;
+        gtk_button_set_label(GTK_BUTTON(chapter_button), chapter.c_str());
+    }
+    if (gdk_window) gdk_window_thaw_updates(gdk_window);
+}
+
+static gboolean on_refresh_timer(gpointer data) {
+    (void)data;
+    refresh_ui();
     return TRUE;
 }
 
+// Start or stop the refresh timer to match the current state
+void schedule_refresh() {
+    bool wanted = screen_on && dispUpdate && backend.is_playing && !backend.is_paused;
+    if (wanted && refresh_source == 0) {
+        // Second-granularity timers are grouped with other wakeups by GLib
+        refresh_source = g_timeout_add_seconds(refresh_period, on_refresh_timer, NULL);
+    } else if (!wanted && refresh_source != 0) {
+        g_source_remove(refresh_source);
+        refresh_source = 0;
+    }
+    if (screen_on) refresh_ui();
+}
+
+static void on_metadata_ready(void *) {
+    g_print("Metadata read: Title='%s', Artist='%s', Album='%s'\n",
+            backend.meta_title.c_str(),
+            backend.meta_artist.c_str(),
+            backend.meta_album.c_str());
+    // Lets the history dialog show how far along each book is
+    history.set_duration(backend.meta_filepath, backend.get_duration() / GST_MSECOND);
+    update_metadata_ui();
+    // The chapter line depends on the chapters just read
+    if (screen_on) refresh_ui();
+}
+
+static void on_backend_state(void *) {
+    schedule_refresh();
+    schedule_checkpoint();
+}
+
+static gboolean on_screen_event(gpointer data) {
+    screen_on = GPOINTER_TO_INT(data) != 0;
+    g_print("Screen %s\n", screen_on ? "on" : "off");
+    schedule_refresh();
+    return FALSE;
+}
+
+// powerd events arrive on the LIPC thread; hand them to the main loop
+static LIPCcode on_powerd_event(LIPC *lipc, const char *name, LIPCevent *event, void *data) {
+    (void)lipc;
+    (void)event;
+    (void)data;
+    bool on = strcmp(name, "outOfScreenSaver") == 0;
+    g_idle_add(on_screen_event, GINT_TO_POINTER(on ? 1 : 0));
+    return LIPC_OK;
+}
+
+void subscribePowerEvents() {
+    LipcSubscribeExt(lipcInstance, "com.lab126.powerd", "goingToScreenSaver", on_powerd_event, NULL);
+    LipcSubscribeExt(lipcInstance, "com.lab126.powerd", "outOfScreenSaver", on_powerd_event, NULL);
+}
+
 void on_play_pause_clicked(GtkWidget *widget, gpointer data) {
     if (backend.is_playing) {
         backend.pause();
@@ -260,8 +391,32 @@ void jump_relative(int seconds) {
     // Update global state
     last_timestamp = new_pos;
     
-    // Restart playback at new position
-    backend.play_file(current_file.c_str(), new_pos);
+    if (backend.is_playing || backend.is_paused) {
+        // Seek inside the running decoder, keeping pipeline and file open
+        backend.seek(new_pos);
+    } else {
+        backend.play_file(current_file.c_str(), new_pos);
+    }
+}
+
+// data: +1 for the next chapter, -1 for the previous one (or the start of
+// this one, a few seconds in)
+void on_chapter_step_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget;
+    if (current_file.empty() || backend.meta_filepath != current_file) return;
+    gint64 pos = (backend.is_playing || backend.is_paused) ? backend.get_position()
+                                                           : (gint64)last_timestamp * GST_SECOND;
+    int index = GPOINTER_TO_INT(data) > 0 ? backend.chapters.next(pos) : backend.chapters.previous(pos);
+    if (index < 0) return;
+    last_timestamp = (int)(backend.chapters.start(index) / GST_SECOND);
+    backend.play_chapter(index);
+}
+
+void on_chapters_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget;
+    (void)data;
+    if (backend.meta_filepath != current_file) return;
+    show_chapters_dialog(GTK_WINDOW(window), &backend);
 }
 
 void on_fl_clicked(GtkWidget *widget, gpointer data) {
@@ -281,6 +436,24 @@ void on_displayUpdate_clicked(GtkWidget *widget, gpointer data) {
     (void)widget;
     (void)data;
     dispUpdate = !(dispUpdate);
+    schedule_refresh();
+}
+
+// Playback speeds the speed button cycles through, per mille
+static const int SPEED_STEPS[] = { 1000, 1250, 1500, 1750, 2000, 2500, 3000 };
+
+void on_speed_clicked(GtkWidget *widget, gpointer data) {
+    (void)data;
+    size_t count = sizeof(SPEED_STEPS) / sizeof(SPEED_STEPS[0]);
+    size_t next = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (SPEED_STEPS[i] == backend.get_speed()) next = (i + 1) % count;
+    }
+    backend.set_speed(SPEED_STEPS[next]);
+
+    char label[16];
+    snprintf(label, sizeof(label), "%gx", SPEED_STEPS[next] / 1000.0);
+    gtk_button_set_label(GTK_BUTTON(widget), label);
 }
 
 void on_rewind_clicked(GtkWidget *widget, gpointer data) {
@@ -297,6 +470,12 @@ void on_destroy(GtkWidget *widget, gpointer data) {
     enableSleep();
     closeLipcInstance();
     save_history();
+    library.stop();
+    perf_stats_stop_server();
+    if (backend.get_silence_saved() > 0) {
+        g_print("Skipping silence saved %lld s of listening\n",
+                (long long)(backend.get_silence_saved() / GST_SECOND));
+    }
     gtk_main_quit();
 }
 
@@ -309,37 +488,25 @@ void on_file_open(const char* filepath) {
     
     // Save position of current file before switching
     // Only save if we were actually playing/paused, to avoid overwriting history with 0 on startup
-    if (!current_file.empty() && (backend.is_playing || backend.is_paused)) {
-        gint64 pos = backend.get_position() / GST_SECOND;
-        playback_history[current_file] = (int)pos;
-        // Optionally save to disk immediately?
-        // save_history(); 
-    }
+    checkpoint_position();
 
-    // Stop playback first to release the global mp4read lock
-    backend.stop();
-    
     current_file = filepath;
     
     // Look up in history
-    if (playback_history.count(filepath)) {
-        last_timestamp = playback_history[filepath];
-    } else {
-        last_timestamp = 0;
-    }
+    const HistoryStore::Entry *entry = history.find(current_file);
+    last_timestamp = entry ? (int)(entry->position / 1000) : 0;
+    // The new book is the one to reopen from now on
+    history.record(current_file, (gint64)last_timestamp * 1000, entry ? entry->chapter : -1);
 
+    // Both run on the backend thread, in order; the UI is refreshed from
+    // on_metadata_ready() when the tags arrive
     g_print("Reading metadata for %s\n", filepath);
     backend.read_metadata(filepath);
-    g_print("Metadata read: Title='%s', Artist='%s', Album='%s'\n",
-            backend.meta_title.c_str(),
-            backend.meta_artist.c_str(),
-            backend.meta_album.c_str());
-    update_metadata_ui();
     g_print("Starting playback for %s at %d seconds\n", filepath, last_timestamp);
     backend.play_file(filepath, last_timestamp);
 }
 
-void on_open_dialog_clicked(GtkWidget *widget, gpointer data) {
+void open_file_chooser() {
     GtkWidget *dialog;
     dialog = gtk_file_chooser_dialog_new("L:A_N:application_PC:TS_ID:com.kbarni.m4bplayer",
                                          GTK_WINDOW(window),
@@ -358,55 +525,162 @@ void on_open_dialog_clicked(GtkWidget *widget, gpointer data) {
     gtk_widget_destroy(dialog);
 }
 
-void on_history_clicked(GtkWidget *widget, gpointer data) {
+// --- Library ---
+// The list shows the library's current snapshot and is refilled when a
+// background scan changes it while the dialog is open.
+
+#define RESPONSE_BROWSE 1
+
+static GtkListStore *library_store = NULL; // while the dialog is open
+
+static void fill_library_store(GtkListStore *store) {
+    Library::Snapshot books = library.books();
+    gtk_list_store_clear(store);
+    for (size_t i = 0; i < books->size(); ++i) {
+        const Library::Book &book = (*books)[i];
+        gint64 minutes = book.duration / (60 * GST_SECOND);
+        char length[16];
+        snprintf(length, sizeof(length), "%lld:%02lld", (long long)(minutes / 60), (long long)(minutes % 60));
+        GtkTreeIter iter;
+        gtk_list_store_append(store, &iter);
+        gtk_list_store_set(store, &iter, 0, book.title.c_str(), 1, book.artist.c_str(),
+                           2, length, 3, book.path.c_str(), -1);
+    }
+}
+
+static void on_library_updated(void *) {
+    if (library_store) fill_library_store(library_store);
+}
+
+void on_open_dialog_clicked(GtkWidget *widget, gpointer data) {
+    // Nothing found (yet): pick a file directly
+    if (library.books()->empty() && !library.is_scanning()) {
+        open_file_chooser();
+        return;
+    }
+
     GtkWidget *dialog = gtk_dialog_new_with_buttons("L:A_N:application_PC:TS_ID:com.kbarni.m4bplayer",
                                                      GTK_WINDOW(window),
                                                      GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                     "Browse...", RESPONSE_BROWSE,
                                                      GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
                                                      GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT,
                                                      NULL);
-    
+
     GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
     GtkWidget *tree_view = gtk_tree_view_new();
-    GtkListStore *store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_INT); // File, Timestamp
-    
-    for (auto const& item : playback_history) {
-        GtkTreeIter iter;
-        gtk_list_store_append(store, &iter);
-        gtk_list_store_set(store, &iter, 0, item.first.c_str(), 1, item.second, -1);
-    }
-    
-    gtk_tree_view_set_model(GTK_TREE_VIEW(tree_view), GTK_TREE_MODEL(store));
-    
+    library_store = gtk_list_store_new(4, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING); // Title, Author, Length, Path
+    fill_library_store(library_store);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(tree_view), GTK_TREE_MODEL(library_store));
+
     GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
-    GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes("File", renderer, "text", 0, NULL);
-    gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), column);
-    
-    // Time column
-    // Ideally format it, but raw int for now is fine or use cell data func
-    
-    gtk_container_add(GTK_CONTAINER(content_area), tree_view);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view),
+        gtk_tree_view_column_new_with_attributes("Title", renderer, "text", 0, NULL));
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view),
+        gtk_tree_view_column_new_with_attributes("Author", renderer, "text", 1, NULL));
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view),
+        gtk_tree_view_column_new_with_attributes("Length", renderer, "text", 2, NULL));
+
+    // Hundreds of books: scroll
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(scroll, DESKTOP_W_SIZE - 40, DESKTOP_H_SIZE - 200);
+    gtk_container_add(GTK_CONTAINER(scroll), tree_view);
+    gtk_container_add(GTK_CONTAINER(content_area), scroll);
     gtk_widget_show_all(dialog);
 
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+    // Pick up books added since the last scan; the list refills if any were
+    library.rescan();
+
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+    std::string chosen;
+    if (response == GTK_RESPONSE_ACCEPT) {
         GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree_view));
         GtkTreeIter iter;
         GtkTreeModel *model;
         if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
             char *file;
-            gtk_tree_model_get(model, &iter, 0, &file, -1);
-            on_file_open(file);
+            gtk_tree_model_get(model, &iter, 3, &file, -1);
+            chosen = file;
             g_free(file);
         }
     }
-    
+
     gtk_widget_destroy(dialog);
+    g_object_unref(library_store);
+    library_store = NULL;
+
+    if (!chosen.empty()) {
+        on_file_open(chosen.c_str());
+    } else if (response == RESPONSE_BROWSE) {
+        open_file_chooser();
+    }
+}
+
+void on_history_clicked(GtkWidget *widget, gpointer data) {
+    std::string chosen = show_history_dialog(GTK_WINDOW(window), history);
+    if (!chosen.empty()) {
+        on_file_open(chosen.c_str());
+    }
 }
 
 int main(int argc, char *argv[]) {
     gtk_init(&argc, &argv);
 
     load_history();
+    backend.set_metadata_callback(on_metadata_ready, NULL);
+    backend.set_state_callback(on_backend_state, NULL);
+
+    const char *refresh_env = getenv("LARK_REFRESH_SECONDS");
+    if (refresh_env && atoi(refresh_env) > 0) {
+        refresh_period = (guint)atoi(refresh_env);
+    }
+    // Cut pauses longer than this many milliseconds down to that length
+    const char *silence_env = getenv("LARK_SKIP_SILENCE_MS");
+    if (silence_env && atoi(silence_env) > 0) {
+        backend.set_skip_silence(atoi(silence_env));
+    }
+    // Resample every book to the speaker's native rate, e.g. 48000
+    const char *rate_env = getenv("LARK_OUTPUT_RATE");
+    if (rate_env && atoi(rate_env) > 0) {
+        backend.set_output_rate((unsigned)atoi(rate_env));
+    }
+    // Megabytes of recently decoded audio kept for instant rewinds; 0 = off
+    const char *rewind_env = getenv("LARK_REWIND_MB");
+    if (rewind_env && *rewind_env) {
+        backend.set_rewind_memory((size_t)atoi(rewind_env) * 1024 * 1024);
+    }
+    // Decode in 90 s bursts and let the CPU idle in between (more RAM)
+    const char *power_env = getenv("LARK_POWER_SAVE");
+    if (power_env && atoi(power_env) > 0) {
+        backend.set_power_save(true);
+    }
+    // Output: gst (default), alsa[:DEVICE], wav:PATH or null
+    const char *sink_env = getenv("LARK_SINK");
+    if (sink_env && *sink_env) {
+        backend.set_audio_sink(sink_env);
+    }
+    // Where to look for books: LARK_LIBRARY=/mnt/us/audiobooks:/mnt/us/music
+    // (default: the home directory). Scanned in the background and watched.
+    std::vector<std::string> library_dirs;
+    const char *library_env = getenv("LARK_LIBRARY");
+    std::string library_spec = (library_env && *library_env) ? library_env : lark_home_dir();
+    for (size_t pos = 0; pos <= library_spec.size(); ) {
+        size_t colon = library_spec.find(':', pos);
+        if (colon == std::string::npos) colon = library_spec.size();
+        if (colon > pos) library_dirs.push_back(library_spec.substr(pos, colon - pos));
+        pos = colon + 1;
+    }
+    library.set_update_callback(on_library_updated, NULL);
+    library.start(library_dirs);
+    // Decoder and sink timings for stutter reports: connect to the socket
+    // (e.g. socat - UNIX-CONNECT:~/.lark_stats.sock) or send SIGUSR1 for a
+    // dump in ~/.lark_stats
+    const char *stats_env = getenv("LARK_STATS");
+    if (stats_env && atoi(stats_env) > 0) {
+        perf_stats_enable(true);
+        perf_stats_start_server(lark_data_path(".lark_stats.sock"), lark_data_path(".lark_stats"));
+    }
     if (argc > 1) {
         current_file = argv[1];
         last_timestamp = 0;
@@ -414,6 +688,7 @@ int main(int argc, char *argv[]) {
 
     openLipcInstance();
     disableSleep();
+    subscribePowerEvents();
     LipcGetIntProperty(lipcInstance,"com.lab126.powerd","flIntensity",&flIntensity);
 
     LipcSetIntProperty(lipcInstance,"com.lab126.btfd","ensureBTconnection",1);
@@ -465,6 +740,12 @@ int main(int argc, char *argv[]) {
     gtk_label_set_justify(GTK_LABEL(artist_label), GTK_JUSTIFY_CENTER);
     gtk_box_pack_start(GTK_BOX(mid_vbox), artist_label, FALSE, FALSE, 0);
 
+    // Current chapter and the time in it; opens the chapter list
+    chapter_button = gtk_button_new_with_label("");
+    gtk_button_set_relief(GTK_BUTTON(chapter_button), GTK_RELIEF_NONE);
+    g_signal_connect(chapter_button, "clicked", G_CALLBACK(on_chapters_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(mid_vbox), chapter_button, FALSE, FALSE, 0);
+
     // Time Display (Frame with label inside)
     GtkWidget *time_align = gtk_alignment_new(0.5, 0, 0, 0);
     GtkWidget *time_frame = gtk_frame_new(NULL);
@@ -492,6 +773,11 @@ int main(int argc, char *argv[]) {
     gtk_container_add(GTK_CONTAINER(controls_align), controls_hbox);
     gtk_box_pack_start(GTK_BOX(mid_vbox), controls_align, FALSE, FALSE, 0);
 
+    GtkWidget *prev_btn = gtk_button_new_with_label("|<");
+    gtk_widget_set_size_request(prev_btn, 60, 80);
+    g_signal_connect(prev_btn, "clicked", G_CALLBACK(on_chapter_step_clicked), GINT_TO_POINTER(-1));
+    gtk_box_pack_start(GTK_BOX(controls_hbox), prev_btn, FALSE, FALSE, 0);
+
     GtkWidget *rw_btn = create_button_from_icon(fast_rewind_icon, 10);
     gtk_widget_set_size_request(rw_btn, 80, 80);
     g_signal_connect(rw_btn, "clicked", G_CALLBACK(on_rewind_clicked), NULL);
@@ -507,6 +793,11 @@ int main(int argc, char *argv[]) {
     g_signal_connect(ff_btn, "clicked", G_CALLBACK(on_ff_clicked), NULL);
     gtk_box_pack_start(GTK_BOX(controls_hbox), ff_btn, FALSE, FALSE, 0);
 
+    GtkWidget *next_btn = gtk_button_new_with_label(">|");
+    gtk_widget_set_size_request(next_btn, 60, 80);
+    g_signal_connect(next_btn, "clicked", G_CALLBACK(on_chapter_step_clicked), GINT_TO_POINTER(1));
+    gtk_box_pack_start(GTK_BOX(controls_hbox), next_btn, FALSE, FALSE, 0);
+
 
     // --- BOTTOM BUTTONS ---
     GtkWidget *bot_hbox = gtk_hbox_new(FALSE, 10);
@@ -523,6 +814,11 @@ int main(int argc, char *argv[]) {
     g_signal_connect(btn_history, "clicked", G_CALLBACK(on_history_clicked), NULL);
     gtk_box_pack_start(GTK_BOX(bot_hbox), btn_history, FALSE, FALSE, 0);
 
+    GtkWidget *btn_speed = gtk_button_new_with_label("1x");
+    gtk_widget_set_size_request(btn_speed, 80, 80);
+    g_signal_connect(btn_speed, "clicked", G_CALLBACK(on_speed_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(bot_hbox), btn_speed, FALSE, FALSE, 0);
+
     // Spacer
     GtkWidget *spacer = gtk_label_new("");
     gtk_box_pack_start(GTK_BOX(bot_hbox), spacer, TRUE, TRUE, 0);
@@ -556,8 +852,6 @@ int main(int argc, char *argv[]) {
         on_file_open(current_file.c_str());
     }
 
-    g_timeout_add(1000, update_ui, NULL);
-
     gtk_main();
 
     return 0;
@@ -0,0 +1,354 @@
+#include "meta_cache.h"
+#include "lark_paths.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char META_MAGIC[4] = { 'L', 'K', 'M', 'C' };
+static const uint32_t META_VERSION = 3;
+static const size_t FILE_HEADER_SIZE = 8; // magic + version
+
+// Compact on open once the file holds this many records and most are stale
+static const size_t COMPACT_MIN_RECORDS = 64;
+
+// Fixed part of one record; followed by the path, title, artist and album
+// bytes, then per chapter: timestamp (8), title sample offset (8) and size
+// (4) for text-track chapters, title length (4), title.
+// Fields are copied with memcpy, so records need no alignment.
+struct MetaRecordHeader {
+    uint32_t record_size; // whole record including this header
+    uint32_t path_len;
+    uint64_t file_size;
+    int64_t file_mtime;
+    int64_t duration;
+    uint64_t cover_offset;
+    uint64_t cover_size;
+    uint32_t samplerate;
+    uint32_t channels;
+    uint32_t title_len;
+    uint32_t artist_len;
+    uint32_t album_len;
+    uint32_t chapter_count;
+    int32_t loudness;     // integrated LUFS * 100, 0 if not measured
+};
+
+// Validate the record at `rec` against the `avail` bytes that follow it
+static bool parse_record(const uint8_t* rec, size_t avail, MetaRecordHeader* h) {
+    if (avail < sizeof(MetaRecordHeader)) return false;
+    memcpy(h, rec, sizeof(MetaRecordHeader));
+    if (h->record_size < sizeof(MetaRecordHeader) || h->record_size > avail) return false;
+
+    uint64_t pos = sizeof(MetaRecordHeader);
+    pos += (uint64_t)h->path_len + h->title_len + h->artist_len + h->album_len;
+    for (uint32_t i = 0; i < h->chapter_count; ++i) {
+        uint32_t len;
+        if (pos + 24 > h->record_size) return false;
+        memcpy(&len, rec + pos + 20, 4);
+        pos += 24 + (uint64_t)len;
+    }
+    return pos == h->record_size;
+}
+
+static void append_bytes(std::vector<uint8_t>* out, const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    out->insert(out->end(), p, p + len);
+}
+
+static bool write_all(int fd, const void* data, size_t len, uint64_t pos) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)pos);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+MetaCache::MetaCache()
+    : fd(-1), map_base(NULL), map_size(0), append_pos(0), record_total(0),
+      hit_count(0), miss_count(0) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+MetaCache::~MetaCache() {
+    close();
+    pthread_mutex_destroy(&lock);
+}
+
+bool MetaCache::open(const std::string& path) {
+    close();
+    cache_path = path;
+    if (!map_file()) return false;
+
+    if (record_total >= COMPACT_MIN_RECORDS && record_total > 2 * records.size()) {
+        compact();
+    }
+    return true;
+}
+
+void MetaCache::close() {
+    unmap_file();
+    added.clear();
+    records.clear();
+    record_total = 0;
+}
+
+bool MetaCache::map_file() {
+    fd = ::open(cache_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) return false;
+
+    struct stat st;
+    char header[FILE_HEADER_SIZE];
+    if (fstat(fd, &st) == -1) {
+        unmap_file();
+        return false;
+    }
+    bool valid = st.st_size >= (off_t)FILE_HEADER_SIZE
+              && pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header)
+              && memcmp(header, META_MAGIC, 4) == 0
+              && memcmp(header + 4, &META_VERSION, 4) == 0;
+    if (!valid) {
+        // New, foreign or outdated file: start over
+        memcpy(header, META_MAGIC, 4);
+        memcpy(header + 4, &META_VERSION, 4);
+        if (ftruncate(fd, 0) == -1 || !write_all(fd, header, sizeof(header), 0)) {
+            unmap_file();
+            return false;
+        }
+        append_pos = FILE_HEADER_SIZE;
+        return true;
+    }
+
+    map_size = (size_t)st.st_size;
+    void* addr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        map_size = 0;
+        unmap_file();
+        return false;
+    }
+    map_base = static_cast<const uint8_t*>(addr);
+    append_pos = FILE_HEADER_SIZE;
+    index_records(map_base + FILE_HEADER_SIZE, map_size - FILE_HEADER_SIZE, FILE_HEADER_SIZE);
+
+    // Drop a record torn by a crash mid-append; the mapping is never read past
+    // it, and if truncating fails the next append simply overwrites it
+    if (append_pos < (uint64_t)map_size) {
+        int ignored = ftruncate(fd, (off_t)append_pos);
+        (void)ignored;
+    }
+    return true;
+}
+
+void MetaCache::unmap_file() {
+    if (map_base) {
+        munmap(const_cast<uint8_t*>(map_base), map_size);
+        map_base = NULL;
+        map_size = 0;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    append_pos = 0;
+}
+
+void MetaCache::index_records(const uint8_t* data, size_t size, uint64_t base_pos) {
+    size_t pos = 0;
+    MetaRecordHeader h;
+    while (parse_record(data + pos, size - pos, &h)) {
+        std::string path(reinterpret_cast<const char*>(data + pos + sizeof(h)), h.path_len);
+        records[lark_hash64(path)] = data + pos;
+        record_total++;
+        pos += h.record_size;
+    }
+    append_pos = base_pos + pos;
+}
+
+void MetaCache::compact() {
+    std::string tmp_path = cache_path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (!out) return;
+
+    bool ok = fwrite(META_MAGIC, 4, 1, out) == 1 && fwrite(&META_VERSION, 4, 1, out) == 1;
+    std::unordered_map<unsigned long long, const uint8_t*>::const_iterator it;
+    for (it = records.begin(); ok && it != records.end(); ++it) {
+        uint32_t record_size;
+        memcpy(&record_size, it->second, 4);
+        ok = fwrite(it->second, record_size, 1, out) == 1;
+    }
+    ok = (fclose(out) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    // Remap the compacted file
+    unmap_file();
+    records.clear();
+    record_total = 0;
+    map_file();
+}
+
+const uint8_t* MetaCache::find(const std::string& filepath, uint64_t file_size, int64_t file_mtime) const {
+    std::unordered_map<unsigned long long, const uint8_t*>::const_iterator it =
+        records.find(lark_hash64(filepath));
+    if (it == records.end()) return NULL;
+
+    MetaRecordHeader h;
+    memcpy(&h, it->second, sizeof(h));
+    if (h.file_size != file_size || h.file_mtime != file_mtime || h.path_len != filepath.size()
+        || memcmp(it->second + sizeof(h), filepath.data(), h.path_len) != 0) {
+        return NULL;
+    }
+    return it->second;
+}
+
+// Fill `entry` from a validated record; chapter titles point into it
+static void decode_record(const uint8_t* rec, MetaCache::Entry* entry) {
+    MetaRecordHeader h;
+    memcpy(&h, rec, sizeof(h));
+    const char* p = reinterpret_cast<const char*>(rec + sizeof(h)) + h.path_len;
+    entry->title.assign(p, h.title_len);
+    p += h.title_len;
+    entry->artist.assign(p, h.artist_len);
+    p += h.artist_len;
+    entry->album.assign(p, h.album_len);
+    p += h.album_len;
+    entry->duration = h.duration;
+    entry->samplerate = h.samplerate;
+    entry->channels = h.channels;
+    entry->cover_offset = h.cover_offset;
+    entry->cover_size = h.cover_size;
+    entry->loudness = h.loudness / 100.0f;
+
+    entry->chapters.resize(h.chapter_count);
+    for (uint32_t i = 0; i < h.chapter_count; ++i) {
+        Mp4Demuxer::Chapter& ch = entry->chapters[i];
+        uint32_t len;
+        memcpy(&ch.timestamp, p, 8);
+        memcpy(&ch.title_offset, p + 8, 8);
+        memcpy(&ch.title_size, p + 16, 4);
+        memcpy(&len, p + 20, 4);
+        ch.title = Mp4View(reinterpret_cast<const uint8_t*>(p + 24), len);
+        p += 24 + len;
+    }
+}
+
+bool MetaCache::lookup(const std::string& filepath, uint64_t file_size, int64_t file_mtime, Entry* entry) {
+    pthread_mutex_lock(&lock);
+    const uint8_t* rec = find(filepath, file_size, file_mtime);
+    if (rec) {
+        decode_record(rec, entry);
+        hit_count++;
+    } else {
+        miss_count++;
+    }
+    pthread_mutex_unlock(&lock);
+    return rec != NULL;
+}
+
+void MetaCache::store(const std::string& filepath, uint64_t file_size, int64_t file_mtime, Entry* entry) {
+    MetaRecordHeader h;
+    memset(&h, 0, sizeof(h));
+    h.path_len = (uint32_t)filepath.size();
+    h.file_size = file_size;
+    h.file_mtime = file_mtime;
+    h.duration = entry->duration;
+    h.cover_offset = entry->cover_offset;
+    h.cover_size = entry->cover_size;
+    h.samplerate = entry->samplerate;
+    h.channels = entry->channels;
+    h.title_len = (uint32_t)entry->title.size();
+    h.artist_len = (uint32_t)entry->artist.size();
+    h.album_len = (uint32_t)entry->album.size();
+    h.chapter_count = (uint32_t)entry->chapters.size();
+    h.loudness = (int32_t)lrintf(entry->loudness * 100.0f);
+
+    std::vector<uint8_t> rec;
+    rec.resize(sizeof(h));
+    append_bytes(&rec, filepath.data(), filepath.size());
+    append_bytes(&rec, entry->title.data(), entry->title.size());
+    append_bytes(&rec, entry->artist.data(), entry->artist.size());
+    append_bytes(&rec, entry->album.data(), entry->album.size());
+    for (size_t i = 0; i < entry->chapters.size(); ++i) {
+        const Mp4Demuxer::Chapter& ch = entry->chapters[i];
+        uint32_t len = (uint32_t)ch.title.size();
+        append_bytes(&rec, &ch.timestamp, 8);
+        append_bytes(&rec, &ch.title_offset, 8);
+        append_bytes(&rec, &ch.title_size, 4);
+        append_bytes(&rec, &len, 4);
+        append_bytes(&rec, ch.title.data(), len);
+    }
+    h.record_size = (uint32_t)rec.size();
+    memcpy(&rec[0], &h, sizeof(h));
+
+    pthread_mutex_lock(&lock);
+    added.push_back(std::vector<uint8_t>());
+    added.back().swap(rec);
+    const uint8_t* stored = &added.back()[0];
+    records[lark_hash64(filepath)] = stored;
+    if (fd != -1 && write_all(fd, stored, h.record_size, append_pos)) {
+        append_pos += h.record_size;
+    }
+    decode_record(stored, entry);
+    pthread_mutex_unlock(&lock);
+}
+
+bool MetaCache::get_loudness(const std::string& filepath, uint64_t file_size, int64_t file_mtime,
+                             float* loudness) const {
+    pthread_mutex_lock(&lock);
+    const uint8_t* rec = find(filepath, file_size, file_mtime);
+    MetaRecordHeader h;
+    if (rec) memcpy(&h, rec, sizeof(h));
+    pthread_mutex_unlock(&lock);
+
+    if (!rec || h.loudness == 0) return false;
+    *loudness = h.loudness / 100.0f;
+    return true;
+}
+
+bool MetaCache::set_loudness(const std::string& filepath, uint64_t file_size, int64_t file_mtime,
+                             float loudness) {
+    Entry entry;
+    pthread_mutex_lock(&lock);
+    const uint8_t* rec = find(filepath, file_size, file_mtime);
+    if (rec) decode_record(rec, &entry);
+    pthread_mutex_unlock(&lock);
+    if (!rec) return false;
+
+    // Records are immutable: append the updated one, it supersedes the old
+    entry.loudness = loudness;
+    store(filepath, file_size, file_mtime, &entry);
+    return true;
+}
+
+double MetaCache::hit_rate() const {
+    unsigned int total = hit_count + miss_count;
+    return total ? (double)hit_count / total : 0.0;
+}
+
+bool meta_cache_read_book(const char* filepath, Mp4Demuxer& demuxer, MetaCache::Entry* entry) {
+    if (!demuxer.open_metadata(filepath)) return false;
+
+    entry->title = demuxer.get_title();
+    entry->artist = demuxer.get_artist();
+    entry->album = demuxer.get_album();
+    entry->duration = demuxer.get_duration();
+    entry->samplerate = demuxer.get_samplerate();
+    entry->channels = demuxer.get_channels();
+    entry->cover_offset = demuxer.get_cover_offset();
+    entry->cover_size = demuxer.get_cover_size();
+    entry->chapters = demuxer.get_chapters();
+    return true;
+}
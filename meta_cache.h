@@ -0,0 +1,98 @@
+#ifndef META_CACHE_H
+#define META_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "mp4_demuxer.h"
+
+// Persistent cache of the per-book metadata the UI needs on open (tags,
+// duration, format, chapters and where the cover lives), so an unchanged book
+// opens without running the MP4 parser or a decoder.
+//
+// The cache is one append-only file of self-describing records, memory-mapped
+// when opened; entries are keyed by path and checked against the file's size
+// and mtime. The newest record for a path wins, and the file is compacted on
+// open once most of it is stale.
+class MetaCache {
+public:
+    struct Entry {
+        std::string title;
+        std::string artist;
+        std::string album;
+        int64_t duration;      // nanoseconds
+        uint32_t samplerate;   // of the sample entry; SBR may double what FAAD outputs
+        uint32_t channels;
+        uint64_t cover_offset; // cover image location in the book (size 0 if none)
+        uint64_t cover_size;
+        float loudness;        // integrated LUFS (EBU R128), 0 if not measured yet
+        // Titles are views into the cache, valid until close()
+        std::vector<Mp4Demuxer::Chapter> chapters;
+
+        Entry() : duration(0), samplerate(0), channels(0), cover_offset(0), cover_size(0), loudness(0) {}
+    };
+
+    MetaCache();
+    ~MetaCache();
+
+    // Map the cache file at `path`, creating it if needed. Without a usable
+    // file the cache still works, in memory only.
+    bool open(const std::string& path);
+    void close();
+
+    // Find the entry for `filepath` if the book still has this size and mtime
+    bool lookup(const std::string& filepath, uint64_t file_size, int64_t file_mtime, Entry* entry);
+
+    // Add or replace the entry for `filepath`. On return the chapter titles
+    // of `entry` point into the cache's own copy.
+    void store(const std::string& filepath, uint64_t file_size, int64_t file_mtime, Entry* entry);
+
+    // Loudness of an unchanged book, without counting as a lookup; false if
+    // the book is unknown or has not been measured
+    bool get_loudness(const std::string& filepath, uint64_t file_size, int64_t file_mtime,
+                      float* loudness) const;
+    // Record a measurement for a book already in the cache
+    bool set_loudness(const std::string& filepath, uint64_t file_size, int64_t file_mtime,
+                      float loudness);
+
+    unsigned int hits() const { return hit_count; }
+    unsigned int misses() const { return miss_count; }
+    double hit_rate() const;
+
+private:
+    std::string cache_path;
+    int fd;
+    const uint8_t* map_base;
+    size_t map_size;
+    uint64_t append_pos; // end of the last complete record in the file
+
+    // Records added since open(); std::list so they never move
+    std::list<std::vector<uint8_t> > added;
+    std::unordered_map<unsigned long long, const uint8_t*> records; // path hash -> record
+    size_t record_total; // records seen in the file, including stale ones
+
+    unsigned int hit_count;
+    unsigned int miss_count;
+    mutable pthread_mutex_t lock;
+
+    bool map_file();
+    void unmap_file();
+    void index_records(const uint8_t* data, size_t size, uint64_t base_pos);
+    void compact();
+    const uint8_t* find(const std::string& filepath, uint64_t file_size, int64_t file_mtime) const;
+
+    MetaCache(const MetaCache&);
+    MetaCache& operator=(const MetaCache&);
+};
+
+// Fill `entry` by parsing `filepath` with `demuxer`, which reads only the
+// metadata: no seek index is built or written for the book. The chapter
+// titles point into the demuxer, so it must stay open until the entry has
+// been stored.
+bool meta_cache_read_book(const char* filepath, Mp4Demuxer& demuxer, MetaCache::Entry* entry);
+
+#endif // META_CACHE_H
@@ -0,0 +1,219 @@
+#include "mp4_boxes.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <string.h>
+#include <errno.h>
+
+// Network and FUSE file systems either do not support shared mappings well
+// or turn every page fault into a round trip; read those with pread.
+static bool fs_prefers_pread(int fd) {
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == -1) return true;
+    switch ((unsigned long)fs.f_type) {
+        case 0x6969UL:      // NFS
+        case 0x517BUL:      // SMB
+        case 0xFF534D42UL:  // CIFS
+        case 0xFE534D42UL:  // SMB2
+        case 0x65735546UL:  // FUSE
+            return true;
+        default:
+            return false;
+    }
+}
+
+Mp4File::Mp4File() : fd(-1), file_size(0), file_mtime(0), base(NULL) {
+}
+
+Mp4File::~Mp4File() {
+    close();
+}
+
+bool Mp4File::open(const char* filepath) {
+    close();
+    fd = ::open(filepath, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close();
+        return false;
+    }
+    file_size = (uint64_t)st.st_size;
+    file_mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+void Mp4File::close() {
+    if (base) {
+        munmap(const_cast<uint8_t*>(base), (size_t)file_size);
+        base = NULL;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    file_size = 0;
+    file_mtime = 0;
+}
+
+bool Mp4File::map() {
+    if (fd == -1 || base) return base != NULL;
+    if (file_size == 0 || file_size > (uint64_t)(size_t)-1 / 2) return false;
+    if (fs_prefers_pread(fd)) return false;
+
+    void* addr = mmap(NULL, (size_t)file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return false;
+    base = static_cast<const uint8_t*>(addr);
+    return true;
+}
+
+const uint8_t* Mp4File::view(uint64_t pos, uint64_t len) const {
+    if (!base || pos + len > file_size) return NULL;
+    return base + pos;
+}
+
+void Mp4File::advise(uint64_t pos, uint64_t len, int advice) const {
+    if (!base || pos >= file_size) return;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = pos - pos % page;
+    uint64_t end = pos + len < file_size ? pos + len : file_size;
+    madvise(const_cast<uint8_t*>(base) + start, (size_t)(end - start), advice);
+}
+
+bool Mp4File::read(uint64_t pos, void* buf, size_t len) const {
+    if (fd == -1 || pos + len > file_size) return false;
+    if (base) {
+        memcpy(buf, base + pos, len);
+        return true;
+    }
+
+    unsigned char* out = static_cast<unsigned char*>(buf);
+    while (len > 0) {
+        ssize_t got = pread(fd, out, len, (off_t)pos);
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (got == 0) return false;
+        out += got;
+        pos += got;
+        len -= got;
+    }
+    return true;
+}
+
+bool Mp4File::read_u8(uint64_t pos, uint8_t* value) const {
+    return read(pos, value, 1);
+}
+
+bool Mp4File::read_u16(uint64_t pos, uint16_t* value) const {
+    uint8_t b[2];
+    if (!read(pos, b, sizeof(b))) return false;
+    *value = (uint16_t)((b[0] << 8) | b[1]);
+    return true;
+}
+
+bool Mp4File::read_u32(uint64_t pos, uint32_t* value) const {
+    uint8_t b[4];
+    if (!read(pos, b, sizeof(b))) return false;
+    *value = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    return true;
+}
+
+bool Mp4File::read_u64(uint64_t pos, uint64_t* value) const {
+    uint32_t hi, lo;
+    if (!read_u32(pos, &hi) || !read_u32(pos + 4, &lo)) return false;
+    *value = ((uint64_t)hi << 32) | lo;
+    return true;
+}
+
+bool Mp4File::read_box(uint64_t pos, uint64_t limit, Mp4Box* box) const {
+    uint32_t size32, type;
+    if (pos + 8 > limit) return false;
+    if (!read_u32(pos, &size32) || !read_u32(pos + 4, &type)) return false;
+
+    box->type = type;
+    box->offset = pos;
+    box->header_size = 8;
+    if (size32 == 1) {
+        if (!read_u64(pos + 8, &box->size)) return false;
+        box->header_size = 16;
+    } else if (size32 == 0) {
+        box->size = limit - pos; // box extends to the end of its parent
+    } else {
+        box->size = size32;
+    }
+
+    return box->size >= box->header_size && box->end() <= limit;
+}
+
+bool Mp4File::find_box(uint64_t start, uint64_t end, uint32_t type, Mp4Box* box) const {
+    uint64_t pos = start;
+    Mp4Box child;
+    while (read_box(pos, end, &child)) {
+        if (child.type == type) {
+            *box = child;
+            return true;
+        }
+        pos = child.end();
+    }
+    return false;
+}
+
+bool Mp4File::find_child(const Mp4Box& parent, uint32_t type, Mp4Box* box) const {
+    return find_box(parent.payload(), parent.end(), type, box);
+}
+
+bool Mp4File::find_path(const Mp4Box& parent, const uint32_t* types, size_t count, Mp4Box* box) const {
+    Mp4Box current = parent;
+    for (size_t i = 0; i < count; ++i) {
+        if (!find_child(current, types[i], &current)) return false;
+    }
+    *box = current;
+    return true;
+}
+
+bool mp4_find_moov(const Mp4File& file, Mp4Box* moov) {
+    return file.find_box(0, file.size(), MP4_FOURCC('m','o','o','v'), moov);
+}
+
+bool mp4_find_track(const Mp4File& file, const Mp4Box& moov, uint32_t handler,
+                    uint32_t track_id, Mp4Box* trak) {
+    uint64_t pos = moov.payload();
+    Mp4Box child;
+    while (file.read_box(pos, moov.end(), &child)) {
+        pos = child.end();
+        if (child.type != MP4_FOURCC('t','r','a','k')) continue;
+
+        if (track_id != 0) {
+            Mp4Box tkhd;
+            uint8_t version;
+            uint32_t id;
+            if (!file.find_child(child, MP4_FOURCC('t','k','h','d'), &tkhd)) continue;
+            if (!file.read_u8(tkhd.payload(), &version)) continue;
+            // version 1 carries 64-bit creation/modification times
+            uint64_t id_pos = tkhd.payload() + (version == 1 ? 20 : 12);
+            if (file.read_u32(id_pos, &id) && id == track_id) {
+                *trak = child;
+                return true;
+            }
+            continue;
+        }
+
+        static const uint32_t hdlr_path[] = {
+            MP4_FOURCC('m','d','i','a'), MP4_FOURCC('h','d','l','r')
+        };
+        Mp4Box hdlr;
+        uint32_t type;
+        if (!file.find_path(child, hdlr_path, 2, &hdlr)) continue;
+        // version/flags (4), pre_defined (4), handler_type (4)
+        if (file.read_u32(hdlr.payload() + 8, &type) && type == handler) {
+            *trak = child;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,97 @@
+#ifndef MP4_BOXES_H
+#define MP4_BOXES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#define MP4_FOURCC(a, b, c, d) \
+    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// One ISO-BMFF box header as found in the file
+struct Mp4Box {
+    uint32_t type;
+    uint64_t offset;      // position of the size field
+    uint64_t header_size; // 8, or 16 for 64-bit sizes
+    uint64_t size;        // whole box including header
+
+    uint64_t payload() const { return offset + header_size; }
+    uint64_t end() const { return offset + size; }
+};
+
+// Borrowed bytes of an open Mp4File: either a range of the mapping or a
+// buffer owned by whoever handed the view out. Valid until that owner closes.
+struct Mp4View {
+    const uint8_t* ptr;
+    size_t len;
+
+    Mp4View() : ptr(NULL), len(0) {}
+    Mp4View(const uint8_t* p, size_t n) : ptr(p), len(n) {}
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    std::string str() const { return std::string(reinterpret_cast<const char*>(ptr), len); }
+};
+
+// Read-only view of an MP4 file using positional reads (pread), so several
+// readers can share nothing but the path and never fight over a file offset.
+// Optionally the whole file is memory-mapped, and reads and views are then
+// served straight from the mapping.
+class Mp4File {
+public:
+    Mp4File();
+    ~Mp4File();
+
+    bool open(const char* filepath);
+    void close();
+    bool is_open() const { return fd != -1; }
+
+    uint64_t size() const { return file_size; }
+    int64_t mtime() const { return file_mtime; }
+    int handle() const { return fd; }
+
+    // Map the file read-only. Returns false and stays in pread mode when the
+    // file system or the address space is not suited to mmap.
+    bool map();
+    bool is_mapped() const { return base != NULL; }
+    // Pointer to [pos, pos + len) inside the mapping; NULL when not mapped
+    const uint8_t* view(uint64_t pos, uint64_t len) const;
+    // madvise() a byte range of the mapping (rounded out to whole pages)
+    void advise(uint64_t pos, uint64_t len, int advice) const;
+
+    bool read(uint64_t pos, void* buf, size_t len) const;
+    bool read_u8(uint64_t pos, uint8_t* value) const;
+    bool read_u16(uint64_t pos, uint16_t* value) const;
+    bool read_u32(uint64_t pos, uint32_t* value) const;
+    bool read_u64(uint64_t pos, uint64_t* value) const;
+
+    // Parse the box header at `pos`; fails if it does not fit before `limit`
+    bool read_box(uint64_t pos, uint64_t limit, Mp4Box* box) const;
+
+    // First child of type `type` inside [start, end)
+    bool find_box(uint64_t start, uint64_t end, uint32_t type, Mp4Box* box) const;
+    bool find_child(const Mp4Box& parent, uint32_t type, Mp4Box* box) const;
+
+    // Follow a path of nested box types from `parent`, e.g. mdia/minf/stbl
+    bool find_path(const Mp4Box& parent, const uint32_t* types, size_t count, Mp4Box* box) const;
+
+private:
+    int fd;
+    uint64_t file_size;
+    int64_t file_mtime;
+    const uint8_t* base;
+
+    Mp4File(const Mp4File&);
+    Mp4File& operator=(const Mp4File&);
+};
+
+// Locate the moov box at the top level of the file
+bool mp4_find_moov(const Mp4File& file, Mp4Box* moov);
+
+// Find the first trak whose handler is `handler` (e.g. 'soun'), or the trak
+// with the given track ID when `track_id` is non-zero.
+bool mp4_find_track(const Mp4File& file, const Mp4Box& moov, uint32_t handler,
+                    uint32_t track_id, Mp4Box* trak);
+
+#endif // MP4_BOXES_H
@@ -0,0 +1,450 @@
+#include "mp4_demuxer.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+// Buffered mode: frames are served from a window of this size, refilled with
+// one pread
+static const size_t READAHEAD_BYTES = 64 * 1024;
+
+// Mapped mode: keep this much of the file ahead of the decoder in flight,
+// topping it up once half of it has been consumed. At 64 kbit/s this is about
+// a minute of audio, so the flash can idle between bursts.
+static const uint64_t WILLNEED_BYTES = 512 * 1024;
+
+Mp4Demuxer::Mp4Demuxer() {
+    close();
+}
+
+Mp4Demuxer::~Mp4Demuxer() {
+    close();
+}
+
+void Mp4Demuxer::close() {
+    file.close();
+    index.clear();
+    filepath.clear();
+    asc.clear();
+    samplerate = 0;
+    channels = 0;
+    duration = 0;
+    title.clear();
+    artist.clear();
+    album.clear();
+    chapters.clear();
+    cover_offset = 0;
+    cover_size = 0;
+    std::vector<uint8_t>().swap(chpl_copy);
+    std::vector<uint8_t>().swap(cover_copy);
+    next_frame = 0;
+    chunk = 0;
+    next_offset = 0;
+    frame_ptr = NULL;
+    frame_len = 0;
+    window_pos = 0;
+    window_len = 0;
+    advised_end = 0;
+}
+
+// Open `path` and find its first audio track and sample entry
+bool Mp4Demuxer::open_track(const char* path, Mp4Box* moov, Mp4Box* trak) {
+    close();
+    if (!path || !file.open(path)) return false;
+    filepath = path;
+    return mp4_find_moov(file, moov)
+        && mp4_find_track(file, *moov, MP4_FOURCC('s','o','u','n'), 0, trak)
+        && parse_sample_entry(*trak);
+}
+
+bool Mp4Demuxer::open(const char* path, bool read_tags, ReadMode mode) {
+    Mp4Box moov, trak;
+    if (!open_track(path, &moov, &trak)) {
+        close();
+        return false;
+    }
+    // Note: a mapped file that is truncated underneath us raises SIGBUS on
+    // access, the same way a vanished SD card fails reads in buffered mode.
+    if (mode == READ_AUTO) {
+        file.map();
+    }
+    if (!index.load_or_build(path, file, trak)) {
+        close();
+        return false;
+    }
+
+    if (read_tags) {
+        parse_tags(moov);
+        parse_chapter_track(moov, trak);
+    }
+
+    if (file.is_mapped()) {
+        // Audio data is consumed front to back: let the kernel read ahead
+        // aggressively and drop pages behind the decoder early
+        uint64_t data_start = index.chunk_offset(0);
+        file.advise(data_start, file.size() - data_start, MADV_SEQUENTIAL);
+    } else {
+        window.resize(std::max<size_t>(READAHEAD_BYTES, index.max_frame_size()));
+    }
+
+    seek(0);
+    return true;
+}
+
+bool Mp4Demuxer::open_metadata(const char* path) {
+    Mp4Box moov, trak;
+    if (!open_track(path, &moov, &trak)) {
+        close();
+        return false;
+    }
+    duration = SeekIndex::track_duration(file, trak);
+    if (duration <= 0) {
+        close();
+        return false;
+    }
+    // Tags are read through buffered preads: mapping a book to look at a few
+    // boxes in its moov is not worth the page tables
+    parse_tags(moov);
+    parse_chapter_track(moov, trak);
+    return true;
+}
+
+int64_t Mp4Demuxer::get_duration() const {
+    if (!index.is_valid()) return duration;
+    return index.frame_start_time(index.frame_count());
+}
+
+// Read an MPEG-4 descriptor header (tag + variable-length size)
+static bool read_descriptor(const Mp4File& file, uint64_t* pos, uint64_t end, uint8_t* tag, uint32_t* len) {
+    if (!file.read_u8(*pos, tag)) return false;
+    (*pos)++;
+    *len = 0;
+    for (int i = 0; i < 4; ++i) {
+        uint8_t b;
+        if (*pos >= end || !file.read_u8(*pos, &b)) return false;
+        (*pos)++;
+        *len = (*len << 7) | (b & 0x7F);
+        if (!(b & 0x80)) break;
+    }
+    return *pos + *len <= end;
+}
+
+bool Mp4Demuxer::parse_sample_entry(const Mp4Box& trak) {
+    static const uint32_t stsd_path[] = {
+        MP4_FOURCC('m','d','i','a'), MP4_FOURCC('m','i','n','f'),
+        MP4_FOURCC('s','t','b','l'), MP4_FOURCC('s','t','s','d')
+    };
+    Mp4Box stsd, entry;
+    if (!file.find_path(trak, stsd_path, 4, &stsd)) return false;
+    // version/flags (4), entry_count (4), then the first sample entry
+    if (!file.read_box(stsd.payload() + 8, stsd.end(), &entry)) return false;
+    if (entry.type != MP4_FOURCC('m','p','4','a')) return false;
+
+    // AudioSampleEntry: reserved (6), data_reference_index (2), version (2),
+    // revision (2), vendor (4), channels (2), sample size (2), compression (2),
+    // packet size (2), sample rate 16.16 (4)
+    uint16_t version, channel_count;
+    uint32_t rate;
+    uint64_t base = entry.payload();
+    if (!file.read_u16(base + 8, &version) || !file.read_u16(base + 16, &channel_count)
+        || !file.read_u32(base + 24, &rate)) {
+        return false;
+    }
+    channels = channel_count;
+    samplerate = rate >> 16;
+
+    // QuickTime sound description v1/v2 carry extra fields before the children
+    uint64_t children = base + 28;
+    if (version == 1) children += 16;
+    else if (version == 2) children += 36;
+
+    Mp4Box esds;
+    if (!file.find_box(children, entry.end(), MP4_FOURCC('e','s','d','s'), &esds)) return false;
+
+    uint64_t pos = esds.payload() + 4; // version/flags
+    uint64_t end = esds.end();
+    uint8_t tag, flags;
+    uint32_t len;
+    if (!read_descriptor(file, &pos, end, &tag, &len) || tag != 0x03) return false;
+    // ES_Descriptor: ES_ID (2), flags (1) and their optional fields
+    if (!file.read_u8(pos + 2, &flags)) return false;
+    pos += 3;
+    if (flags & 0x80) pos += 2;
+    if (flags & 0x40) {
+        uint8_t url_len;
+        if (!file.read_u8(pos, &url_len)) return false;
+        pos += 1 + url_len;
+    }
+    if (flags & 0x20) pos += 2;
+
+    if (!read_descriptor(file, &pos, end, &tag, &len) || tag != 0x04) return false;
+    pos += 13; // objectTypeIndication, streamType, bufferSize, bitrates
+    if (!read_descriptor(file, &pos, end, &tag, &len) || tag != 0x05 || len == 0) return false;
+
+    asc.resize(len);
+    return file.read(pos, &asc[0], len);
+}
+
+void Mp4Demuxer::parse_tags(const Mp4Box& moov) {
+    Mp4Box udta;
+    if (!file.find_child(moov, MP4_FOURCC('u','d','t','a'), &udta)) return;
+
+    Mp4Box chpl;
+    if (file.find_child(udta, MP4_FOURCC('c','h','p','l'), &chpl)) {
+        parse_chpl(chpl);
+    }
+
+    Mp4Box meta, ilst;
+    if (!file.find_child(udta, MP4_FOURCC('m','e','t','a'), &meta)) return;
+    // ISO meta is a full box; QuickTime-style files omit version/flags
+    uint64_t children = meta.payload();
+    uint32_t probe;
+    if (file.read_u32(children + 4, &probe) && probe != MP4_FOURCC('h','d','l','r')) {
+        children += 4;
+    }
+    if (file.find_box(children, meta.end(), MP4_FOURCC('i','l','s','t'), &ilst)) {
+        parse_ilst(ilst);
+    }
+}
+
+void Mp4Demuxer::parse_ilst(const Mp4Box& ilst) {
+    std::string album_artist;
+    uint64_t pos = ilst.payload();
+    Mp4Box item;
+    while (file.read_box(pos, ilst.end(), &item)) {
+        pos = item.end();
+
+        Mp4Box data;
+        if (!file.find_child(item, MP4_FOURCC('d','a','t','a'), &data)) continue;
+        // data: type indicator (4), locale (4), value
+        uint64_t value_pos = data.payload() + 8;
+        if (value_pos > data.end()) continue;
+        uint64_t value_len = data.end() - value_pos;
+
+        if (item.type == MP4_FOURCC('c','o','v','r')) {
+            if (cover_size == 0) {
+                cover_offset = value_pos;
+                cover_size = value_len;
+            }
+            continue;
+        }
+
+        std::string* target = NULL;
+        switch (item.type) {
+            case MP4_FOURCC(0xA9,'n','a','m'): target = &title; break;
+            case MP4_FOURCC(0xA9,'A','R','T'): target = &artist; break;
+            case MP4_FOURCC(0xA9,'a','l','b'): target = &album; break;
+            case MP4_FOURCC('a','A','R','T'): target = &album_artist; break;
+            default: break;
+        }
+        if (!target || value_len == 0 || value_len > 4096) continue;
+
+        target->resize((size_t)value_len);
+        if (!file.read(value_pos, &(*target)[0], (size_t)value_len)) {
+            target->clear();
+        }
+    }
+
+    if (artist.empty()) artist = album_artist;
+}
+
+void Mp4Demuxer::parse_chpl(const Mp4Box& chpl) {
+    // Nero chapters: version (1), flags (3), [reserved (4) if version 1],
+    // count (1), then per chapter: start (8, 100 ns units), title length (1), title
+    uint8_t version, count;
+    uint64_t pos = chpl.payload();
+    if (!file.read_u8(pos, &version)) return;
+    pos += 4;
+    if (version == 1) pos += 4;
+    if (!file.read_u8(pos, &count)) return;
+    pos++;
+
+    // Titles are views: into the mapping, or into one copy of the box payload
+    const uint8_t* base = file.view(pos, chpl.end() - pos);
+    if (!base) {
+        chpl_copy.resize((size_t)(chpl.end() - pos));
+        if (chpl_copy.empty() || !file.read(pos, &chpl_copy[0], chpl_copy.size())) return;
+        base = &chpl_copy[0];
+    }
+    const uint8_t* p = base;
+    const uint8_t* end = base + (size_t)(chpl.end() - pos);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (end - p < 9) break;
+        Chapter ch;
+        ch.timestamp = 0;
+        for (int b = 0; b < 8; ++b) ch.timestamp = (ch.timestamp << 8) | p[b];
+        uint8_t len = p[8];
+        p += 9;
+        if (end - p < len) break;
+        ch.title = Mp4View(p, len);
+        p += len;
+        chapters.push_back(ch);
+    }
+}
+
+void Mp4Demuxer::parse_chapter_track(const Mp4Box& moov, const Mp4Box& audio_trak) {
+    // tref/chap lists the IDs of the tracks holding this track's chapters
+    static const uint32_t chap_path[] = { MP4_FOURCC('t','r','e','f'), MP4_FOURCC('c','h','a','p') };
+    Mp4Box chap, text_trak;
+    uint32_t track_id;
+    if (!file.find_path(audio_trak, chap_path, 2, &chap) || !file.read_u32(chap.payload(), &track_id)
+        || track_id == 0 || !mp4_find_track(file, moov, 0, track_id, &text_trak)) {
+        return;
+    }
+
+    // One sample per chapter: its start time is the chapter's, its bytes are
+    // the title
+    SeekIndex samples;
+    if (!samples.build(file, text_trak) || samples.chunk_count() == 0) return;
+    // chpl tops out at 255 chapters. With as many, keep chpl: its titles
+    // are already read.
+    if (samples.frame_count() <= chapters.size()) return;
+
+    std::vector<Chapter> text;
+    text.reserve(samples.frame_count());
+    size_t sample_chunk = 0;
+    uint64_t offset = samples.chunk_offset(0);
+    for (uint32_t i = 0; i < samples.frame_count(); ++i) {
+        // Samples follow each other within a chunk, as in read_frame()
+        if (sample_chunk + 1 < samples.chunk_count() && i >= samples.chunk_first_frame(sample_chunk + 1)) {
+            sample_chunk++;
+            offset = samples.chunk_offset(sample_chunk);
+        }
+        Chapter ch;
+        ch.timestamp = (uint64_t)(samples.frame_start_time(i) / 100);
+        ch.title_offset = offset;
+        ch.title_size = samples.frame_size(i);
+        offset += ch.title_size;
+        text.push_back(ch);
+    }
+    chapters.swap(text);
+}
+
+// Append code point `c` to `out` as UTF-8
+static void append_utf8(std::string* out, uint32_t c) {
+    if (c < 0x80) {
+        *out += (char)c;
+    } else if (c < 0x800) {
+        *out += (char)(0xC0 | (c >> 6));
+        *out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        *out += (char)(0xE0 | (c >> 12));
+        *out += (char)(0x80 | ((c >> 6) & 0x3F));
+        *out += (char)(0x80 | (c & 0x3F));
+    } else {
+        *out += (char)(0xF0 | (c >> 18));
+        *out += (char)(0x80 | ((c >> 12) & 0x3F));
+        *out += (char)(0x80 | ((c >> 6) & 0x3F));
+        *out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+// UTF-16 text after its byte order mark; unpaired surrogates become U+FFFD
+static std::string utf16_to_utf8(const uint8_t* p, size_t len, bool big_endian) {
+    std::string out;
+    out.reserve(len);
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint32_t c = big_endian ? (p[i] << 8) | p[i + 1] : (p[i + 1] << 8) | p[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+            uint32_t low = big_endian ? (p[i + 2] << 8) | p[i + 3] : (p[i + 3] << 8) | p[i + 2];
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        if (c >= 0xD800 && c < 0xE000) c = 0xFFFD;
+        append_utf8(&out, c);
+    }
+    return out;
+}
+
+bool mp4_read_chapter_title(const Mp4File& file, const Mp4Demuxer::Chapter& chapter, std::string* title) {
+    // A text sample: length (2), the text, then optional style boxes
+    uint16_t len;
+    if (chapter.title_size < 2 || !file.read_u16(chapter.title_offset, &len)
+        || len > chapter.title_size - 2) {
+        return false;
+    }
+    std::vector<uint8_t> text(len);
+    if (len > 0 && !file.read(chapter.title_offset + 2, &text[0], len)) return false;
+
+    // UTF-16 starts with a byte order mark, anything else is UTF-8
+    if (len >= 2 && text[0] == 0xFE && text[1] == 0xFF) {
+        *title = utf16_to_utf8(&text[2], len - 2, true);
+    } else if (len >= 2 && text[0] == 0xFF && text[1] == 0xFE) {
+        *title = utf16_to_utf8(&text[2], len - 2, false);
+    } else {
+        title->assign(text.begin(), text.end());
+    }
+    return true;
+}
+
+Mp4View Mp4Demuxer::get_cover() {
+    if (cover_size == 0) return Mp4View();
+    const uint8_t* mapped = file.view(cover_offset, cover_size);
+    if (mapped) return Mp4View(mapped, (size_t)cover_size);
+
+    if (cover_copy.empty()) {
+        cover_copy.resize((size_t)cover_size);
+        if (!file.read(cover_offset, &cover_copy[0], cover_copy.size())) {
+            cover_copy.clear();
+            return Mp4View();
+        }
+    }
+    return Mp4View(&cover_copy[0], cover_copy.size());
+}
+
+bool Mp4Demuxer::seek(uint32_t frame) {
+    if (!index.is_valid() || frame > index.frame_count()) return false;
+
+    next_frame = frame;
+    if (frame < index.frame_count()) {
+        chunk = index.chunk_for_frame(frame);
+        next_offset = index.frame_offset(frame);
+    }
+    advised_end = 0; // restart read-ahead at the new position
+    return true;
+}
+
+bool Mp4Demuxer::read_frame() {
+    if (next_frame >= index.frame_count()) return false;
+
+    // Entering a new chunk: frames continue at that chunk's offset
+    if (chunk + 1 < index.chunk_count() && next_frame >= index.chunk_first_frame(chunk + 1)) {
+        chunk++;
+        next_offset = index.chunk_offset(chunk);
+    }
+
+    uint32_t size = index.frame_size(next_frame);
+
+    if (file.is_mapped()) {
+        const uint8_t* data = file.view(next_offset, size);
+        if (!data) return false;
+        if (next_offset + WILLNEED_BYTES / 2 >= advised_end) {
+            file.advise(next_offset, WILLNEED_BYTES, MADV_WILLNEED);
+            advised_end = next_offset + WILLNEED_BYTES;
+        }
+        frame_ptr = data;
+        frame_len = size;
+        next_offset += size;
+        next_frame++;
+        return true;
+    }
+
+    if (next_offset < window_pos || next_offset + size > window_pos + window_len) {
+        if (next_offset >= file.size()) return false;
+        size_t want = std::max<size_t>(READAHEAD_BYTES, size);
+        if (next_offset + want > file.size()) want = (size_t)(file.size() - next_offset);
+        if (want < size) return false;
+        if (window.size() < want) window.resize(want);
+        if (!file.read(next_offset, &window[0], want)) return false;
+        window_pos = next_offset;
+        window_len = want;
+    }
+
+    frame_ptr = &window[(size_t)(next_offset - window_pos)];
+    frame_len = size;
+    next_offset += size;
+    next_frame++;
+    return true;
+}
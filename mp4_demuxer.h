@@ -0,0 +1,140 @@
+#ifndef MP4_DEMUXER_H
+#define MP4_DEMUXER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mp4_boxes.h"
+#include "seek_index.h"
+
+// Per-instance MP4/M4B audio demuxer. Every instance owns its file handle,
+// sample tables, frame buffer and tags, so a decoder, a metadata reader and
+// any number of scanners can each hold one and run concurrently without a
+// global lock.
+//
+// Frames, cover art and chapter titles are handed out as pointers into a
+// read-only mapping of the file where possible, so nothing is copied and the
+// pages live in the (reclaimable) page cache instead of our heap. Files on
+// network/FUSE mounts, or too big for the address space, use buffered preads.
+//
+// Chapters come from the Nero chpl box or from a QuickTime text track that
+// the audio track references with tref/chap, whichever lists more. Only the
+// text track's sample table is read on open; its titles are samples in mdat,
+// located but not read (see mp4_read_chapter_title()), so a book with
+// thousands of chapters opens as fast as one with none.
+class Mp4Demuxer {
+public:
+    enum ReadMode {
+        READ_AUTO,     // mmap, falling back to buffered reads
+        READ_BUFFERED  // always pread into an owned window
+    };
+
+    struct Chapter {
+        uint64_t timestamp; // 100 ns units, as stored in chpl
+        Mp4View title;      // valid until close(); empty for text-track chapters
+        // Text-track chapters: the title sample in the file (size 0 if none)
+        uint64_t title_offset;
+        uint32_t title_size;
+
+        Chapter() : timestamp(0), title_offset(0), title_size(0) {}
+    };
+
+    Mp4Demuxer();
+    ~Mp4Demuxer();
+
+    // Open the first audio track of `filepath`. With `read_tags` the iTunes
+    // metadata (title, artist, album, cover) and chapters are read too.
+    bool open(const char* filepath, bool read_tags = true, ReadMode mode = READ_AUTO);
+    // Open for tags, chapters, format and duration only. The duration comes
+    // from mdhd/stts; no seek index is built or cached, so frames cannot be
+    // read. Cheap enough to run over a whole library.
+    bool open_metadata(const char* filepath);
+    void close();
+    bool is_open() const { return file.is_open(); }
+    bool is_mapped() const { return file.is_mapped(); }
+    const std::string& get_filepath() const { return filepath; }
+
+    // --- Track ---
+    const SeekIndex& get_index() const { return index; }
+    const std::vector<uint8_t>& get_asc() const { return asc; } // AudioSpecificConfig
+    uint32_t get_samplerate() const { return samplerate; }      // from the sample entry
+    uint32_t get_channels() const { return channels; }
+    int64_t get_duration() const;                                // nanoseconds
+
+    // --- Frames ---
+    uint32_t frame_count() const { return index.frame_count(); }
+    uint32_t current_frame() const { return next_frame; }
+    // Position the reader so the next read_frame() returns `frame`
+    bool seek(uint32_t frame);
+    // Read the next access unit; false at end of track or on I/O error.
+    // frame_data() stays valid until the next read_frame()/seek()/close().
+    bool read_frame();
+    const uint8_t* frame_data() const { return frame_ptr; }
+    uint32_t frame_size() const { return frame_len; }
+
+    // --- Tags ---
+    const std::string& get_title() const { return title; }
+    const std::string& get_artist() const { return artist; }
+    const std::string& get_album() const { return album; }
+    const std::vector<Chapter>& get_chapters() const { return chapters; }
+
+    // Location of the embedded cover image in the file (size 0 if none)
+    uint64_t get_cover_offset() const { return cover_offset; }
+    uint64_t get_cover_size() const { return cover_size; }
+    // The cover image bytes; read into an owned buffer on first use when the
+    // file is not mapped. Valid until close().
+    Mp4View get_cover();
+
+private:
+    std::string filepath;
+    Mp4File file;
+    SeekIndex index;
+
+    std::vector<uint8_t> asc;
+    uint32_t samplerate;
+    uint32_t channels;
+    int64_t duration; // open_metadata() only; otherwise the index has it
+
+    std::string title;
+    std::string artist;
+    std::string album;
+    std::vector<Chapter> chapters;
+    uint64_t cover_offset;
+    uint64_t cover_size;
+
+    // Backing store for tag views when the file is not mapped
+    std::vector<uint8_t> chpl_copy;
+    std::vector<uint8_t> cover_copy;
+
+    // Sequential frame cursor
+    uint32_t next_frame;
+    size_t chunk;
+    uint64_t next_offset;
+    const uint8_t* frame_ptr;
+    uint32_t frame_len;
+
+    // Buffered mode: read-ahead window so consecutive small frames cost one pread
+    std::vector<uint8_t> window;
+    uint64_t window_pos;
+    size_t window_len;
+
+    // Mapped mode: end of the range last passed to MADV_WILLNEED
+    uint64_t advised_end;
+
+    bool open_track(const char* path, Mp4Box* moov, Mp4Box* trak);
+    bool parse_sample_entry(const Mp4Box& trak);
+    void parse_tags(const Mp4Box& moov);
+    void parse_ilst(const Mp4Box& ilst);
+    void parse_chpl(const Mp4Box& chpl);
+    void parse_chapter_track(const Mp4Box& moov, const Mp4Box& audio_trak);
+
+    Mp4Demuxer(const Mp4Demuxer&);
+    Mp4Demuxer& operator=(const Mp4Demuxer&);
+};
+
+// Read the title of a text-track chapter (one with a title_size) from `file`,
+// converted to UTF-8. False if the sample cannot be read or is malformed.
+bool mp4_read_chapter_title(const Mp4File& file, const Mp4Demuxer::Chapter& chapter, std::string* title);
+
+#endif // MP4_DEMUXER_H
@@ -1,6 +1,8 @@
 /* music_backend.cpp - adapted with chapter support (see header) */
 #include "music_backend.h"
 #include <glib.h>
+#include "lark_paths.h"
+#include "perf_stats.h"
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -13,57 +15,201 @@
 #include <fstream>
 #include <vector>
 #include <mutex>
+#include <chrono>
+#include <algorithm>
 
 extern "C" {
 #include <faad/neaacdec.h>
-#include "mpeg4/mp4read.h"
 }
 
-// Global mutex to protect the non-reentrant mp4read library
-static std::mutex mp4_mutex;
+// The decoder parks for this long at most; drain, seek and stop wake it earlier
+static const int PRODUCER_WAIT_MS = 5000;
 
-const char* PIPE_PATH = "/tmp/kinamp_audio_pipe";
+// Frames decoded by Decoder::open() to learn the output format; HE-AAC
+// signals PS within its first few frames
+static const int FORMAT_PROBE_FRAMES = 8;
+
+// Loudness normalization: every book is brought to this level, by at most
+// MAX_NORMALIZE_DB either way
+static const double NORMALIZE_TARGET_LUFS = -18.0;
+static const double MAX_NORMALIZE_DB = 12.0;
+
+static gint64 monotonic_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 // =================================================================================
 // Decoder Implementation
 // =================================================================================
 
-Decoder::Decoder() : stop_flag(false), running(false), thread_id(0) {
-    // Ensure pipe exists
-    unlink(PIPE_PATH);
-    if (mkfifo(PIPE_PATH, 0666) == -1) {
-        perror("Decoder: Failed to create named pipe");
-    }
+Decoder::Decoder()
+    : stop_flag(false), running(false), finished(false), thread_id(0), start_time(0),
+      seek_target(-1), seek_requested_at(0), last_seek_latency(-1),
+      started_at(0), ended_at(0), faad(NULL), faad_rate(0), faad_channels(0),
+      mono_from_stereo(false), output_rate(0),
+      rewind_bytes(DEFAULT_REWIND_BYTES), rewind_compress(true), read_ahead_ms(0),
+      replaying(false), replay_frame(0), history_start(0),
+      bytes_per_second(0), speed(TimeStretch::MIN_SPEED),
+      skip_silence_ms(0), skip_threshold_db(DEFAULT_SILENCE_DB), silence_saved(0),
+      gain_q12(LOUDNESS_UNITY_GAIN),
+      preroll_frames(0), trim_time(0) {
 }
 
 Decoder::~Decoder() {
     stop();
-    unlink(PIPE_PATH);
 }
 
-bool Decoder::start(const char* filepath, int start_time) {
+// A FAAD handle set up for the book's ASC: 16-bit output, more than two
+// channels mixed down
+static NeAACDecHandle open_faad(Mp4Demuxer& demuxer, unsigned long* rate, unsigned char* channels) {
+    NeAACDecHandle hDecoder = NeAACDecOpen();
+    if (!hDecoder) return NULL;
+
+    NeAACDecConfigurationPtr config = NeAACDecGetCurrentConfiguration(hDecoder);
+    config->outputFormat = FAAD_FMT_16BIT;
+    config->downMatrix = 1;
+    NeAACDecSetConfiguration(hDecoder, config);
+
+    std::vector<uint8_t> asc = demuxer.get_asc();
+    if (asc.empty() || NeAACDecInit2(hDecoder, &asc[0], asc.size(), rate, channels) < 0) {
+        NeAACDecClose(hDecoder);
+        return NULL;
+    }
+    return hDecoder;
+}
+
+bool Decoder::open(const char* filepath, gint64 start_time) {
     if (running) {
         stop();
     }
+    close_input();
 
     current_filepath = filepath;
     this->start_time = start_time;
+    PerfSlot* stats = perf_stats_slot("decoder");
+    uint64_t opened_at = stats ? perf_now_ns() : 0;
+
+    // Own demuxer instance: no global lock, tags are not needed here
+    if (!demuxer.open(filepath, false)) {
+        g_printerr("Decoder: Failed to open file: %s\n", filepath);
+        return false;
+    }
+
+    unsigned long rate = 0;
+    unsigned channels = 0;
+    bool ps = false;
+    if (!probe_format(&rate, &channels, &ps)) {
+        g_printerr("Decoder: Failed to initialize FAAD2 with ASC\n");
+        demuxer.close();
+        return false;
+    }
+
+    // Decode for real with a fresh handle, so no state from the probe leaks
+    // into the first frames
+    unsigned long init_rate;
+    unsigned char init_channels;
+    faad = open_faad(demuxer, &init_rate, &init_channels);
+    if (!faad) {
+        g_printerr("Decoder: Failed to open FAAD2 decoder\n");
+        demuxer.close();
+        return false;
+    }
+
+    faad_rate = (unsigned)rate;
+    faad_channels = channels;
+    mono_from_stereo = channels == 2 && demuxer.get_channels() == 1 && !ps;
+    format.channels = mono_from_stereo ? 1 : channels;
+    unsigned target = output_rate;
+    format.rate = target > 0 ? target : faad_rate;
+
+    bytes_per_second = (guint32)(format.rate * format.channels * 2);
+    size_t history_bytes = rewind_bytes;
+    if (history_bytes > 0) history_bytes += (size_t)((uint64_t)read_ahead_ms * bytes_per_second / 1000);
+    history.configure(history_bytes, rewind_compress, format.channels);
+    resampler.configure(faad_rate, format.rate, format.channels);
+    stretch.set_speed(speed);
+    stretch.configure(format.rate, format.channels);
+    skipper.configure(format.rate, format.channels);
+
+    g_print("Decoder: Decoding %u Hz, %u channel(s)%s", faad_rate, format.channels,
+            mono_from_stereo ? " (mono passthrough)" : "");
+    if (format.rate != faad_rate) g_print(", resampled to %u Hz", format.rate);
+    g_print("\n");
+    if (stats) {
+        stats->count(PERF_OPENS);
+        stats->time(PERF_OPEN, perf_now_ns() - opened_at);
+    }
+    return true;
+}
+
+// FAAD only reports its real output format along with decoded audio:
+// implicit SBR doubles the rate, PS may turn mono into stereo, and 5.1 is
+// mixed down. Decode the first frames with a scratch handle to learn it.
+bool Decoder::probe_format(unsigned long* rate, unsigned* channels, bool* ps) {
+    unsigned char init_channels = 0;
+    NeAACDecHandle hDecoder = open_faad(demuxer, rate, &init_channels);
+    if (!hDecoder) return false;
+    *channels = init_channels > 2 ? 2 : init_channels;
+    *ps = false;
+
+    bool decoded = false;
+    demuxer.seek(0);
+    for (int i = 0; i < FORMAT_PROBE_FRAMES && demuxer.read_frame(); ++i) {
+        NeAACDecFrameInfo info;
+        NeAACDecDecode(hDecoder, &info, const_cast<unsigned char*>(demuxer.frame_data()),
+                       demuxer.frame_size());
+        if (info.error > 0 || info.samples == 0 || info.channels == 0) continue;
+        if (!decoded) {
+            *rate = info.samplerate;
+            *channels = info.channels;
+            decoded = true;
+        }
+        if (info.ps) *ps = true;
+    }
+    NeAACDecClose(hDecoder);
+    return *rate > 0 && *channels > 0;
+}
+
+void Decoder::close_input() {
+    if (faad) {
+        NeAACDecClose(faad);
+        faad = NULL;
+    }
+    demuxer.close();
+}
+
+bool Decoder::run() {
+    if (running || !faad) return false;
+
     stop_flag = false;
+    finished = false;
+    seek_target = -1;
+    ring.reset();
+    // Report the start position until the decoder thread anchors the clock
+    clock.anchor(0, start_time, 0, speed);
+    started_at = monotonic_us();
+    ended_at = 0;
     running = true;
 
     if (pthread_create(&thread_id, NULL, thread_func, this) != 0) {
         perror("Decoder: Failed to create thread");
         running = false;
+        close_input();
         return false;
     }
     return true;
 }
 
 void Decoder::stop() {
-    if (!running) return;
+    if (!running) {
+        close_input(); // opened but never run
+        return;
+    }
 
-    // Signal stop
+    // Signal stop and wake the thread if it is waiting for ring space
     stop_flag = true;
+    ring.shutdown();
 
     // Wait for thread
     if (thread_id != 0) {
@@ -72,110 +218,316 @@ void Decoder::stop() {
     }
 
     running = false;
+    close_input();
+
+    double wakeups, duty;
+    if (get_power_stats(&wakeups, &duty)) {
+        g_print("Decoder: %.1f wakeups/min, duty cycle %.1f%%\n", wakeups, duty * 100.0);
+    }
+    if (silence_saved > 0) {
+        g_print("Decoder: Skipped %.1f s of silence so far\n", (double)silence_saved / GST_SECOND);
+    }
+    if (history.enabled() && bytes_per_second > 0) {
+        g_print("Decoder: Rewind memory held %.1f s in %zu KB\n",
+                (double)history.raw_bytes() / bytes_per_second, history.stored_bytes() / 1024);
+    }
+}
+
+bool Decoder::get_power_stats(double* wakeups_per_minute, double* duty_cycle) const {
+    gint64 start = started_at;
+    if (start == 0) return false;
+    gint64 end = ended_at;
+    gint64 elapsed = (end ? end : monotonic_us()) - start;
+    if (elapsed <= 0) return false;
+
+    gint64 parked = (gint64)ring.producer_park_time();
+    *wakeups_per_minute = (double)ring.producer_park_count() * 60e6 / elapsed;
+    *duty_cycle = parked < elapsed ? (double)(elapsed - parked) / elapsed : 0.0;
+    return true;
 }
 
 bool Decoder::is_running() const {
     return running;
 }
 
+bool Decoder::can_seek() const {
+    return running && !finished;
+}
+
+bool Decoder::seek(gint64 position) {
+    if (!can_seek()) return false;
+    if (position < 0) position = 0;
+
+    // Keep the sink from reading audio queued for the old position
+    ring.wait_for_flush();
+    seek_requested_at = monotonic_us();
+    seek_target = position;
+    // The decoder may be parked on a full ring for minutes in power-saving mode
+    ring.interrupt_producer();
+    return true;
+}
+
+void Decoder::set_speed(int value) {
+    if (value < TimeStretch::MIN_SPEED) value = TimeStretch::MIN_SPEED;
+    if (value > TimeStretch::MAX_SPEED) value = TimeStretch::MAX_SPEED;
+    speed = value;
+}
+
+void Decoder::set_skip_silence(int min_silence_ms, int threshold_db) {
+    skip_threshold_db = threshold_db;
+    skip_silence_ms = min_silence_ms > 0 ? min_silence_ms : 0;
+}
+
+void Decoder::set_rewind_memory(size_t bytes, bool compress) {
+    rewind_bytes = bytes;
+    rewind_compress = compress;
+}
+
+void Decoder::set_gain(double db) {
+    double gain = pow(10.0, db / 20.0) * LOUDNESS_UNITY_GAIN;
+    gain_q12 = gain > 32767.0 ? 32767 : (int)lround(gain);
+}
+
+gint64 Decoder::get_last_seek_latency() const {
+    return last_seek_latency;
+}
+
+// Runs on the decoder thread: reposition the demuxer, reset FAAD and drop
+// whatever PCM is still queued in the ring from the old position.
+void Decoder::apply_seek(gint64 position) {
+    ring.flush();
+    // The history restarts at the target; decoding resumes from the demuxer
+    history.clear();
+    history_start = position;
+    replaying = false;
+    // PCM written from here on starts at `position`, resampled and stretched
+    // from scratch
+    resampler.reset();
+    stretch.set_speed(speed);
+    stretch.reset();
+    skipper.reset();
+    clock.anchor(ring.written(), position, bytes_per_second, stretch.get_speed());
+
+    const SeekIndex& index = demuxer.get_index();
+    gint64 frame_start = 0;
+    unsigned long target_frame = index.frame_for_time(position, &frame_start);
+
+    // Decode one frame before the target and throw it away so the
+    // overlap-add state is primed and the first kept frame is clean.
+    unsigned long first_frame = target_frame > 0 ? target_frame - 1 : 0;
+    if (!demuxer.seek(first_frame)) {
+        g_printerr("Decoder: Failed to seek to frame %lu\n", first_frame);
+        return;
+    }
+    NeAACDecPostSeekReset(faad, (long)first_frame);
+    preroll_frames = (int)(target_frame - first_frame);
+    trim_time = position > frame_start ? position - frame_start : 0;
+    g_print("Decoder: Seeked to %lld ms (frame %lu)\n", (long long)(position / GST_MSECOND), target_frame);
+}
+
+// Runs on the decoder thread: if `position` is still in the history, replay
+// it from there instead of seeking. The demuxer and FAAD stay where they
+// are, and decoding picks up again once the replay has caught up.
+bool Decoder::replay_from_history(gint64 position, PerfSlot* stats) {
+    if (!history.enabled() || position < history_start) return false;
+    uint64_t frame = (uint64_t)((position - history_start) * (gint64)format.rate / GST_SECOND);
+    if (frame < history.first_frame() || frame >= history.end_frame()) return false;
+
+    ring.flush();
+    stretch.set_speed(speed);
+    stretch.reset();
+    skipper.reset();
+    clock.anchor(ring.written(), position, bytes_per_second, stretch.get_speed());
+    replay_frame = frame;
+    replaying = true;
+    g_print("Decoder: Replaying %lld ms from memory\n",
+            (long long)((history.end_frame() - frame) * 1000 / format.rate));
+    if (stats) stats->count(PERF_REWINDS);
+    return true;
+}
+
 void* Decoder::thread_func(void* arg) {
     Decoder* self = static_cast<Decoder*>(arg);
     self->decode_loop();
+    self->ended_at = monotonic_us();
+    self->finished = true;
+    // Lets the sink drain what is queued and then signal end-of-stream
+    self->ring.close();
     return NULL;
 }
 
 void Decoder::decode_loop() {
     g_print("Decoder: Starting for %s\n", current_filepath.c_str());
 
-    std::lock_guard<std::mutex> lock(mp4_mutex);
-
-    if (mp4read_open(const_cast<char*>(current_filepath.c_str())) != 0) {
-        g_printerr("Decoder: Failed to open file with mp4read: %s\n", current_filepath.c_str());
-        return;
+    preroll_frames = 0;
+    trim_time = 0;
+    replaying = false;
+    if (this->start_time > 0) {
+        apply_seek(this->start_time);
+    } else {
+        demuxer.seek(0); // Start from beginning
+        clock.anchor(ring.written(), 0, bytes_per_second, stretch.get_speed());
+        history.clear();
+        history_start = 0;
     }
 
-    NeAACDecHandle hDecoder = NeAACDecOpen();
-    if (!hDecoder) {
-        g_printerr("Decoder: Failed to open FAAD2 decoder\n");
-        mp4read_close();
-        return;
-    }
+    bool measuring_seek = false;
+    int skipper_ms = -1, skipper_db = 0;
+    // NULL unless stats are on; then every step below is timed
+    PerfSlot* stats = perf_stats_slot("decoder");
+    uint64_t t0 = 0, t1 = 0;
+
+    while (!stop_flag) {
+        gint64 target = seek_target.exchange(-1);
+        if (target >= 0) {
+            if (!replay_from_history(target, stats)) apply_seek(target);
+            measuring_seek = true;
+        }
 
-    NeAACDecConfigurationPtr config = NeAACDecGetCurrentConfiguration(hDecoder);
-    config->outputFormat = FAAD_FMT_16BIT;
-    config->downMatrix = 1;
-    NeAACDecSetConfiguration(hDecoder, config);
+        unsigned char* pcm;
+        ssize_t to_write;
+        unsigned long channels = format.channels;
+
+        if (replaying) {
+            // Recently decoded audio again, until it catches up with the
+            // demuxer, which never moved
+            size_t frames = history.read(replay_frame, &replayed);
+            if (frames == 0) {
+                replaying = false;
+                continue;
+            }
+            replay_frame += frames;
+            pcm = reinterpret_cast<unsigned char*>(&replayed[0]);
+            to_write = frames * channels * 2;
+        } else {
+            if (stats) t0 = perf_now_ns();
+            if (!demuxer.read_frame()) {
+                break;
+            }
+            if (stats) t1 = perf_now_ns();
+
+            NeAACDecFrameInfo frameInfo;
+            void* sample_buffer = NeAACDecDecode(faad, &frameInfo,
+                                                 const_cast<unsigned char*>(demuxer.frame_data()),
+                                                 demuxer.frame_size());
+            if (stats) {
+                uint64_t t2 = perf_now_ns();
+                stats->time(PERF_DEMUX, t1 - t0);
+                stats->time(PERF_DECODE, t2 - t1);
+                stats->count(PERF_FRAMES);
+            }
 
-    unsigned long samplerate;
-    unsigned char channels;
-    if (NeAACDecInit2(hDecoder, mp4config.asc.buf, mp4config.asc.size, &samplerate, &channels) < 0) {
-        g_printerr("Decoder: Failed to initialize FAAD2 with ASC\n");
-        NeAACDecClose(hDecoder);
-        mp4read_close();
-        return;
-    }
-    g_print("Decoder: Starting for %d %d\n", samplerate, channels);
+            if (frameInfo.error > 0) {
+                 g_printerr("Decoder: FAAD Warning: %s\n", NeAACDecGetErrorMessage(frameInfo.error));
+                 if (stats) stats->faad_error(frameInfo.error);
+                 continue;
+            }
 
-    if (this->start_time > 0) {
-        unsigned long samples_per_frame = 1024;
-        if (mp4config.frame.nsamples > 0 && mp4config.samples > 0) {
-             samples_per_frame = mp4config.samples / mp4config.frame.nsamples;
-        }
-        
-        unsigned long target_frame = (unsigned long)((double)this->start_time * samplerate / samples_per_frame);
-        
-        if (target_frame < mp4config.frame.nsamples) {
-             if (mp4read_seek(target_frame) == 0) {
-                 g_print("Decoder: Seeked to %d seconds (frame %lu)\n", this->start_time, target_frame);
-             } else {
-                 g_printerr("Decoder: Failed to seek to frame %lu\n", target_frame);
-             }
-        }
-    } else {
-        mp4read_seek(0); // Start from beginning
-    }
+            if (preroll_frames > 0) {
+                preroll_frames--;
+                continue;
+            }
 
-    int fd = open(PIPE_PATH, O_WRONLY);
-    if (fd == -1) {
-        perror("Decoder: Failed to open pipe");
-        NeAACDecClose(hDecoder);
-        mp4read_close();
-        return;
-    }
+            if (frameInfo.samples == 0) continue;
+            if (frameInfo.channels != faad_channels) {
+                g_printerr("Decoder: Dropping frame with %d channels, expected %u\n",
+                           frameInfo.channels, faad_channels);
+                if (stats) stats->count(PERF_FRAMES_DROPPED);
+                continue;
+            }
+            pcm = static_cast<unsigned char*>(sample_buffer);
+            to_write = frameInfo.samples * 2;
+
+            // First frame after a seek: drop the samples before the target
+            if (trim_time > 0) {
+                unsigned long skip = (unsigned long)(trim_time * (gint64)faad_rate / GST_SECOND) * faad_channels;
+                trim_time = 0;
+                if (skip >= frameInfo.samples) continue;
+                pcm += skip * 2;
+                to_write -= skip * 2;
+            }
 
-    while (true) {
-        if (mp4read_frame() != 0) {
-            break;
+            // Both copies of an upmixed mono frame are the same: keep one,
+            // which halves everything downstream
+            if (mono_from_stereo) {
+                int16_t* samples = reinterpret_cast<int16_t*>(pcm);
+                size_t frames = to_write / 4;
+                for (size_t i = 0; i < frames; ++i) samples[i] = samples[2 * i];
+                to_write = frames * 2;
+            }
+
+            if (!resampler.is_passthrough()) {
+                resampler.process(reinterpret_cast<const int16_t*>(pcm), to_write / (2 * channels), &resampled);
+                if (resampled.empty()) continue;
+                pcm = reinterpret_cast<unsigned char*>(&resampled[0]);
+                to_write = resampled.size() * 2;
+            }
+
+            // Kept in book time, before speed and silence skipping, so a
+            // replay goes through both with the settings of its own time
+            history.append(reinterpret_cast<const int16_t*>(pcm), to_write / (2 * channels));
         }
 
-        NeAACDecFrameInfo frameInfo;
-        void* sample_buffer = NeAACDecDecode(hDecoder, &frameInfo, 
-                                             mp4config.bitbuf.data, 
-                                             mp4config.bitbuf.size);
+        if (!stretch.is_passthrough()) {
+            stretch.process(reinterpret_cast<const int16_t*>(pcm), to_write / (2 * channels), &stretched);
+            if (stretched.empty()) continue;
+            pcm = reinterpret_cast<unsigned char*>(&stretched[0]);
+            to_write = stretched.size() * 2;
+        }
 
-        if (frameInfo.error > 0) {
-             g_printerr("Decoder: FAAD Warning: %s\n", NeAACDecGetErrorMessage(frameInfo.error));
-             continue;
+        // Cut long stretches of dead air short
+        int silence_ms = skip_silence_ms;
+        int threshold_db = skip_threshold_db;
+        if (silence_ms != skipper_ms || threshold_db != skipper_db) {
+            skipper.set_params(silence_ms, threshold_db);
+            skipper_ms = silence_ms;
+            skipper_db = threshold_db;
+        }
+        cuts.clear();
+        if (!skipper.is_idle()) {
+            skipper.process(reinterpret_cast<const int16_t*>(pcm), to_write / (2 * channels), &unsilenced, &cuts);
+            pcm = unsilenced.empty() ? pcm : reinterpret_cast<unsigned char*>(&unsilenced[0]);
+            to_write = unsilenced.size() * 2;
         }
 
-        if (frameInfo.samples > 0) {
-            ssize_t to_write = frameInfo.samples * 2; 
-            
-            ssize_t written = write(fd, sample_buffer, to_write);
+        // Wait for room in the ring. Stop and seek requests wake the
+        // wait, so it can be long and the CPU stays idle meanwhile.
+        if (stats) t0 = perf_now_ns();
+        while (to_write > 0 && !stop_flag && seek_target < 0
+               && !ring.wait_for_space(to_write, PRODUCER_WAIT_MS)) {
+        }
+        if (stats) stats->time(PERF_WRITE_WAIT, perf_now_ns() - t0);
+        if (stop_flag) break;
+        if (seek_target >= 0) continue; // drop this frame, seek first
+
+        // Tell the clock where audio went missing, so the position
+        // jumps over the cut just as the listener does
+        for (size_t i = 0; i < cuts.size(); ++i) {
+            gint64 saved = (gint64)cuts[i].frames * GST_SECOND / format.rate;
+            clock.skip(ring.written() + cuts[i].out_frame * channels * 2,
+                       saved * stretch.get_speed() / TimeStretch::MIN_SPEED, ring.released());
+            silence_saved += saved;
+        }
+        if (to_write == 0) continue;
 
-            if (written == -1) {
-                if (errno == EPIPE) {
-                    break;
-                }
-                perror("Decoder: write error");
-                break;
+        int gain = gain_q12;
+        if (gain != LOUDNESS_UNITY_GAIN) {
+            loudness_apply_gain(reinterpret_cast<int16_t*>(pcm), to_write / 2, gain);
+        }
+        ring.write(pcm, to_write);
+
+        if (measuring_seek) {
+            measuring_seek = false;
+            last_seek_latency = monotonic_us() - seek_requested_at;
+            g_print("Decoder: Seek latency %lld us\n", (long long)last_seek_latency);
+            if (stats) {
+                stats->count(PERF_SEEKS);
+                stats->time(PERF_SEEK, (uint64_t)last_seek_latency * 1000);
             }
         }
     }
 
-    close(fd);
-    NeAACDecClose(hDecoder);
-    mp4read_close();
+    close_input();
     g_print("Decoder: Thread exiting.\n");
 }
 
@@ -183,17 +535,44 @@ void Decoder::decode_loop() {
 // MusicBackend Implementation
 // =================================================================================
 
+// While seeks keep arriving (repeated FF/REW taps), run at most one this often
+static const gint64 SEEK_THROTTLE_US = 250 * 1000;
+
 MusicBackend::MusicBackend() 
-    : is_playing(false), is_paused(false), pipeline(NULL), bus(NULL), bus_watch_id(0),
-      stopping(false), on_eos_callback(NULL), eos_user_data(NULL), last_position(0), current_samplerate(44100), total_duration(0)
+    : is_playing(false), is_paused(false),
+      cover_offset(0), cover_size(0), current_samplerate(44100), total_duration(0),
+      next_seq(0), worker_thread(0), worker_started(false),
+      issued_seq(0), pending_seek_position(-1), playback_speed(TimeStretch::MIN_SPEED),
+      pending_seek_seq(0),
+      on_eos_callback(NULL), eos_user_data(NULL), on_metadata_callback(NULL), metadata_user_data(NULL),
+      on_state_callback(NULL), state_user_data(NULL),
+      sink_generation(0), engine_playing(false), engine_paused(false), last_seek_at(0),
+      stopping(false), last_open_latency(-1),
+      buffer_depth_ms(2000), buffer_low_ms(1000), buffer_high_ms(2000),
+      power_save(false),
+      normalize(true), scan_thread(0), scan_started(false), scan_cancel(false)
 {
     signal(SIGPIPE, SIG_IGN);
-    gst_init(NULL, NULL);
     decoder = std::unique_ptr<Decoder>(new Decoder());
+    meta_cache.open(lark_data_path(".lark_meta"));
+
+    if (pthread_create(&worker_thread, NULL, worker_func, this) == 0) {
+        worker_started = true;
+    } else {
+        perror("Backend: Failed to create command thread");
+    }
 }
 
 MusicBackend::~MusicBackend() {
-    stop();
+    if (worker_started) {
+        post(CMD_STOP);
+        post(CMD_QUIT);
+        pthread_join(worker_thread, NULL);
+        worker_started = false;
+    } else {
+        do_stop();
+    }
+    stop_loudness_scan();
 }
 
 bool MusicBackend::is_shutting_down() const {
@@ -209,227 +588,575 @@ void MusicBackend::set_eos_callback(EosCallback callback, void* user_data) {
     eos_user_data = user_data;
 }
 
-gint64 MusicBackend::get_duration() {
-    if (total_duration > 0) return total_duration;
+void MusicBackend::set_metadata_callback(MetadataCallback callback, void* user_data) {
+    on_metadata_callback = callback;
+    metadata_user_data = user_data;
+}
 
-    if (pipeline) {
-        GstFormat format = GST_FORMAT_TIME;
-        gint64 duration;
-        if (gst_element_query_duration(pipeline, &format, &duration)) {
-            return duration;
-        }
-    }
-    return 0;
+void MusicBackend::set_state_callback(StateCallback callback, void* user_data) {
+    on_state_callback = callback;
+    state_user_data = user_data;
 }
 
-gint64 MusicBackend::get_position() {
-    if (is_paused) {
-        return last_position;
+void MusicBackend::notify_state() {
+    if (on_state_callback) {
+        on_state_callback(state_user_data);
     }
+}
 
-    if (pipeline && is_playing) {
-        GstClock *clock = gst_element_get_clock(pipeline);
-        if (clock) {
-            GstClockTime current_time = gst_clock_get_time(clock);
-            GstClockTime base_time = gst_element_get_base_time(pipeline);
-            gst_object_unref(clock);
+// --- Main thread: queue commands, answer from published state ---
+
+guint64 MusicBackend::post(CommandType type, const std::string& filepath, gint64 value) {
+    guint64 seq;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        Command cmd;
+        cmd.type = type;
+        cmd.filepath = filepath;
+        cmd.value = value;
+        cmd.seq = seq = ++next_seq;
+        queue.push_back(cmd);
+    }
+    queue_cond.notify_one();
 
-            if (GST_CLOCK_TIME_IS_VALID(base_time) && current_time > base_time) {
-                return (gint64)(current_time - base_time) + last_position;
-            }
-        }
+    // Sink events are posted from other threads too, but are not UI intent
+    if (type != CMD_SINK_EOS && type != CMD_SINK_ERROR && type != CMD_SINK_LATENCY
+        && type != CMD_LOUDNESS) {
+        issued_seq = seq;
     }
-    return last_position;
+    return seq;
+}
+
+void MusicBackend::play_file(const char* filepath, int start_time) {
+    if (!filepath) return;
+    current_filepath_str = filepath;
+    is_playing = true;
+    is_paused = false;
+    pending_seek_position = (gint64)start_time * GST_SECOND;
+    pending_seek_seq = post(CMD_PLAY, filepath, pending_seek_position);
+    notify_state();
+}
+
+void MusicBackend::seek(int position) {
+    if (current_filepath_str.empty()) return;
+    if (position < 0) position = 0;
+
+    // Report the target right away, so relative jumps issued before the
+    // backend gets to this one build on it
+    pending_seek_position = (gint64)position * GST_SECOND;
+    pending_seek_seq = post(CMD_SEEK, std::string(), pending_seek_position);
+    notify_state();
+}
+
+void MusicBackend::pause() {
+    if (!is_playing) return;
+    is_paused = !is_paused;
+    post(CMD_PAUSE, std::string(), is_paused ? 1 : 0);
+    notify_state();
+}
+
+void MusicBackend::stop() {
+    is_playing = false;
+    is_paused = false;
+    pending_seek_position = -1;
+    post(CMD_STOP);
+    notify_state();
+}
+
+void MusicBackend::set_speed(int speed) {
+    if (speed < TimeStretch::MIN_SPEED) speed = TimeStretch::MIN_SPEED;
+    if (speed > TimeStretch::MAX_SPEED) speed = TimeStretch::MAX_SPEED;
+    if (speed == playback_speed) return;
+    playback_speed = speed;
+    post(CMD_SET_SPEED, std::string(), speed);
 }
 
 void MusicBackend::read_metadata(const char* filepath) {
-    std::lock_guard<std::mutex> lock(mp4_mutex);
-    meta_title.clear();
-    meta_artist.clear();
-    meta_album.clear();
-    cover_art.clear();
-    chapters.clear();
     if (filepath == nullptr) return;
+    post(CMD_READ_METADATA, filepath);
+}
+
+gint64 MusicBackend::get_duration() {
+    return total_duration;
+}
+
+gint64 MusicBackend::get_position() {
+    if (pending_seek_position >= 0) return pending_seek_position;
+    return decoder->get_position();
+}
+
+void MusicBackend::set_buffer_depth(int depth_ms, int low_ms, int high_ms) {
+    int depth = depth_ms > 0 ? depth_ms : 2000;
+    int high = (high_ms > 0 && high_ms <= depth) ? high_ms : depth;
+    int low = (low_ms >= 0 && low_ms < high) ? low_ms : high / 2;
+    buffer_depth_ms = depth;
+    buffer_high_ms = high;
+    buffer_low_ms = low;
+}
+
+void MusicBackend::set_skip_silence(int min_silence_ms, int threshold_db) {
+    decoder->set_skip_silence(min_silence_ms, threshold_db);
+}
+
+gint64 MusicBackend::get_silence_saved() const {
+    return decoder->get_silence_saved();
+}
+
+void MusicBackend::set_normalize(bool enabled) {
+    post(CMD_SET_NORMALIZE, std::string(), enabled ? 1 : 0);
+}
+
+void MusicBackend::set_output_rate(unsigned rate) {
+    decoder->set_output_rate(rate);
+}
+
+void MusicBackend::set_rewind_memory(size_t bytes) {
+    decoder->set_rewind_memory(bytes);
+}
+
+void MusicBackend::set_audio_sink(const char* spec) {
+    post(CMD_SET_SINK, spec ? spec : "");
+}
+
+void MusicBackend::set_power_save(bool enabled) {
+    power_save = enabled;
+}
+
+bool MusicBackend::get_power_stats(double* wakeups_per_minute, double* duty_cycle) const {
+    return decoder->get_power_stats(wakeups_per_minute, duty_cycle);
+}
+
+gint64 MusicBackend::get_last_seek_latency() const {
+    return decoder->get_last_seek_latency();
+}
+
+void MusicBackend::play_chapter(size_t index) {
+    if (index >= chapters.size()) return;
+    if (current_filepath_str.empty()) return;
+
+    // Same as seek() / play_file(), at the chapter's start to the 100 ns
+    // rather than rounded down to the second
+    pending_seek_position = chapters.start(index);
+    if (is_playing || is_paused) {
+        pending_seek_seq = post(CMD_SEEK, std::string(), pending_seek_position);
+    } else {
+        is_playing = true;
+        is_paused = false;
+        pending_seek_seq = post(CMD_PLAY, current_filepath_str, pending_seek_position);
+    }
+    notify_state();
+}
 
-    mp4config.verbose.tags = 1;
+// --- Main loop side of the replies ---
+
+struct BackendState {
+    MusicBackend* self;
+    guint64 seq;
+    bool playing;
+    bool paused;
+};
+
+gboolean MusicBackend::apply_state_cb(gpointer data) {
+    BackendState* state = static_cast<BackendState*>(data);
+    MusicBackend* self = state->self;
+
+    // Commands posted after this one already set the state they expect
+    bool changed = false;
+    if (state->seq >= self->issued_seq) {
+        changed = self->is_playing != state->playing || self->is_paused != state->paused;
+        self->is_playing = state->playing;
+        self->is_paused = state->paused;
+    }
+    if (self->pending_seek_position >= 0 && state->seq >= self->pending_seek_seq) {
+        self->pending_seek_position = -1;
+    }
+    delete state;
+    if (changed) {
+        self->notify_state();
+    }
+    return FALSE;
+}
+
+struct MetadataResult {
+    MusicBackend* self;
+    std::string filepath;
+    bool ok;
+    MetaCache::Entry entry;
+};
+
+gboolean MusicBackend::apply_metadata_cb(gpointer data) {
+    MetadataResult* result = static_cast<MetadataResult*>(data);
+    MusicBackend* self = result->self;
+    const MetaCache::Entry& entry = result->entry;
+
+    self->meta_filepath = result->filepath;
+    self->meta_title = entry.title;
+    self->meta_artist = entry.artist;
+    self->meta_album = entry.album;
+    self->cover_offset = entry.cover_offset;
+    self->cover_size = entry.cover_size;
+    self->total_duration = result->ok ? entry.duration : 0;
+    if (entry.samplerate > 0) {
+        self->current_samplerate = (int)entry.samplerate;
+    }
+
+    self->chapters.assign(entry.chapters, self->total_duration, result->filepath);
+
+    if (self->on_metadata_callback) {
+        self->on_metadata_callback(self->metadata_user_data);
+    }
+    delete result;
+    return FALSE;
+}
 
-    if (mp4read_open((char*)filepath) == 0) {
-        if (mp4config.meta_title) meta_title = mp4config.meta_title;
-        if (mp4config.meta_artist) meta_artist = mp4config.meta_artist;
-        if (mp4config.meta_album) meta_album = mp4config.meta_album;
-        if (mp4config.cover_art.data && mp4config.cover_art.size > 0) {
-            cover_art.assign(mp4config.cover_art.data, mp4config.cover_art.data + mp4config.cover_art.size);
+gboolean MusicBackend::notify_eos_cb(gpointer data) {
+    MusicBackend* self = static_cast<MusicBackend*>(data);
+    if (self->on_eos_callback) {
+        self->on_eos_callback(self->eos_user_data);
+    }
+    return FALSE;
+}
+
+// --- Backend thread ---
+
+void* MusicBackend::worker_func(void* arg) {
+    static_cast<MusicBackend*>(arg)->worker_loop();
+    return NULL;
+}
+
+// Pop the next command, collapsing what a newer command makes redundant
+bool MusicBackend::next_command(Command* cmd) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (queue.empty()) {
+        queue_cond.wait(lock);
+    }
+    *cmd = queue.front();
+    queue.pop_front();
+
+    if (cmd->type == CMD_PLAY) {
+        // Only the last of several queued file switches matters
+        while (!queue.empty() && queue.front().type == CMD_PLAY) {
+            *cmd = queue.front();
+            queue.pop_front();
         }
-        
-        if (mp4config.chapter_count > 0 && mp4config.chapters) {
-            chapters.clear();
-            for (uint32_t i = 0; i < mp4config.chapter_count; ++i) {
-                MusicBackend::Chapter ch;
-                ch.timestamp = (gint64)(mp4config.chapters[i].timestamp / 10000000ULL);
-                if (mp4config.chapters[i].title) ch.title = mp4config.chapters[i].title;
-                else ch.title = "";
-                chapters.push_back(ch);
+    } else if (cmd->type == CMD_SEEK) {
+        // A burst of seeks: the first runs at once, later ones at most every
+        // SEEK_THROTTLE_US, each time to the newest target
+        gint64 wait_until = last_seek_at + SEEK_THROTTLE_US;
+        for (;;) {
+            while (!queue.empty() && queue.front().type == CMD_SEEK) {
+                *cmd = queue.front();
+                queue.pop_front();
             }
+            if (!queue.empty()) break; // don't hold up anything else
+            gint64 now = monotonic_us();
+            if (now >= wait_until) break;
+            queue_cond.wait_for(lock, std::chrono::microseconds(wait_until - now));
         }
+    }
+    return cmd->type != CMD_QUIT;
+}
 
-        NeAACDecHandle hDecoder = NeAACDecOpen();
-        if (hDecoder) {
-             NeAACDecConfigurationPtr config = NeAACDecGetCurrentConfiguration(hDecoder);
-             config->outputFormat = FAAD_FMT_16BIT;
-             NeAACDecSetConfiguration(hDecoder, config);
-
-             unsigned long rate = 0;
-             unsigned char channels = 0;
-             if (NeAACDecInit2(hDecoder, mp4config.asc.buf, mp4config.asc.size, &rate, &channels) >= 0) {
-                 if (rate > 0) {
-                     current_samplerate = (int)rate;
-                 }
-             }
-             NeAACDecClose(hDecoder);
+void MusicBackend::worker_loop() {
+    Command cmd;
+    while (next_command(&cmd)) {
+        std::unique_lock<std::mutex> lock(engine_mutex);
+        switch (cmd.type) {
+            case CMD_PLAY:
+                do_play_file(cmd.filepath, cmd.value);
+                break;
+            case CMD_SEEK:
+                do_seek(cmd.value);
+                last_seek_at = monotonic_us();
+                break;
+            case CMD_PAUSE:
+                do_pause(cmd.value != 0);
+                break;
+            case CMD_STOP:
+                do_stop();
+                break;
+            case CMD_READ_METADATA:
+                lock.unlock(); // does not touch the pipeline
+                do_read_metadata(cmd.filepath);
+                lock.lock();
+                break;
+            case CMD_SET_SPEED:
+                do_set_speed((int)cmd.value);
+                break;
+            case CMD_SET_NORMALIZE:
+                normalize = cmd.value != 0;
+                if (!engine_filepath.empty()) apply_loudness(engine_filepath);
+                break;
+            case CMD_LOUDNESS:
+                if (normalize && cmd.filepath == engine_filepath) {
+                    double gain = NORMALIZE_TARGET_LUFS - cmd.value / 100.0;
+                    gain = std::max(-MAX_NORMALIZE_DB, std::min(MAX_NORMALIZE_DB, gain));
+                    decoder->set_gain(gain);
+                    g_print("Backend: Normalizing by %+.1f dB\n", gain);
+                }
+                break;
+            case CMD_SET_SINK:
+                sink_spec = cmd.filepath;
+                break;
+            case CMD_SINK_LATENCY:
+                if ((guint)cmd.value == sink_generation && sink) {
+                    sink->update_latency();
+                }
+                break;
+            case CMD_SINK_EOS:
+            case CMD_SINK_ERROR:
+                // Ignore events from a sink that has since been replaced
+                if ((guint)cmd.value != sink_generation || !sink) break;
+                do_stop();
+                if (cmd.type == CMD_SINK_EOS) {
+                    g_idle_add(notify_eos_cb, this);
+                }
+                break;
+            case CMD_QUIT:
+                break;
         }
-        
-        if (mp4config.samplerate > 0 && mp4config.samples > 0) {
-            total_duration = (gint64)mp4config.samples * GST_SECOND / mp4config.samplerate;
-        } else {
-            total_duration = 0;
+        publish_state(cmd.seq);
+    }
+}
+
+void MusicBackend::publish_state(guint64 seq) {
+    BackendState* state = new BackendState;
+    state->self = this;
+    state->seq = seq;
+    state->playing = engine_playing;
+    state->paused = engine_paused;
+    g_idle_add(apply_state_cb, state);
+}
+
+void MusicBackend::do_read_metadata(const std::string& filepath) {
+    MetadataResult* result = new MetadataResult;
+    result->self = this;
+    result->filepath = filepath;
+
+    // Opening the file costs one fstat; the MP4 parser only runs on a cache
+    // miss. Nothing here touches the decoder, so this can run while another
+    // book is playing.
+    gint64 started = monotonic_us();
+    Mp4File meta_file;
+    MetaCache::Entry& entry = result->entry;
+    bool hit = false;
+    bool ok = meta_file.open(filepath.c_str());
+    if (ok) {
+        hit = meta_cache.lookup(filepath, meta_file.size(), meta_file.mtime(), &entry);
+        if (!hit) {
+            Mp4Demuxer demuxer;
+            ok = meta_cache_read_book(filepath.c_str(), demuxer, &entry);
+            if (ok) meta_cache.store(filepath, meta_file.size(), meta_file.mtime(), &entry);
         }
+    }
+    result->ok = ok;
 
-        mp4read_close();
+    if (ok) {
+        last_open_latency = monotonic_us() - started;
+        g_print("Backend: Metadata in %lld us (cache %s, hit rate %.0f%%)\n",
+                (long long)last_open_latency, hit ? "hit" : "miss", meta_cache.hit_rate() * 100.0);
     } else {
-        g_printerr("Backend: Failed to read metadata for %s\n", filepath);
+        result->entry = MetaCache::Entry();
+        g_printerr("Backend: Failed to read metadata for %s\n", filepath.c_str());
     }
-    
-    mp4config.verbose.tags = 0;
+    g_idle_add(apply_metadata_cb, result);
 }
 
-void MusicBackend::play_file(const char* filepath, int start_time) {
-    if (stopping) return;
+// Ring sizes must hold whole frames, so regions never split one at the wrap
+static size_t frame_align(size_t bytes, size_t frame_bytes) {
+    return bytes / frame_bytes * frame_bytes;
+}
 
-    if (is_playing || is_paused) {
-        stop();
+void MusicBackend::do_play_file(const std::string& filepath, gint64 start) {
+    if (engine_playing || engine_paused) {
+        do_stop();
     }
 
-    g_print("Backend: Playing %s from %d\n", filepath, start_time);
-    current_filepath_str = filepath;
-    is_playing = true;
-    is_paused = false;
-    last_position = start_time * GST_SECOND;
+    g_print("Backend: Playing %s from %lld ms\n", filepath.c_str(), (long long)(start / GST_MSECOND));
+    engine_filepath = filepath;
+    engine_playing = true;
+    engine_paused = false;
+
+    // The sink plays whatever format the decoder negotiated for this book.
+    // In power-saving mode it is decoded 90 s ahead, past what the default
+    // rewind memory holds, so that grows to match.
+    decoder->set_read_ahead(power_save ? POWER_SAVE_DEPTH_MS : (int)buffer_depth_ms);
+    if (!decoder->open(filepath.c_str(), start)) {
+        engine_playing = false;
+        return;
+    }
+    Decoder::Format format = decoder->get_format();
+
+    // Size the PCM ring for this file's format (16-bit)
+    size_t frame_bytes = format.channels * 2;
+    size_t bytes_per_ms = (size_t)format.rate * frame_bytes / 1000;
+    size_t chunk_bytes;
+    if (power_save) {
+        decoder->get_ring().configure(frame_align(POWER_SAVE_DEPTH_MS * bytes_per_ms, frame_bytes),
+                                      POWER_SAVE_LOW_MS * bytes_per_ms,
+                                      POWER_SAVE_DEPTH_MS * bytes_per_ms);
+        chunk_bytes = POWER_SAVE_PUSH_BYTES;
+    } else {
+        decoder->get_ring().configure(frame_align(buffer_depth_ms * bytes_per_ms, frame_bytes),
+                                      buffer_low_ms * bytes_per_ms,
+                                      buffer_high_ms * bytes_per_ms);
+        chunk_bytes = PUSH_BYTES;
+    }
+
+    sink.reset(audio_sink_create(sink_spec));
+    sink_generation++;
+    if (sink) {
+        sink->set_event_callback(sink_event_cb, this);
+    }
+    if (!sink || !sink->open(decoder.get(), frame_align(chunk_bytes, frame_bytes), sink_generation)) {
+        g_printerr("Backend: Failed to open the %s sink\n", sink ? sink->name() : "audio");
+        sink.reset();
+        decoder->stop();
+        engine_playing = false;
+        return;
+    }
 
-    int rate = (current_samplerate > 0) ? current_samplerate : 44100;
+    apply_loudness(filepath);
+    if (!decoder->run()) {
+        sink->close();
+        sink.reset();
+        engine_playing = false;
+        return;
+    }
+    sink->start();
+}
 
-    gchar *pipeline_desc = g_strdup_printf(
-        "filesrc location=\"%s\" ! audio/x-raw-int, endianness=1234, signed=true, width=16, depth=16, rate=%d, channels=2 ! queue ! mixersink",
-        PIPE_PATH, rate
-    );
-    pipeline = gst_parse_launch(pipeline_desc, NULL);
-    g_free(pipeline_desc);
+void MusicBackend::do_seek(gint64 position) {
+    if (engine_filepath.empty()) return;
 
-    if (!pipeline) {
-        g_printerr("Backend: Failed to create pipeline\n");
-        is_playing = false;
+    if (sink && decoder->can_seek() && sink->seek(position)) {
+        g_print("Backend: Seek to %lld ms in running decoder\n", (long long)(position / GST_MSECOND));
         return;
     }
 
-    bus = gst_element_get_bus(pipeline);
-    bus_watch_id = gst_bus_add_watch(bus, bus_callback_func, this);
-    gst_object_unref(bus);
+    // Decoder already hit EOF or never started: rebuild everything
+    do_play_file(engine_filepath, position);
+}
+
+void MusicBackend::do_set_speed(int speed) {
+    decoder->set_speed(speed);
+    if (!sink || !decoder->can_seek()) return; // used by the next play
 
-    if (!decoder->start(filepath, start_time)) {
-        cleanup_pipeline();
+    // Audio queued in the ring and the sink was stretched for the old speed:
+    // flush it with a seek to what is being heard right now
+    gint64 position = decoder->get_position();
+    if (sink->seek(position)) {
+        g_print("Backend: Speed %d.%02dx at %lld ms\n", speed / 1000, (speed % 1000) / 10,
+                (long long)(position / GST_MSECOND));
+    }
+}
+
+// Set the decoder gain for `filepath` from its cached loudness, or measure
+// the book in the background first
+void MusicBackend::apply_loudness(const std::string& filepath) {
+    decoder->set_gain(0.0);
+    if (!normalize) return;
+
+    Mp4File file;
+    float loudness;
+    if (file.open(filepath.c_str())
+        && meta_cache.get_loudness(filepath, file.size(), file.mtime(), &loudness)) {
+        double gain = NORMALIZE_TARGET_LUFS - loudness;
+        decoder->set_gain(std::max(-MAX_NORMALIZE_DB, std::min(MAX_NORMALIZE_DB, gain)));
         return;
     }
+    start_loudness_scan(filepath);
+}
 
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+struct LoudnessScanJob {
+    MusicBackend* self;
+    std::string filepath;
+};
+
+void MusicBackend::start_loudness_scan(const std::string& filepath) {
+    if (scan_started && scan_path == filepath) return;
+    stop_loudness_scan();
+
+    LoudnessScanJob* job = new LoudnessScanJob;
+    job->self = this;
+    job->filepath = filepath;
+    scan_cancel = false;
+    if (pthread_create(&scan_thread, NULL, loudness_scan_func, job) != 0) {
+        perror("Backend: Failed to create loudness scan thread");
+        delete job;
+        return;
+    }
+    scan_started = true;
+    scan_path = filepath;
 }
 
-void MusicBackend::pause() {
-    if (!pipeline || !is_playing) return;
-
-    if (is_paused) {
-        GstClock *clock = gst_element_get_clock(pipeline);
-        if (clock) {
-            GstClockTime current_time = gst_clock_get_time(clock);
-            GstClockTime base_time = gst_element_get_base_time(pipeline);
-            gst_object_unref(clock);
-
-            if (GST_CLOCK_TIME_IS_VALID(base_time) && current_time > base_time) {
-                gint64 running_time = (gint64)(current_time - base_time);
-                last_position -= running_time;
-            }
+void MusicBackend::stop_loudness_scan() {
+    if (!scan_started) return;
+    scan_cancel = true;
+    pthread_join(scan_thread, NULL);
+    scan_started = false;
+    scan_path.clear();
+}
+
+void* MusicBackend::loudness_scan_func(void* arg) {
+    LoudnessScanJob* job = static_cast<LoudnessScanJob*>(arg);
+    MusicBackend* self = job->self;
+
+    lark_set_background_priority();
+
+    gint64 started = monotonic_us();
+    double lufs;
+    if (loudness_scan(job->filepath.c_str(), &lufs, &self->scan_cancel)) {
+        g_print("Backend: Loudness %.1f LUFS in %lld ms for %s\n", lufs,
+                (long long)((monotonic_us() - started) / 1000), job->filepath.c_str());
+        Mp4File file;
+        if (file.open(job->filepath.c_str())) {
+            self->meta_cache.set_loudness(job->filepath, file.size(), file.mtime(), (float)lufs);
         }
-        
-        gst_element_set_state(pipeline, GST_STATE_PLAYING);
-        is_paused = false;
-    } else {
-        last_position = get_position();
-        gst_element_set_state(pipeline, GST_STATE_PAUSED);
-        is_paused = true;
+        self->post(CMD_LOUDNESS, job->filepath, (gint64)lround(lufs * 100.0));
     }
+    delete job;
+    return NULL;
 }
 
-void MusicBackend::stop() {
+void MusicBackend::do_pause(bool paused) {
+    if (!sink || !engine_playing || paused == engine_paused) return;
+
+    // The playback clock stops by itself: a paused sink consumes nothing
+    sink->set_paused(paused);
+    engine_paused = paused;
+}
+
+void MusicBackend::do_stop() {
     if (stopping) return;
     stopping = true;
 
-    if (pipeline) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
+    // Wake a sink waiting for audio so it can be shut down
+    decoder->get_ring().shutdown();
+
+    if (sink) {
+        sink->close();
     }
 
     decoder->stop();
+    sink.reset();
 
-    cleanup_pipeline();
-    
     stopping = false;
-    is_playing = false;
-    is_paused = false;
+    engine_playing = false;
+    engine_paused = false;
 }
 
-void MusicBackend::cleanup_pipeline() {
-    if (bus_watch_id > 0) {
-        g_source_remove(bus_watch_id);
-        bus_watch_id = 0;
-    }
-    if (pipeline) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
-        gst_object_unref(pipeline);
-        pipeline = NULL;
-    }
-}
-
-gboolean MusicBackend::bus_callback_func(GstBus *bus, GstMessage *msg, gpointer data) {
-    MusicBackend* self = static_cast<MusicBackend*>(data);
-
-    switch (GST_MESSAGE_TYPE(msg)) {
-        case GST_MESSAGE_EOS:
-            g_print("Backend: EOS reached.\n");
-            self->stop(); 
-
-            if (self->on_eos_callback) {
-                self->on_eos_callback(self->eos_user_data);
-            }
+void MusicBackend::sink_event_cb(void* user_data, AudioSink::Event event, guint generation) {
+    MusicBackend* self = static_cast<MusicBackend*>(user_data);
+    switch (event) {
+        case AudioSink::SINK_EOS:
+            self->post(CMD_SINK_EOS, std::string(), generation);
             break;
-        case GST_MESSAGE_ERROR: {
-            GError *err;
-            gchar *debug;
-            gst_message_parse_error(msg, &err, &debug);
-            g_printerr("Backend: Error: %s\n", err->message);
-            g_error_free(err);
-            g_free(debug);
-            self->stop();
+        case AudioSink::SINK_ERROR:
+            self->post(CMD_SINK_ERROR, std::string(), generation);
             break;
-        }
-        default:
+        case AudioSink::SINK_LATENCY:
+            self->post(CMD_SINK_LATENCY, std::string(), generation);
             break;
     }
-    return TRUE;
-}
-
-/* New: play_chapter implementation */
-void MusicBackend::play_chapter(size_t index) {
-    if (index >= chapters.size()) return;
-    if (current_filepath_str.empty()) return;
-
-    gint64 sec = chapters[index].timestamp;
-    int start_time = (int)sec;
-    play_file(current_filepath_str.c_str(), start_time);
 }
@@ -2,24 +2,58 @@
 #define MUSIC_BACKEND_H
 
 #include <gst/gst.h>
+#include <faad/neaacdec.h>
 #include <string>
 #include <vector>
 #include <atomic>
 #include <pthread.h>
 #include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "mp4_demuxer.h"
+#include "pcm_ring.h"
+#include "pcm_history.h"
+#include "playback_clock.h"
+#include "resampler.h"
+#include "time_stretch.h"
+#include "silence_skip.h"
+#include "loudness.h"
+#include "meta_cache.h"
+#include "audio_sink.h"
+#include "chapter_timeline.h"
 
 // Callback type for End of Stream (song finished)
 typedef void (*EosCallback)(void* user_data);
 
+struct PerfSlot;
+
 // --- Decoder Class ---
 class Decoder {
 public:
     Decoder();
     ~Decoder();
 
-    // Start decoding the specified file in a separate thread.
-    // Returns true if thread started successfully.
-    bool start(const char* filepath, int start_time = 0);
+    // PCM format written to the ring: interleaved 16-bit at `rate` Hz
+    struct Format {
+        unsigned rate;
+        unsigned channels;
+    };
+
+    // Open `filepath` and set up FAAD on the calling thread, to decode from
+    // `start_time` (nanoseconds) once run() is called. A few frames are
+    // decoded here, because only decoded audio tells the real output format.
+    bool open(const char* filepath, gint64 start_time = 0);
+    // What open() negotiated: mono stays mono, SBR doubles the rate, more
+    // than two channels are mixed down, and the output rate wins if set
+    Format get_format() const { return format; }
+    // Start decoding the opened file in a separate thread. Returns true if
+    // the thread started successfully.
+    bool run();
+    bool start(const char* filepath, gint64 start_time = 0) {
+        return open(filepath, start_time) && run();
+    }
 
     // Stop the decoding thread.
     // This sets the stop flag and waits for the thread to join.
@@ -28,29 +62,160 @@ public:
     // Check if the decoder thread is currently running.
     bool is_running() const;
 
+    // Ask the running decoder thread to reposition to `position` (nanoseconds).
+    // The file and FAAD handle stay open. The sink is held back at once (see
+    // PcmRing::wait_for_flush()) until the decoder thread flushes the ring,
+    // so none of the PCM queued for the old position is played.
+    // Returns false if there is no live decoding thread to deliver the seek to.
+    bool seek(gint64 position);
+    bool can_seek() const;
+
+    // Playback speed in per mille (1000-3000), pitch kept. Applies from the
+    // next open() or seek(), since queued PCM is already stretched.
+    void set_speed(int speed);
+    int get_speed() const { return speed; }
+
+    // Shorten silences longer than `min_silence_ms` (0 = off) to that length;
+    // windows below `threshold_db` dBFS RMS count as silent. Takes effect
+    // from the next decoded frame.
+    static const int DEFAULT_SILENCE_DB = -40;
+    void set_skip_silence(int min_silence_ms, int threshold_db = DEFAULT_SILENCE_DB);
+    // Listening time saved by skipping silence, in ns, across all files
+    gint64 get_silence_saved() const { return silence_saved; }
+
+    // Gain applied to everything decoded from now on (dB, clipped at full scale)
+    void set_gain(double db);
+
+    // Resample to `rate` Hz (0 = the decoder's own rate) so the sink never
+    // has to. Takes effect from the next open().
+    void set_output_rate(unsigned rate) { output_rate = rate; }
+
+    // Keep up to `bytes` of the most recently decoded audio (0 = none), so
+    // seeks back into it replay from memory without demuxing or decoding.
+    // Takes effect from the next open().
+    static const size_t DEFAULT_REWIND_BYTES = 8 * 1024 * 1024;
+    void set_rewind_memory(size_t bytes, bool compress = true);
+    // How far ahead of the listener the ring may be decoded (ms). Rewinds
+    // are measured from what is heard, so the rewind memory grows by this
+    // much on top of its budget. Takes effect from the next open().
+    void set_read_ahead(int ms) { read_ahead_ms = ms > 0 ? ms : 0; }
+
+    // Decoded PCM, produced by the decoder thread and consumed by the sink
+    PcmRing& get_ring() { return ring; }
+
+    // Position of the audio leaving the sink, anchored by this decoder
+    PlaybackClock& get_clock() { return clock; }
+    gint64 get_position() const { return clock.position(ring.released()); }
+
+    // Time in microseconds from the last seek() request to the first PCM
+    // written after it, or -1 if no seek has completed yet.
+    gint64 get_last_seek_latency() const;
+
+    // Power profile of the current (or last) run: how often per minute the
+    // decoder thread woke from waiting on the ring, and the fraction of wall
+    // time it spent working rather than parked. False before the first run.
+    bool get_power_stats(double* wakeups_per_minute, double* duty_cycle) const;
+
 private:
     std::atomic<bool> stop_flag;
     std::atomic<bool> running;
+    std::atomic<bool> finished; // decode_loop has returned (EOF or error)
     pthread_t thread_id;
     std::string current_filepath;
-    int start_time;
+    gint64 start_time;
+
+    // Pending seek target in nanoseconds, -1 when none
+    std::atomic<gint64> seek_target;
+    std::atomic<gint64> seek_requested_at;
+    std::atomic<gint64> last_seek_latency;
+
+    // Start and end (0 while running) of the decoder thread, monotonic us
+    std::atomic<gint64> started_at;
+    std::atomic<gint64> ended_at;
+
+    // Per-instance demuxer and FAAD handle for the file being decoded; opened
+    // by open(), closed when the thread ends or by stop()
+    Mp4Demuxer demuxer;
+    NeAACDecHandle faad;
+    unsigned faad_rate;       // what FAAD produces
+    unsigned faad_channels;
+    bool mono_from_stereo;    // FAAD upmixes mono for PS the book never uses
+    Format format;
+    std::atomic<unsigned> output_rate;
+    Resampler resampler;
+    std::vector<int16_t> resampled;
+
+    // Recent audio in book time, for rewinds (decoder thread, but for the
+    // settings); frame 0 of the history is at `history_start`
+    std::atomic<size_t> rewind_bytes;
+    std::atomic<bool> rewind_compress;
+    std::atomic<int> read_ahead_ms;
+    PcmHistory history;
+    std::vector<int16_t> replayed;
+    bool replaying;
+    uint64_t replay_frame;
+    gint64 history_start;
+
+    PcmRing ring;
+    PlaybackClock clock;
+    guint32 bytes_per_second; // of the PCM written to the ring
+
+    // Time stretch between FAAD and the ring (decoder thread only)
+    std::atomic<int> speed;
+    TimeStretch stretch;
+    std::vector<int16_t> stretched;
+
+    // Silence skipping after the stretch (decoder thread, but for the settings)
+    std::atomic<int> skip_silence_ms;
+    std::atomic<int> skip_threshold_db;
+    std::atomic<gint64> silence_saved;
+    SilenceSkipper skipper;
+    std::vector<int16_t> unsilenced;
+    std::vector<SilenceSkipper::Cut> cuts;
+
+    std::atomic<int> gain_q12; // loudness normalization, LOUDNESS_UNITY_GAIN = 0 dB
+
+    // Decoder-thread state set by apply_seek(): frames decoded only to prime
+    // FAAD after a seek, and the time to trim from the first kept frame.
+    int preroll_frames;
+    gint64 trim_time;
+
+    bool probe_format(unsigned long* rate, unsigned* channels, bool* ps);
+    void close_input();
+    void apply_seek(gint64 position);
+    bool replay_from_history(gint64 position, PerfSlot* stats);
 
     static void* thread_func(void* arg);
     void decode_loop();
 };
 
+// Callback run on the main loop once read_metadata() has filled in the meta_* fields
+typedef void (*MetadataCallback)(void* user_data);
+// Runs on the main thread when is_playing/is_paused change or the position
+// jumps (play, seek), so the UI can refresh without polling
+typedef void (*StateCallback)(void* user_data);
+
 // --- MusicBackend Class ---
+// The backend is an actor: every call below queues a command for its own
+// thread and returns at once, so stopping a decoder or opening a slow file
+// never blocks the GTK main loop. Results come back through g_idle_add(),
+// which updates the public fields on the main thread.
 class MusicBackend {
 public:
-    // Public state for GUI
+    // Public state for GUI. Main-thread copies: set right away by the calls
+    // below and corrected when the backend thread reports what happened.
     bool is_playing;
     bool is_paused;
 
     MusicBackend();
     ~MusicBackend();
 
-    // --- Public API ---
+    // --- Public API (main thread) ---
     void play_file(const char* filepath, int start_time = 0);
+    // Jump to `position` (seconds) in the current file. Reuses the running
+    // decoder and pipeline when possible, otherwise falls back to play_file().
+    // Bursts of seeks are coalesced into one seek to the newest target.
+    void seek(int position);
     void pause();
     void stop();
     
@@ -59,50 +224,197 @@ public:
     bool is_shutting_down() const;
 
     gint64 get_duration();
+    // Lock-free: counted from the PCM the sink has consumed (see
+    // PlaybackClock), or the target of a play/seek that is still queued.
     gint64 get_position();
     const char* get_current_filepath();
 
     void set_eos_callback(EosCallback callback, void* user_data);
+    void set_metadata_callback(MetadataCallback callback, void* user_data);
+    void set_state_callback(StateCallback callback, void* user_data);
 
+    // Read tags, chapters and the cover location of `filepath` on the
+    // backend thread; the fields below are updated and the metadata
+    // callback runs when it is done.
     void read_metadata(const char* filepath);
     
+    std::string meta_filepath; // book the meta_* fields describe
     std::string meta_title;
     std::string meta_artist;
     std::string meta_album;
-    std::vector<unsigned char> cover_art;
+    // Where the embedded cover lives in the book (size 0 if none); the image
+    // itself is only read when it is rendered (see cover_cache_get_async)
+    guint64 cover_offset;
+    guint64 cover_size;
     int current_samplerate;
     gint64 total_duration;
 
-    // Chapter support
-    struct Chapter {
-        gint64 timestamp; // seconds
-        std::string title;
-    };
-    std::vector<Chapter> chapters;
+    // Chapters of the book read_metadata() last read
+    ChapterTimeline chapters;
 
-    // Play a chapter by index (will stop/restart playback at chapter time)
+    // Play the current file from the exact start of chapter `index`: seeks
+    // if it is playing or paused, otherwise starts it there
     void play_chapter(size_t index);
 
+    // Latency of the last in-place seek in microseconds (-1 if none yet)
+    gint64 get_last_seek_latency() const;
+
+    // Time the last read_metadata() took in microseconds (-1 if none yet),
+    // and the metadata cache it is served from (hit/miss counts)
+    gint64 get_last_open_latency() const { return last_open_latency; }
+    const MetaCache& get_meta_cache() const { return meta_cache; }
+    MetaCache& get_meta_cache() { return meta_cache; } // for the library scanner
+
+    // Size of the decoded PCM buffer and its watermarks, in milliseconds of
+    // audio. The decoder pauses at `high_ms` and resumes below `low_ms`.
+    // Takes effect on the next play_file().
+    void set_buffer_depth(int depth_ms, int low_ms, int high_ms);
+
+    // Playback speed in per mille (1000 = normal, up to 3000), pitch kept.
+    // Positions, chapters and history stay in book time.
+    void set_speed(int speed);
+    int get_speed() const { return playback_speed; }
+
+    // Cut silences longer than `min_silence_ms` (0 = off) down to that
+    // length. Applies at once; positions still follow the book's timeline.
+    void set_skip_silence(int min_silence_ms, int threshold_db = Decoder::DEFAULT_SILENCE_DB);
+    // Listening time saved so far by skipping silence (ns)
+    gint64 get_silence_saved() const;
+
+    // Play every book at the same loudness (on by default). Books are
+    // measured once in the background and the result is cached.
+    void set_normalize(bool enabled);
+
+    // Largest PCM region handed to the sink at a time
+    static const size_t PUSH_BYTES = 8192;
+
+    // Race-to-idle mode: decode minutes of audio ahead in one burst at full
+    // speed, then let the decoder sleep until the buffer runs low, so the
+    // SoC can stay in deep idle. Uses ~16 MB of RAM at 44.1 kHz stereo; overrides
+    // set_buffer_depth(). Takes effect on the next play_file().
+    // The ring holds up to 90 s and is refilled once only 15 s are left;
+    // the sink takes bigger regions so it wakes less often too. The rewind
+    // memory grows by the 90 s, so rewinds still replay from memory.
+    static const int POWER_SAVE_DEPTH_MS = 90 * 1000;
+    static const int POWER_SAVE_LOW_MS = 15 * 1000;
+    static const size_t POWER_SAVE_PUSH_BYTES = 64 * 1024;
+    void set_power_save(bool enabled);
+    bool get_power_stats(double* wakeups_per_minute, double* duty_cycle) const;
+
+    // Native rate of the output device (0 = play at the book's own rate).
+    // Books are resampled to it in the decoder. Takes effect on the next
+    // play_file().
+    void set_output_rate(unsigned rate);
+
+    // Memory for instant rewinds (see Decoder::set_rewind_memory); 0 turns
+    // them off. Takes effect on the next play_file().
+    void set_rewind_memory(size_t bytes);
+
+    // Where the audio goes (see audio_sink_create): "gst" (the default),
+    // "alsa" or "alsa:DEVICE", "wav:PATH" or "null". Takes effect on the
+    // next play_file().
+    void set_audio_sink(const char* spec);
+
 private:
-    std::unique_ptr<Decoder> decoder;
-    
-    GstElement *pipeline;
-    GstBus *bus;
-    guint bus_watch_id;
+    enum CommandType {
+        CMD_PLAY,
+        CMD_SEEK,
+        CMD_PAUSE,
+        CMD_STOP,
+        CMD_READ_METADATA,
+        CMD_SET_SPEED,
+        CMD_SET_NORMALIZE,
+        CMD_SET_SINK,
+        CMD_LOUDNESS,       // from the scan thread: value is LUFS * 100
+        CMD_SINK_EOS,       // from the sink: value is its generation
+        CMD_SINK_ERROR,
+        CMD_SINK_LATENCY,
+        CMD_QUIT
+    };
+    struct Command {
+        CommandType type;
+        std::string filepath;
+        gint64 value; // start/seek position (ns), pause flag or sink generation
+        guint64 seq;
+    };
 
-    std::string current_filepath_str;
-    std::atomic<bool> stopping; // Flag to indicate stop in progress
+    // --- Command queue (any thread) ---
+    std::mutex queue_mutex;
+    std::condition_variable queue_cond;
+    std::deque<Command> queue;
+    guint64 next_seq;
+    pthread_t worker_thread;
+    bool worker_started;
 
+    // --- Main-thread state ---
+    std::string current_filepath_str;
+    guint64 issued_seq;          // newest command posted
+    gint64 pending_seek_position; // target of a queued play/seek, -1 if none
+    int playback_speed;
+    guint64 pending_seek_seq;
     EosCallback on_eos_callback;
     void* eos_user_data;
-    
-    gint64 last_position;
+    MetadataCallback on_metadata_callback;
+    void* metadata_user_data;
+    StateCallback on_state_callback;
+    void* state_user_data;
+
+    void notify_state();
+
+    // --- Backend-thread state; held under engine_mutex while a command runs ---
+    std::mutex engine_mutex;
+    std::unique_ptr<Decoder> decoder;
+    std::unique_ptr<AudioSink> sink;
+    std::string sink_spec;
+    guint sink_generation; // tells events of old sinks apart
+    std::string engine_filepath;
+    bool engine_playing;
+    bool engine_paused;
+    gint64 last_seek_at; // monotonic us of the last executed seek
+
+    std::atomic<bool> stopping; // Flag to indicate stop in progress
+
+    // Book metadata, keyed by path/size/mtime; chapter titles point into it
+    MetaCache meta_cache;
+    std::atomic<gint64> last_open_latency;
+
+    std::atomic<int> buffer_depth_ms;
+    std::atomic<int> buffer_low_ms;
+    std::atomic<int> buffer_high_ms;
+    std::atomic<bool> power_save;
+
+    // Loudness normalization; one background scan at a time
+    bool normalize;
+    pthread_t scan_thread;
+    bool scan_started;
+    std::atomic<bool> scan_cancel;
+    std::string scan_path;
+
+    guint64 post(CommandType type, const std::string& filepath = std::string(), gint64 value = 0);
+    bool next_command(Command* cmd);
+    static void* worker_func(void* arg);
+    void worker_loop();
+
+    // Command handlers, run on the backend thread
+    void do_play_file(const std::string& filepath, gint64 start);
+    void do_seek(gint64 position);
+    void do_pause(bool paused);
+    void do_stop();
+    void do_read_metadata(const std::string& filepath);
+    void do_set_speed(int speed);
+    void apply_loudness(const std::string& filepath);
+    void start_loudness_scan(const std::string& filepath);
+    void stop_loudness_scan();
+    static void* loudness_scan_func(void* arg);
+    void publish_state(guint64 seq);
 
-    // Helper to cleanup GStreamer resources
-    void cleanup_pipeline();
+    // Main-loop side of the replies
+    static gboolean apply_state_cb(gpointer data);
+    static gboolean apply_metadata_cb(gpointer data);
+    static gboolean notify_eos_cb(gpointer data);
 
-    // GStreamer bus callback
-    static gboolean bus_callback_func(GstBus *bus, GstMessage *msg, gpointer data);
+    // Sink events, from any thread: forwarded to the backend thread
+    static void sink_event_cb(void* user_data, AudioSink::Event event, guint generation);
 };
 
 #endif // MUSIC_BACKEND_H
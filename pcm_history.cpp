@@ -0,0 +1,190 @@
+#include "pcm_history.h"
+#include <string.h>
+
+// Block layout: one mode byte, then either raw interleaved samples or, per
+// channel, the first sample followed by groups of GROUP zigzag-coded
+// differences, each group a width byte and GROUP values of that many bits
+enum { BLOCK_RAW = 0, BLOCK_DELTA = 1 };
+static const size_t GROUP = 32;
+
+static inline uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Largest encoding of a block: raw, or delta when nothing compresses
+static size_t max_block_size(unsigned channels) {
+    size_t groups = (PcmHistory::BLOCK_FRAMES - 1 + GROUP - 1) / GROUP;
+    size_t delta = channels * (2 + groups * (1 + GROUP * 17 / 8));
+    size_t raw = PcmHistory::BLOCK_FRAMES * channels * 2;
+    return 1 + (delta > raw ? delta : raw);
+}
+
+PcmHistory::PcmHistory() : head(0), compress(true), channels(1), pending_first(0) {
+}
+
+void PcmHistory::configure(size_t budget_bytes, bool compress_blocks, unsigned channel_count) {
+    channels = channel_count > 0 ? channel_count : 1;
+    compress = compress_blocks;
+    size_t block = max_block_size(channels);
+    if (budget_bytes > 0 && budget_bytes < 4 * block) budget_bytes = 4 * block;
+    if (store.size() != budget_bytes) {
+        std::vector<uint8_t>(budget_bytes).swap(store);
+    }
+    encoded.resize(budget_bytes > 0 ? block : 0);
+    pending.reserve(budget_bytes > 0 ? BLOCK_FRAMES * channels : 0);
+    clear();
+}
+
+void PcmHistory::clear() {
+    blocks.clear();
+    head = 0;
+    pending.clear();
+    pending_first = 0;
+}
+
+void PcmHistory::append(const int16_t* pcm, size_t frames) {
+    if (store.empty()) return;
+    while (frames > 0) {
+        size_t room = BLOCK_FRAMES - pending.size() / channels;
+        size_t n = frames < room ? frames : room;
+        pending.insert(pending.end(), pcm, pcm + n * channels);
+        pcm += n * channels;
+        frames -= n;
+        if (pending.size() == BLOCK_FRAMES * channels) seal_pending();
+    }
+}
+
+// Move the full pending block into the store, dropping the oldest blocks
+// it overwrites
+void PcmHistory::seal_pending() {
+    size_t size = encode(&pending[0], BLOCK_FRAMES);
+    if (head + size > store.size()) {
+        // Skip the tail: what lives there is older than anything at the start
+        while (!blocks.empty() && blocks.front().offset >= head) blocks.pop_front();
+        head = 0;
+    }
+    while (!blocks.empty() && blocks.front().offset < head + size
+           && blocks.front().offset + blocks.front().size > head) {
+        blocks.pop_front();
+    }
+
+    memcpy(&store[head], &encoded[0], size);
+    Block block = { pending_first, head, size, (uint32_t)BLOCK_FRAMES };
+    blocks.push_back(block);
+    head += size;
+    pending_first += BLOCK_FRAMES;
+    pending.clear();
+}
+
+size_t PcmHistory::encode(const int16_t* pcm, size_t frames) {
+    uint8_t* out = &encoded[0];
+    size_t raw = frames * channels * 2;
+    if (compress) {
+        uint8_t* p = out + 1;
+        uint8_t* limit = out + 1 + raw; // give up once it would not shrink
+        for (unsigned ch = 0; ch < channels && p < limit; ++ch) {
+            const int16_t* s = pcm + ch;
+            memcpy(p, s, 2);
+            p += 2;
+            for (size_t i = 1; i < frames && p < limit; i += GROUP) {
+                uint32_t d[GROUP];
+                uint32_t all = 0;
+                size_t n = frames - i < GROUP ? frames - i : GROUP;
+                for (size_t k = 0; k < n; ++k) {
+                    size_t j = (i + k) * channels;
+                    d[k] = zigzag((int32_t)s[j] - s[j - channels]);
+                    all |= d[k];
+                }
+                for (size_t k = n; k < GROUP; ++k) d[k] = 0;
+                unsigned width = 0;
+                while (width < 17 && (all >> width) != 0) ++width;
+
+                *p++ = (uint8_t)width;
+                uint64_t acc = 0;
+                unsigned bits = 0;
+                for (size_t k = 0; k < GROUP; ++k) {
+                    acc |= (uint64_t)d[k] << bits;
+                    bits += width;
+                    while (bits >= 8) {
+                        *p++ = (uint8_t)acc;
+                        acc >>= 8;
+                        bits -= 8;
+                    }
+                }
+            }
+        }
+        if (p < limit) {
+            out[0] = BLOCK_DELTA;
+            return p - out;
+        }
+    }
+    out[0] = BLOCK_RAW;
+    memcpy(out + 1, pcm, raw);
+    return 1 + raw;
+}
+
+void PcmHistory::decode(const Block& block, std::vector<int16_t>* out) const {
+    const uint8_t* p = &store[block.offset];
+    size_t frames = block.frames;
+    out->resize(frames * channels);
+    int16_t* dst = &(*out)[0];
+    if (*p++ == BLOCK_RAW) {
+        memcpy(dst, p, frames * channels * 2);
+        return;
+    }
+
+    for (unsigned ch = 0; ch < channels; ++ch) {
+        int16_t* s = dst + ch;
+        memcpy(s, p, 2);
+        p += 2;
+        int32_t prev = s[0];
+        for (size_t i = 1; i < frames; i += GROUP) {
+            unsigned width = *p++;
+            uint32_t mask = width ? (uint32_t)((1ULL << width) - 1) : 0;
+            size_t n = frames - i < GROUP ? frames - i : GROUP;
+            uint64_t acc = 0;
+            unsigned bits = 0;
+            for (size_t k = 0; k < GROUP; ++k) {
+                while (bits < width) {
+                    acc |= (uint64_t)*p++ << bits;
+                    bits += 8;
+                }
+                uint32_t v = (uint32_t)acc & mask;
+                acc >>= width;
+                bits -= width;
+                if (k < n) {
+                    prev += unzigzag(v);
+                    s[(i + k) * channels] = (int16_t)prev;
+                }
+            }
+        }
+    }
+}
+
+size_t PcmHistory::read(uint64_t frame, std::vector<int16_t>* out) const {
+    out->clear();
+    if (frame < first_frame() || frame >= end_frame()) return 0;
+
+    size_t skip;
+    if (frame >= pending_first) {
+        skip = (size_t)(frame - pending_first);
+        out->assign(pending.begin() + skip * channels, pending.end());
+    } else {
+        // Blocks are contiguous and all BLOCK_FRAMES long
+        const Block& block = blocks[(size_t)((frame - blocks.front().first_frame) / BLOCK_FRAMES)];
+        decode(block, out);
+        skip = (size_t)(frame - block.first_frame);
+        out->erase(out->begin(), out->begin() + skip * channels);
+    }
+    return out->size() / channels;
+}
+
+size_t PcmHistory::stored_bytes() const {
+    size_t total = pending.size() * 2;
+    for (size_t i = 0; i < blocks.size(); ++i) total += blocks[i].size;
+    return total;
+}
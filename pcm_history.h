@@ -0,0 +1,67 @@
+#ifndef PCM_HISTORY_H
+#define PCM_HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+
+// The most recently decoded PCM of the current book, kept so short rewinds
+// replay from memory instead of demuxing and decoding again.
+//
+// Audio is stored in blocks of BLOCK_FRAMES in a fixed byte budget; the
+// oldest blocks are dropped to make room. With compression on, each block is
+// stored as per-channel first differences bit-packed in groups of 32, which
+// is lossless and saves about a third on speech; blocks that would
+// not shrink are kept raw. Frames are numbered from the last clear(), so the
+// owner maps them to book time. Not thread-safe: the decoder thread owns it.
+class PcmHistory {
+public:
+    static const size_t BLOCK_FRAMES = 4096;
+
+    PcmHistory();
+
+    // Set the memory budget (0 = keep nothing) and format; clears
+    void configure(size_t budget_bytes, bool compress, unsigned channels);
+    bool enabled() const { return !store.empty(); }
+
+    // Forget everything; the next frame appended is frame 0
+    void clear();
+    void append(const int16_t* pcm, size_t frames);
+
+    // Frames [first_frame(), end_frame()) can be read back
+    uint64_t first_frame() const { return blocks.empty() ? pending_first : blocks.front().first_frame; }
+    uint64_t end_frame() const { return pending_first + pending.size() / (channels ? channels : 1); }
+
+    // Copy the frames from `frame` to the end of its block into `out`
+    // (interleaved). Returns the number of frames, 0 if `frame` is not held.
+    size_t read(uint64_t frame, std::vector<int16_t>* out) const;
+
+    // Bytes of the budget in use, and the raw size of what they hold
+    size_t stored_bytes() const;
+    uint64_t raw_bytes() const { return (end_frame() - first_frame()) * channels * 2; }
+
+private:
+    struct Block {
+        uint64_t first_frame;
+        size_t offset; // in store
+        size_t size;
+        uint32_t frames;
+    };
+
+    std::vector<uint8_t> store; // ring of encoded blocks
+    std::deque<Block> blocks;   // oldest first
+    size_t head;                // where the next block goes
+    bool compress;
+    unsigned channels;
+
+    std::vector<int16_t> pending; // the block being filled, readable too
+    uint64_t pending_first;
+    std::vector<uint8_t> encoded; // scratch
+
+    void seal_pending();
+    size_t encode(const int16_t* pcm, size_t frames);
+    void decode(const Block& block, std::vector<int16_t>* out) const;
+};
+
+#endif // PCM_HISTORY_H
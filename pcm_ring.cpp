@@ -0,0 +1,207 @@
+#include "pcm_ring.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+PcmRing::PcmRing()
+    : low_mark(DEFAULT_CAPACITY / 2), high_mark(DEFAULT_CAPACITY),
+      write_pos(0), release_pos(0), read_cursor(0), handed_end(0), hold_pos(0),
+      flush_pos(0), flush_gen(0), seen_gen(0), required_gen(0),
+      closed(false), stopped(false), producer_parked(false), consumer_parked(false),
+      producer_interrupted(false), park_count(0), park_time_us(0)
+{
+    buffer.resize(DEFAULT_CAPACITY);
+}
+
+void PcmRing::configure(size_t capacity, size_t low_watermark, size_t high_watermark) {
+    if (capacity < 4096) capacity = 4096;
+    if (high_watermark == 0 || high_watermark > capacity) high_watermark = capacity;
+    if (low_watermark >= high_watermark) low_watermark = high_watermark / 2;
+
+    // Large power-saving rings are only reallocated when the size changes
+    if (buffer.size() != capacity) {
+        std::vector<uint8_t>(capacity).swap(buffer);
+    }
+    low_mark = low_watermark;
+    high_mark = high_watermark;
+    reset();
+}
+
+void PcmRing::reset() {
+    write_pos = 0;
+    release_pos = 0;
+    read_cursor = 0;
+    handed_end = 0;
+    hold_pos = 0;
+    flush_pos = 0;
+    flush_gen = 0;
+    seen_gen = 0;
+    required_gen = 0;
+    closed = false;
+    stopped = false;
+    producer_interrupted = false;
+    park_count = 0;
+    park_time_us = 0;
+}
+
+size_t PcmRing::used_by_producer() const {
+    uint64_t w = write_pos.load();
+    // Flushed data is free, except what the sink borrowed before the flush
+    // and has not released yet: that is still being copied out
+    uint64_t r = std::max(release_pos.load(), std::min(flush_pos.load(), hold_pos.load()));
+    return w > r ? (size_t)(w - r) : 0;
+}
+
+size_t PcmRing::fill() const {
+    return used_by_producer();
+}
+
+void PcmRing::wake() {
+    std::lock_guard<std::mutex> lock(park_mutex);
+    park_cond.notify_all();
+}
+
+void PcmRing::shutdown() {
+    stopped = true;
+    wake();
+}
+
+void PcmRing::interrupt_producer() {
+    producer_interrupted = true;
+    wake();
+}
+
+// --- Producer ---
+
+bool PcmRing::wait_for_space(size_t len, int timeout_ms) {
+    if (stopped) return false;
+    size_t used = used_by_producer();
+    if (used + len <= high_mark) return true;
+
+    // Above the high watermark: sleep until the consumer drains to `low`
+    std::chrono::steady_clock::time_point parked_at = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(park_mutex);
+    producer_parked = true;
+    park_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+        return stopped || producer_interrupted || used_by_producer() <= low_mark;
+    });
+    producer_parked = false;
+    lock.unlock();
+
+    park_count.fetch_add(1);
+    park_time_us.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - parked_at).count());
+
+    if (producer_interrupted.exchange(false)) return false;
+    return !stopped && used_by_producer() + len <= buffer.size();
+}
+
+void PcmRing::write(const void* data, size_t len) {
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+    uint64_t w = write_pos.load(std::memory_order_relaxed);
+    size_t cap = buffer.size();
+    size_t offset = (size_t)(w % cap);
+    size_t first = std::min(len, cap - offset);
+
+    memcpy(&buffer[offset], src, first);
+    if (first < len) {
+        memcpy(&buffer[0], src + first, len - first);
+    }
+    write_pos.store(w + len);
+
+    if (consumer_parked) wake();
+}
+
+void PcmRing::flush() {
+    flush_pos.store(write_pos.load());
+    flush_gen.fetch_add(1);
+    wake();
+}
+
+void PcmRing::close() {
+    closed = true;
+    wake();
+}
+
+// --- Consumer ---
+
+void PcmRing::advance_release(uint64_t pos) {
+    uint64_t current = release_pos.load();
+    while (pos > current && !release_pos.compare_exchange_weak(current, pos)) {
+    }
+}
+
+void PcmRing::wait_for_flush() {
+    uint32_t required = flush_gen.load() + 1;
+    uint32_t current = required_gen.load();
+    // Never lower it: a later seek may already require a newer flush
+    while ((int32_t)(required - current) > 0 && !required_gen.compare_exchange_weak(current, required)) {
+    }
+}
+
+bool PcmRing::barrier_pending() const {
+    return (int32_t)(seen_gen - required_gen.load()) < 0;
+}
+
+size_t PcmRing::acquire(const uint8_t** data, size_t max_len, int timeout_ms, uint64_t* end_pos) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (stopped) return 0;
+
+        // With nothing borrowed, the sink holds no bytes below the cursor.
+        // This is published before the flush check below, so a flush the
+        // check misses still sees the region about to be handed out as held.
+        bool idle = release_pos.load() >= handed_end;
+        if (idle) hold_pos.store(read_cursor);
+
+        uint32_t gen = flush_gen.load();
+        if (gen != seen_gen) {
+            seen_gen = gen;
+            uint64_t fp = flush_pos.load();
+            if (read_cursor < fp) read_cursor = fp;
+        }
+        // Skip the release over flushed data once nothing from before the
+        // flush is borrowed any more
+        if (idle && release_pos.load() < read_cursor) {
+            hold_pos.store(read_cursor);
+            advance_release(read_cursor);
+            if (producer_parked && used_by_producer() <= low_mark) wake();
+        }
+        bool barrier = barrier_pending();
+
+        uint64_t w = write_pos.load();
+        if (!barrier && w > read_cursor) {
+            size_t cap = buffer.size();
+            size_t offset = (size_t)(read_cursor % cap);
+            size_t len = (size_t)std::min<uint64_t>(w - read_cursor, cap - offset);
+            len = std::min(len, max_len);
+
+            *data = &buffer[offset];
+            read_cursor += len;
+            handed_end = read_cursor;
+            *end_pos = read_cursor;
+            return len;
+        }
+        // Closed with a barrier pending means the producer ended before
+        // it could honour the seek; nothing valid will follow.
+        if (closed) return 0;
+        if (attempt > 0) break;
+
+        std::unique_lock<std::mutex> lock(park_mutex);
+        consumer_parked = true;
+        park_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+            return stopped || closed || flush_gen.load() != seen_gen
+                || (!barrier_pending() && write_pos.load() > read_cursor);
+        });
+        consumer_parked = false;
+    }
+    return 0;
+}
+
+void PcmRing::release(uint64_t end_pos) {
+    advance_release(end_pos);
+    if (producer_parked && used_by_producer() <= low_mark) wake();
+}
+
+bool PcmRing::at_end() const {
+    return closed && (barrier_pending() || read_cursor >= write_pos.load());
+}
@@ -0,0 +1,123 @@
+#ifndef PCM_RING_H
+#define PCM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// Single-producer/single-consumer ring buffer for decoded PCM.
+//
+// The producer (decoder thread) copies each FAAD frame in once; the consumer
+// (sink thread) borrows contiguous regions in place and releases them when
+// the sink is done, so no extra copy or syscall is made per frame. Positions
+// are monotonically increasing byte counters; the indices themselves are
+// lock-free, the mutex is only used to park a thread that has to wait.
+//
+// Flow control uses two watermarks: once the fill level reaches `high` the
+// producer sleeps until it drops to `low`. With a ring of several minutes and
+// a low `low`, the producer runs in rare bursts and the CPU can stay idle in
+// between (race to idle); the park counters below show how well that works.
+class PcmRing {
+public:
+    static const size_t DEFAULT_CAPACITY = 256 * 1024;
+
+    PcmRing();
+
+    // Resize and set watermarks (in bytes). Only call while both sides are idle.
+    void configure(size_t capacity, size_t low_watermark, size_t high_watermark);
+    size_t capacity() const { return buffer.size(); }
+
+    // Drop all content and clear the end-of-stream / shutdown state.
+    // Only call while both sides are idle.
+    void reset();
+
+    // --- Producer side ---
+
+    // Wait up to `timeout_ms` until `len` bytes can be written, honouring the
+    // watermarks. Returns false on timeout, shutdown or interrupt_producer().
+    bool wait_for_space(size_t len, int timeout_ms);
+    // Copy `len` bytes in; the caller must have waited for space first.
+    void write(const void* data, size_t len);
+    // Discard everything queued so far (e.g. after a seek). Data written
+    // afterwards is kept.
+    void flush();
+    // No more data will follow; the consumer sees end-of-stream once drained.
+    void close();
+
+    // --- Consumer side ---
+
+    // Borrow up to `max_len` contiguous queued bytes, waiting up to
+    // `timeout_ms` for data. Returns 0 on timeout, end-of-stream or shutdown.
+    // `end_pos` receives the token to pass to release().
+    size_t acquire(const uint8_t** data, size_t max_len, int timeout_ms, uint64_t* end_pos);
+    // Give back a region obtained from acquire(). May be called from any
+    // thread; regions must be released in the order they were acquired, and
+    // regions from before a flush are ignored.
+    void release(uint64_t end_pos);
+    // Hold back data until the producer has performed its next flush(), so
+    // audio queued before a pending seek is never handed out. Call this
+    // before asking the producer to seek.
+    void wait_for_flush();
+
+    bool at_end() const;
+
+    // --- Either side ---
+
+    // Total bytes written so far, and the end of what the sink has released
+    uint64_t written() const { return write_pos.load(); }
+    uint64_t released() const { return release_pos.load(); }
+
+    // Wake and fail all waiters until reset()
+    void shutdown();
+    // Wake a producer parked in wait_for_space() once, e.g. to take a seek
+    void interrupt_producer();
+    size_t fill() const;
+
+    // How often the producer parked for lack of space, and for how long in
+    // total (microseconds), since the last reset()
+    uint64_t producer_park_count() const { return park_count.load(); }
+    uint64_t producer_park_time() const { return park_time_us.load(); }
+
+private:
+    std::vector<uint8_t> buffer;
+    size_t low_mark;
+    size_t high_mark;
+
+    std::atomic<uint64_t> write_pos;   // owned by the producer
+    std::atomic<uint64_t> release_pos; // owned by the consumer
+    uint64_t read_cursor;              // consumer only: next byte to hand out
+
+    uint64_t handed_end;               // consumer only: end of the last region handed out
+    // Start of the oldest region the consumer may still be reading. A flush
+    // frees queued space only up to here, never under the sink's feet.
+    std::atomic<uint64_t> hold_pos;
+
+    std::atomic<uint64_t> flush_pos;   // write_pos at the last flush
+    std::atomic<uint32_t> flush_gen;
+    uint32_t seen_gen;                 // consumer only
+    // Flush generation the consumer must have seen before reading again;
+    // only ever raised by wait_for_flush(), never cleared
+    std::atomic<uint32_t> required_gen;
+
+    std::atomic<bool> closed;
+    std::atomic<bool> stopped;
+    std::atomic<bool> producer_parked;
+    std::atomic<bool> consumer_parked;
+    std::atomic<bool> producer_interrupted;
+
+    std::atomic<uint64_t> park_count;
+    std::atomic<uint64_t> park_time_us;
+
+    std::mutex park_mutex;
+    std::condition_variable park_cond;
+
+    size_t used_by_producer() const;
+    bool barrier_pending() const;
+    void advance_release(uint64_t pos);
+    void wake();
+};
+
+#endif // PCM_RING_H
@@ -0,0 +1,319 @@
+#include "perf_stats.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mutex>
+#include <algorithm>
+
+static const char* const COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+    "frames", "faad_errors", "frames_dropped", "seeks", "rewinds", "opens", "buffers", "underruns"
+};
+
+static const char* const HISTOGRAM_NAMES[PERF_HISTOGRAM_COUNT] = {
+    "demux", "decode", "write_wait", "sink_wait", "seek", "open"
+};
+
+// Enough for the decoder, the sink and a few helpers
+static const unsigned MAX_SLOTS = 8;
+
+std::atomic<bool> perf_stats_on(false);
+
+static PerfSlot slots[MAX_SLOTS];
+static std::atomic<unsigned> slot_count(0);
+static std::mutex slot_mutex; // creating slots only, never recording
+static uint64_t enabled_at = 0; // perf_now_ns()
+
+// --- PerfLatency ---
+
+void PerfLatency::record(uint64_t ns) {
+    unsigned b = 0;
+    for (uint64_t v = ns; v > 1 && b < BUCKETS - 1; v >>= 1) ++b;
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    // Only the owning thread raises it, so a plain compare is enough
+    if (ns > max_ns.load(std::memory_order_relaxed)) {
+        max_ns.store(ns, std::memory_order_relaxed);
+    }
+}
+
+void PerfLatency::reset() {
+    for (unsigned i = 0; i < BUCKETS; ++i) buckets[i].store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    sum_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+}
+
+uint64_t PerfLatency::percentile(double p) const {
+    uint64_t n = count();
+    if (n == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i) {
+        seen += bucket(i);
+        if (seen >= rank) return std::min(max(), (uint64_t)2 << i);
+    }
+    return max();
+}
+
+// --- PerfSlot ---
+
+void PerfSlot::faad_error(unsigned code) {
+    count(PERF_FAAD_ERRORS);
+    faad_errors[code < FAAD_CODES ? code : FAAD_CODES - 1].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PerfSlot::fill_level(size_t used, size_t capacity) {
+    if (capacity == 0) return;
+    size_t step = used >= capacity ? FILL_STEPS - 1 : used * (FILL_STEPS - 1) / capacity;
+    fill[step].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PerfSlot::reset() {
+    for (unsigned i = 0; i < PERF_COUNTER_COUNT; ++i) counters[i].store(0, std::memory_order_relaxed);
+    for (unsigned i = 0; i < PERF_HISTOGRAM_COUNT; ++i) latency[i].reset();
+    for (unsigned i = 0; i < FAAD_CODES; ++i) faad_errors[i].store(0, std::memory_order_relaxed);
+    for (unsigned i = 0; i < FILL_STEPS; ++i) fill[i].store(0, std::memory_order_relaxed);
+}
+
+// --- Registry ---
+
+void perf_stats_enable(bool enabled) {
+    if (enabled && !perf_stats_on) enabled_at = perf_now_ns();
+    perf_stats_on = enabled;
+}
+
+PerfSlot* perf_stats_slot(const char* name) {
+    if (!perf_stats_enabled()) return NULL;
+
+    std::lock_guard<std::mutex> lock(slot_mutex);
+    unsigned n = slot_count.load();
+    for (unsigned i = 0; i < n; ++i) {
+        if (strcmp(slots[i].name, name) == 0) return &slots[i];
+    }
+    if (n == MAX_SLOTS) return NULL;
+
+    PerfSlot* slot = &slots[n];
+    slot->reset();
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot_count.store(n + 1); // publishes the name to readers
+    return slot;
+}
+
+void perf_stats_reset() {
+    unsigned n = slot_count.load();
+    for (unsigned i = 0; i < n; ++i) slots[i].reset();
+    enabled_at = perf_now_ns();
+}
+
+static void append(std::string* out, const char* format, ...) G_GNUC_PRINTF(2, 3);
+static void append(std::string* out, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out->append(line);
+}
+
+std::string perf_stats_format() {
+    std::string out;
+    if (!perf_stats_enabled()) {
+        return "stats off (set LARK_STATS=1)\n";
+    }
+    append(&out, "uptime_s %.1f\n", (perf_now_ns() - enabled_at) / 1e9);
+
+    unsigned n = slot_count.load();
+    for (unsigned s = 0; s < n; ++s) {
+        const PerfSlot& slot = slots[s];
+        append(&out, "\n[%s]\n", slot.name);
+        for (unsigned i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            uint64_t value = slot.counters[i].load(std::memory_order_relaxed);
+            if (value) append(&out, "%s %llu\n", COUNTER_NAMES[i], (unsigned long long)value);
+        }
+        for (unsigned i = 0; i < PerfSlot::FAAD_CODES; ++i) {
+            uint64_t value = slot.faad_errors[i].load(std::memory_order_relaxed);
+            if (value) append(&out, "faad_error_%u %llu\n", i, (unsigned long long)value);
+        }
+
+        // Latencies in microseconds; percentiles are bucket upper bounds
+        for (unsigned i = 0; i < PERF_HISTOGRAM_COUNT; ++i) {
+            const PerfLatency& h = slot.latency[i];
+            uint64_t count = h.count();
+            if (count == 0) continue;
+            append(&out, "%s_us n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+                   HISTOGRAM_NAMES[i], (unsigned long long)count, h.sum() / 1e3 / count,
+                   h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+                   h.max() / 1e3);
+        }
+
+        uint64_t fills = 0;
+        for (unsigned i = 0; i < PerfSlot::FILL_STEPS; ++i) fills += slot.fill[i].load(std::memory_order_relaxed);
+        if (fills > 0) {
+            out.append("fill_pct");
+            for (unsigned i = 0; i < PerfSlot::FILL_STEPS; ++i) {
+                append(&out, " %u:%llu", i * 10, (unsigned long long)slot.fill[i].load(std::memory_order_relaxed));
+            }
+            out.append("\n");
+        }
+    }
+    return out;
+}
+
+bool perf_stats_dump(const std::string& path) {
+    std::string text = perf_stats_format();
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --- Control socket ---
+
+struct StatsServer {
+    std::string socket_path;
+    std::string dump_path;
+    int listen_fd;
+    int wake_pipe[2]; // SIGUSR1 writes 'd', stop writes 'q'
+    pthread_t thread;
+    bool running;
+};
+
+static StatsServer server = { std::string(), std::string(), -1, { -1, -1 }, 0, false };
+
+static void on_sigusr1(int) {
+    int saved = errno;
+    char c = 'd';
+    if (write(server.wake_pipe[1], &c, 1) < 0) {
+        // pipe full: a dump is already pending
+    }
+    errno = saved;
+}
+
+static void serve_client(int fd) {
+    // A client that sends nothing still gets its dump after a moment
+    struct timeval timeout = { 0, 200 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[32];
+    ssize_t len = read(fd, request, sizeof(request) - 1);
+    request[len > 0 ? len : 0] = '\0';
+
+    std::string text = perf_stats_format();
+    if (strncmp(request, "reset", 5) == 0) {
+        perf_stats_reset();
+        text += "\nreset\n";
+    }
+    size_t sent = 0;
+    while (sent < text.size()) {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if (n <= 0) break;
+        sent += n;
+    }
+}
+
+// Blocks in poll() until a client or a signal arrives: no periodic wakeups
+static void* server_func(void*) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { server.listen_fd, POLLIN, 0 },
+            { server.wake_pipe[0], POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            char c = 0;
+            if (read(server.wake_pipe[0], &c, 1) == 1 && c == 'q') break;
+            if (perf_stats_dump(server.dump_path)) {
+                g_print("Stats: Wrote %s\n", server.dump_path.c_str());
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(server.listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                serve_client(fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+bool perf_stats_start_server(const std::string& socket_path, const std::string& dump_path) {
+    if (server.running) return true;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    unlink(socket_path.c_str()); // left over from a crash
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0
+        || pipe(server.wake_pipe) != 0) {
+        g_printerr("Stats: Cannot listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    fcntl(server.wake_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(server.wake_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(server.wake_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    server.socket_path = socket_path;
+    server.dump_path = dump_path;
+    server.listen_fd = fd;
+    if (pthread_create(&server.thread, NULL, server_func, NULL) != 0) {
+        perror("Stats: Failed to create thread");
+        close(fd);
+        close(server.wake_pipe[0]);
+        close(server.wake_pipe[1]);
+        unlink(socket_path.c_str());
+        return false;
+    }
+    server.running = true;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    g_print("Stats: Serving on %s (SIGUSR1 writes %s)\n", socket_path.c_str(), dump_path.c_str());
+    return true;
+}
+
+void perf_stats_stop_server() {
+    if (!server.running) return;
+    signal(SIGUSR1, SIG_DFL);
+    char c = 'q';
+    if (write(server.wake_pipe[1], &c, 1) != 1) {
+        g_printerr("Stats: Failed to stop server\n");
+        return;
+    }
+    pthread_join(server.thread, NULL);
+    close(server.listen_fd);
+    close(server.wake_pipe[0]);
+    close(server.wake_pipe[1]);
+    unlink(server.socket_path.c_str());
+    server.running = false;
+}
@@ -0,0 +1,112 @@
+#ifndef PERF_STATS_H
+#define PERF_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+// Hot-path counters and latency histograms for diagnosing stutter.
+//
+// Each thread role (decoder, sink, ...) records into its own slot, so the
+// hot path only does a few relaxed atomic adds on cache lines no other thread
+// writes; nothing takes a lock. Readers take a snapshot whenever asked, which
+// may be a few events out of date. Recording is off by default: callers fetch
+// a slot only if perf_stats_enabled(), and skip all timing when they got none.
+
+enum PerfCounter {
+    PERF_FRAMES,         // AAC frames decoded
+    PERF_FAAD_ERRORS,    // frames FAAD rejected (codes in faad_errors)
+    PERF_FRAMES_DROPPED, // decoded, but in an unexpected channel layout
+    PERF_SEEKS,
+    PERF_REWINDS,        // seeks served from the decoded history
+    PERF_OPENS,
+    PERF_BUFFERS,        // regions handed to the sink
+    PERF_UNDERRUNS,      // sink waited for PCM that did not come in time
+    PERF_COUNTER_COUNT
+};
+
+enum PerfHistogram {
+    PERF_DEMUX,      // reading one frame from the container
+    PERF_DECODE,     // FAAD on one frame
+    PERF_WRITE_WAIT, // decoder blocked on a full ring
+    PERF_SINK_WAIT,  // sink blocked on an empty ring
+    PERF_SEEK,       // seek request to first PCM after it
+    PERF_OPEN,       // Decoder::open(), including the format probe
+    PERF_HISTOGRAM_COUNT
+};
+
+// Durations in nanoseconds, one bucket per power of two
+class PerfLatency {
+public:
+    static const unsigned BUCKETS = 40; // up to ~18 minutes
+
+    PerfLatency() { reset(); }
+    void record(uint64_t ns);
+    void reset();
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_ns.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_ns.load(std::memory_order_relaxed); }
+    // Upper bound of the bucket holding the `p`-th percentile (0-100)
+    uint64_t percentile(double p) const;
+    uint64_t bucket(unsigned i) const { return buckets[i].load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+struct PerfSlot {
+    static const unsigned FAAD_CODES = 64;
+    static const unsigned FILL_STEPS = 11; // 0-9%, 10-19%, ... 100%
+
+    char name[24];
+    std::atomic<uint64_t> counters[PERF_COUNTER_COUNT];
+    PerfLatency latency[PERF_HISTOGRAM_COUNT];
+    std::atomic<uint64_t> faad_errors[FAAD_CODES];
+    // Ring fill level each time the sink took a buffer
+    std::atomic<uint64_t> fill[FILL_STEPS];
+
+    void count(PerfCounter counter, uint64_t n = 1) {
+        counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+    void time(PerfHistogram histogram, uint64_t ns) { latency[histogram].record(ns); }
+    void faad_error(unsigned code);
+    void fill_level(size_t used, size_t capacity);
+    void reset();
+};
+
+inline uint64_t perf_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+extern std::atomic<bool> perf_stats_on;
+
+inline bool perf_stats_enabled() {
+    return perf_stats_on.load(std::memory_order_relaxed);
+}
+void perf_stats_enable(bool enabled);
+
+// The slot for thread role `name`, created on first use (never freed). Only
+// one thread should record into a role at a time; NULL once all slots are
+// taken or while stats are off.
+PerfSlot* perf_stats_slot(const char* name);
+
+// All slots as text, one section per role
+std::string perf_stats_format();
+void perf_stats_reset();
+bool perf_stats_dump(const std::string& path);
+
+// Serve dumps until perf_stats_stop_server(): every connection to the Unix
+// socket at `socket_path` gets the text (send "reset" first to also clear
+// the counters), and SIGUSR1 writes it to `dump_path`.
+bool perf_stats_start_server(const std::string& socket_path, const std::string& dump_path);
+void perf_stats_stop_server();
+
+#endif // PERF_STATS_H
@@ -0,0 +1,100 @@
+#include "playback_clock.h"
+
+static const int64_t NS_PER_SECOND = 1000000000LL;
+
+// Media time covered by `bytes` of PCM at `bps` and `speed` per mille
+static int64_t media_time(uint64_t bytes, uint32_t bps, uint32_t speed) {
+    if (bps == 0) return 0;
+    // Split into whole seconds first: bytes * 1e9 overflows after ~14 hours
+    int64_t played = (int64_t)(bytes / bps) * NS_PER_SECOND
+                   + (int64_t)(bytes % bps) * NS_PER_SECOND / bps;
+    // Wall-clock time heard -> media time (a 40-hour book at 3x stays far
+    // from overflow)
+    return speed == 1000 ? played : played * (int64_t)speed / 1000;
+}
+
+PlaybackClock::PlaybackClock()
+    : seq(0), first(0), last(1), rate(0), speed_milli(1000), latency(0) {
+    marks[0].pos.store(0);
+    marks[0].time.store(0);
+}
+
+void PlaybackClock::anchor(uint64_t ring_pos, int64_t position, uint32_t bytes_per_second,
+                           uint32_t speed) {
+    // Single writer (the decoder, or the backend while the decoder is idle)
+    seq.fetch_add(1);
+    uint32_t index = last.load();
+    marks[index % MAX_MARKS].pos.store(ring_pos);
+    marks[index % MAX_MARKS].time.store(position);
+    first.store(index);
+    last.store(index + 1);
+    rate.store(bytes_per_second);
+    speed_milli.store(speed > 0 ? speed : 1000);
+    seq.fetch_add(1);
+}
+
+void PlaybackClock::skip(uint64_t ring_pos, int64_t skipped, uint64_t consumed) {
+    uint32_t bps = rate.load();
+    uint32_t speed = speed_milli.load();
+    uint32_t f = first.load();
+    uint32_t l = last.load();
+
+    // Media time the newest mark reaches at `ring_pos`
+    const Mark& newest = marks[(l - 1) % MAX_MARKS];
+    uint64_t pos = newest.pos.load();
+    int64_t time = newest.time.load();
+    if (ring_pos > pos) time += media_time(ring_pos - pos, bps, speed);
+
+    seq.fetch_add(1);
+    // Forget marks whose successor the listener has already reached, and
+    // the oldest one if there is no room (a cut that far back is long past)
+    uint64_t heard = heard_pos(consumed, bps);
+    while (l - f >= 2 && marks[(f + 1) % MAX_MARKS].pos.load() <= heard) f++;
+    if (l - f >= MAX_MARKS) f++;
+    first.store(f);
+
+    marks[l % MAX_MARKS].pos.store(ring_pos);
+    marks[l % MAX_MARKS].time.store(time + skipped);
+    last.store(l + 1);
+    seq.fetch_add(1);
+}
+
+void PlaybackClock::set_latency(int64_t value) {
+    latency.store(value > 0 ? value : 0);
+}
+
+// Ring position of the audio coming out of the speaker right now
+uint64_t PlaybackClock::heard_pos(uint64_t consumed, uint32_t bps) const {
+    int64_t lat = latency.load();
+    uint64_t held = (uint64_t)(lat / NS_PER_SECOND) * bps
+                  + (uint64_t)(lat % NS_PER_SECOND) * bps / NS_PER_SECOND;
+    return consumed > held ? consumed - held : 0;
+}
+
+int64_t PlaybackClock::position(uint64_t consumed) const {
+    uint64_t pos, heard;
+    int64_t time;
+    uint32_t bps, speed;
+    uint32_t before, after;
+    do {
+        before = seq.load();
+        bps = rate.load();
+        speed = speed_milli.load();
+        heard = heard_pos(consumed, bps);
+
+        // Newest mark the listener has reached, else the anchor
+        uint32_t f = first.load();
+        uint32_t i = last.load() - 1;
+        if (i - f >= MAX_MARKS) { // torn read, the writer is busy
+            after = before + 1;
+            continue;
+        }
+        while (i != f && marks[i % MAX_MARKS].pos.load() > heard) i--;
+        pos = marks[i % MAX_MARKS].pos.load();
+        time = marks[i % MAX_MARKS].time.load();
+        after = seq.load();
+    } while ((before & 1) || before != after);
+
+    if (bps == 0 || heard <= pos) return time;
+    return time + media_time(heard - pos, bps, speed);
+}
@@ -0,0 +1,65 @@
+#ifndef PLAYBACK_CLOCK_H
+#define PLAYBACK_CLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Playback position derived from how much PCM the sink has consumed, rather
+// than from the pipeline clock. The decoder anchors ring positions to media
+// time whenever the timeline jumps (start, seek); the position is then the
+// anchor time plus the audio consumed since, minus what the sink still holds
+// (its reported latency, large over Bluetooth). Pausing needs no bookkeeping:
+// the sink simply stops consuming. At playback speeds above 1x every second
+// of PCM (and of sink latency) covers `speed` seconds of media time.
+//
+// When the decoder drops audio (skipped silence) it records where in the ring
+// that happened; the clock keeps those marks until the sink has played past
+// them, so the position jumps exactly when the listener hears the cut.
+//
+// The anchor and marks are published with a sequence lock, so any thread can
+// read the position without locking or touching GStreamer.
+class PlaybackClock {
+public:
+    PlaybackClock();
+
+    // Producer side: PCM written at ring position `ring_pos` and later is
+    // media time `position` (ns) onwards, at `bytes_per_second` of PCM and
+    // `speed` per mille. Until the sink consumes past `ring_pos` the clock
+    // reads `position`. Drops all skip marks.
+    void anchor(uint64_t ring_pos, int64_t position, uint32_t bytes_per_second,
+                uint32_t speed = 1000);
+
+    // Producer side: `skipped` ns of media time were dropped right before
+    // ring position `ring_pos`. `consumed` (PcmRing::released()) lets the
+    // clock forget marks the sink is already past.
+    void skip(uint64_t ring_pos, int64_t skipped, uint64_t consumed);
+
+    // Audio the sink holds after consuming it (ns); any thread
+    void set_latency(int64_t latency);
+    int64_t get_latency() const { return latency.load(); }
+
+    // Media time being heard once the sink has consumed up to ring position
+    // `consumed` (see PcmRing::released()). Lock-free.
+    int64_t position(uint64_t consumed) const;
+
+private:
+    static const uint32_t MAX_MARKS = 128;
+
+    struct Mark {
+        std::atomic<uint64_t> pos;
+        std::atomic<int64_t> time;
+    };
+
+    std::atomic<uint32_t> seq; // odd while the anchor or marks are being written
+    // marks[first % MAX_MARKS] is the anchor, later ones up to `last` are skips
+    Mark marks[MAX_MARKS];
+    std::atomic<uint32_t> first;
+    std::atomic<uint32_t> last;
+    std::atomic<uint32_t> rate; // bytes per second, 0 if not known yet
+    std::atomic<uint32_t> speed_milli;
+    std::atomic<int64_t> latency;
+
+    uint64_t heard_pos(uint64_t consumed, uint32_t bps) const;
+};
+
+#endif // PLAYBACK_CLOCK_H
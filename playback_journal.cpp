@@ -0,0 +1,381 @@
+#include "playback_journal.h"
+#include "lark_paths.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char JOURNAL_MAGIC[4] = { 'L', 'K', 'J', 'N' };
+static const uint32_t JOURNAL_VERSION = 1;
+
+// Compact once the file holds this many records and most are stale
+static const size_t COMPACT_MIN_RECORDS = 2048;
+
+enum { REC_BOOK = 1, REC_POSITION = 2 };
+
+// One fixed-size slot. The file starts with a header slot (magic, version),
+// and a BOOK record is followed by its path, zero-padded to whole slots.
+struct JournalRecord {
+    uint32_t crc;     // CRC-32 of the rest of the slot, and of a BOOK's path
+    uint16_t type;
+    uint16_t aux;     // BOOK: path length; POSITION: chapter + 1 (0 = none)
+    uint64_t book;    // lark_hash64() of the path
+    int64_t ms;       // BOOK: duration (0 = unknown); POSITION: position
+    int64_t updated;  // POSITION: wall-clock seconds
+};
+static const size_t RECORD_SIZE = sizeof(JournalRecord);
+typedef char journal_record_is_32_bytes[RECORD_SIZE == 32 ? 1 : -1];
+
+struct Crc32Table {
+    uint32_t entries[256];
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+static const Crc32Table crc_table;
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) crc = crc_table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const JournalRecord& rec, const uint8_t* path) {
+    uint32_t crc = crc32_update(0, reinterpret_cast<const uint8_t*>(&rec) + 4, RECORD_SIZE - 4);
+    return path ? crc32_update(crc, path, rec.aux) : crc;
+}
+
+// Slots taken by a BOOK record and its path
+static size_t book_slots(size_t path_len) {
+    return 1 + (path_len + RECORD_SIZE - 1) / RECORD_SIZE;
+}
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const void* data, size_t len, uint64_t pos) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)pos);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void append_book(std::vector<uint8_t>* out, uint64_t hash, const std::string& path,
+                        int64_t duration) {
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_BOOK;
+    rec.aux = (uint16_t)path.size();
+    rec.book = hash;
+    rec.ms = duration;
+    rec.crc = record_crc(rec, reinterpret_cast<const uint8_t*>(path.data()));
+    size_t start = out->size();
+    out->resize(start + book_slots(path.size()) * RECORD_SIZE, 0);
+    memcpy(&(*out)[start], &rec, RECORD_SIZE);
+    memcpy(&(*out)[start + RECORD_SIZE], path.data(), path.size());
+}
+
+static void append_position(std::vector<uint8_t>* out, uint64_t hash, int64_t position, int chapter,
+                            int64_t updated) {
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = REC_POSITION;
+    rec.aux = (uint16_t)(chapter >= 0 && chapter < 0xFFFF ? chapter + 1 : 0);
+    rec.book = hash;
+    rec.ms = position;
+    rec.updated = updated;
+    rec.crc = record_crc(rec, NULL);
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&rec);
+    out->insert(out->end(), p, p + RECORD_SIZE);
+}
+
+PlaybackJournal::PlaybackJournal()
+    : fd(-1), append_pos(0), record_count(0), current_book(0), dirty(false), last_sync(0) {
+}
+
+PlaybackJournal::~PlaybackJournal() {
+    close();
+}
+
+bool PlaybackJournal::open(const std::string& path) {
+    close();
+    journal_path = path;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        g_printerr("Journal: Cannot open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close();
+        return false;
+    }
+    uint8_t header[RECORD_SIZE];
+    bool valid = st.st_size >= (off_t)RECORD_SIZE
+              && pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header)
+              && memcmp(header, JOURNAL_MAGIC, 4) == 0
+              && memcmp(header + 4, &JOURNAL_VERSION, 4) == 0;
+    if (!valid) {
+        // New, foreign or outdated file: start over
+        memset(header, 0, sizeof(header));
+        memcpy(header, JOURNAL_MAGIC, 4);
+        memcpy(header + 4, &JOURNAL_VERSION, 4);
+        if (ftruncate(fd, 0) == -1 || !write_all(fd, header, sizeof(header), 0)) {
+            close();
+            return false;
+        }
+        append_pos = RECORD_SIZE;
+        last_sync = monotonic_ms();
+        dirty = true;
+        return true;
+    }
+
+    // Replay in one pass over a read-only mapping
+    size_t size = (size_t)st.st_size;
+    void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close();
+        return false;
+    }
+    uint64_t valid_end;
+    replay(static_cast<const uint8_t*>(addr) + RECORD_SIZE, size - RECORD_SIZE, &valid_end);
+    munmap(addr, size);
+    append_pos = RECORD_SIZE + valid_end;
+
+    // Cut off a record torn by a crash mid-append; if that fails the next
+    // append overwrites it anyway
+    if (append_pos < (uint64_t)size) {
+        g_printerr("Journal: Dropped %llu bytes of a torn write at the end of %s\n",
+                   (unsigned long long)(size - append_pos), path.c_str());
+        int ignored = ftruncate(fd, (off_t)append_pos);
+        (void)ignored;
+    }
+    last_sync = monotonic_ms();
+
+    if (record_count >= COMPACT_MIN_RECORDS && record_count > 4 * books.size()) {
+        compact();
+    }
+    return true;
+}
+
+void PlaybackJournal::close() {
+    if (fd != -1) {
+        sync();
+        ::close(fd);
+        fd = -1;
+    }
+    append_pos = 0;
+    record_count = 0;
+    books.clear();
+    described.clear();
+    current_book = 0;
+    dirty = false;
+}
+
+// Apply records until the first one that is incomplete or fails its CRC;
+// `valid_end` is where that one starts
+void PlaybackJournal::replay(const uint8_t* data, size_t size, uint64_t* valid_end) {
+    size_t pos = 0;
+    while (pos + RECORD_SIZE <= size) {
+        JournalRecord rec;
+        memcpy(&rec, data + pos, RECORD_SIZE);
+        size_t span = RECORD_SIZE;
+        const uint8_t* path = NULL;
+        if (rec.type == REC_BOOK) {
+            span = book_slots(rec.aux) * RECORD_SIZE;
+            if (pos + span > size) break;
+            path = data + pos + RECORD_SIZE;
+        } else if (rec.type != REC_POSITION) {
+            break;
+        }
+        if (record_crc(rec, path) != rec.crc) break;
+
+        if (rec.type == REC_BOOK) {
+            described.insert(rec.book);
+            Book& book = books[rec.book]; // no position until one follows
+            book.path.assign(reinterpret_cast<const char*>(path), rec.aux);
+            book.duration = rec.ms;
+        } else if (books.count(rec.book)) {
+            Book& book = books[rec.book];
+            book.position = rec.ms;
+            book.chapter = (int)rec.aux - 1;
+            book.updated = rec.updated;
+            current_book = rec.book;
+        }
+        record_count++;
+        pos += span;
+    }
+    *valid_end = pos;
+
+    // A book whose positions were all lost is no book at all
+    for (std::unordered_map<uint64_t, Book>::iterator it = books.begin(); it != books.end(); ) {
+        if (it->second.position < 0) it = books.erase(it);
+        else ++it;
+    }
+}
+
+std::vector<PlaybackJournal::Entry> PlaybackJournal::entries() const {
+    std::vector<Entry> out;
+    out.reserve(books.size());
+    for (std::unordered_map<uint64_t, Book>::const_iterator it = books.begin(); it != books.end(); ++it) {
+        const Book& book = it->second;
+        Entry entry = { book.path, book.position, book.duration, book.chapter, book.updated };
+        out.push_back(entry);
+    }
+    return out;
+}
+
+std::string PlaybackJournal::current() const {
+    std::unordered_map<uint64_t, Book>::const_iterator it = books.find(current_book);
+    return it != books.end() ? it->second.path : std::string();
+}
+
+bool PlaybackJournal::record(const std::string& filepath, int64_t position_ms, int chapter,
+                             int64_t updated) {
+    if (fd == -1 || filepath.empty() || filepath.size() > 0xFFFF) return false;
+    uint64_t hash = lark_hash64(filepath);
+    std::unordered_map<uint64_t, Book>::iterator it = books.find(hash);
+    if (it != books.end() && hash == current_book && it->second.position == position_ms
+        && it->second.chapter == chapter) {
+        return true;
+    }
+
+    std::vector<uint8_t> bytes;
+    size_t records = 1;
+    int64_t duration = it != books.end() ? it->second.duration : 0;
+    if (!described.count(hash)) {
+        append_book(&bytes, hash, filepath, duration);
+        records++;
+    }
+    append_position(&bytes, hash, position_ms, chapter, updated);
+    if (!append(bytes, records)) return false;
+
+    described.insert(hash);
+    Book& book = books[hash];
+    book.path = filepath;
+    book.position = position_ms;
+    book.duration = duration;
+    book.chapter = chapter;
+    book.updated = updated;
+    current_book = hash;
+    after_append();
+    return true;
+}
+
+bool PlaybackJournal::set_duration(const std::string& filepath, int64_t duration_ms) {
+    if (fd == -1) return false;
+    uint64_t hash = lark_hash64(filepath);
+    std::unordered_map<uint64_t, Book>::iterator it = books.find(hash);
+    if (it == books.end() || it->second.duration == duration_ms) return it != books.end();
+
+    // A BOOK record again, now with the duration; replay keeps the newest
+    std::vector<uint8_t> bytes;
+    append_book(&bytes, hash, filepath, duration_ms);
+    if (!append(bytes, 1)) return false;
+    it->second.duration = duration_ms;
+    after_append();
+    return true;
+}
+
+void PlaybackJournal::after_append() {
+    if (record_count >= COMPACT_MIN_RECORDS && record_count > 4 * books.size()) {
+        compact();
+    } else {
+        sync_if_due();
+    }
+}
+
+bool PlaybackJournal::append(const std::vector<uint8_t>& bytes, size_t records) {
+    // On a failed or short write append_pos stays put: the next append
+    // overwrites the partial record, and replay would stop at it
+    if (!write_all(fd, &bytes[0], bytes.size(), append_pos)) {
+        g_printerr("Journal: Write failed: %s\n", strerror(errno));
+        return false;
+    }
+    append_pos += bytes.size();
+    record_count += records;
+    dirty = true;
+    return true;
+}
+
+void PlaybackJournal::sync_if_due() {
+    if (dirty && monotonic_ms() - last_sync >= SYNC_INTERVAL_MS) sync();
+}
+
+void PlaybackJournal::sync() {
+    if (fd == -1 || !dirty) return;
+    fdatasync(fd);
+    dirty = false;
+    last_sync = monotonic_ms();
+}
+
+// Rewrite the journal as one BOOK and one POSITION per book, the current
+// book last. The new file only replaces the old one once it is on disk.
+bool PlaybackJournal::compact() {
+    std::vector<uint8_t> bytes(RECORD_SIZE, 0);
+    memcpy(&bytes[0], JOURNAL_MAGIC, 4);
+    memcpy(&bytes[4], &JOURNAL_VERSION, 4);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (std::unordered_map<uint64_t, Book>::const_iterator it = books.begin(); it != books.end(); ++it) {
+            if ((it->first == current_book) != (pass == 1)) continue;
+            const Book& book = it->second;
+            append_book(&bytes, it->first, book.path, book.duration);
+            append_position(&bytes, it->first, book.position, book.chapter, book.updated);
+        }
+    }
+
+    std::string tmp_path = journal_path + ".tmp";
+    int tmp = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tmp == -1) return false;
+    bool ok = write_all(tmp, &bytes[0], bytes.size(), 0) && fsync(tmp) == 0;
+    ok = (::close(tmp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), journal_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    // Make the rename itself durable
+    std::vector<char> dir_buf(journal_path.begin(), journal_path.end());
+    dir_buf.push_back('\0');
+    int dir = ::open(dirname(&dir_buf[0]), O_RDONLY | O_CLOEXEC);
+    if (dir != -1) {
+        fsync(dir);
+        ::close(dir);
+    }
+
+    int new_fd = ::open(journal_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (new_fd == -1) return false;
+    g_print("Journal: Compacted %zu records to %zu\n", record_count, 2 * books.size());
+    ::close(fd);
+    fd = new_fd;
+    append_pos = bytes.size();
+    record_count = 2 * books.size();
+    described.clear();
+    for (std::unordered_map<uint64_t, Book>::const_iterator it = books.begin(); it != books.end(); ++it) {
+        described.insert(it->first);
+    }
+    dirty = false;
+    last_sync = monotonic_ms();
+    return true;
+}
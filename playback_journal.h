@@ -0,0 +1,89 @@
+#ifndef PLAYBACK_JOURNAL_H
+#define PLAYBACK_JOURNAL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+// Crash-safe record of where each book was left, and how long it is.
+//
+// The journal is an append-only file of fixed 32-byte records, each with a
+// CRC: a position checkpoint is a single small pwrite(), so it can run every
+// few seconds. A book's path and duration are written once (a BOOK record
+// followed by the path, padded to whole records); position records refer to
+// it by hash, and the last one names the current book. Writes reach the disk in batches, one
+// fdatasync() at most every SYNC_INTERVAL_MS or on sync(). After a crash or
+// power loss, replay stops at the first record whose CRC fails and the torn
+// tail is cut off. Once most records are stale the file is rewritten with one
+// position per book, through a temporary file and rename().
+class PlaybackJournal {
+public:
+    static const int64_t SYNC_INTERVAL_MS = 30 * 1000;
+
+    struct Entry {
+        std::string path;
+        int64_t position; // milliseconds
+        int64_t duration; // milliseconds, 0 if not known
+        int chapter;      // at the last checkpoint, -1 if none
+        int64_t updated;  // wall-clock seconds of the last checkpoint
+    };
+
+    PlaybackJournal();
+    ~PlaybackJournal();
+
+    // Replay the journal at `path` in one pass over a read-only mapping, and
+    // keep it open for appends. Creates the file if needed.
+    bool open(const std::string& path);
+    void close();
+
+    // Every book with a position, in no particular order
+    std::vector<Entry> entries() const;
+    // The book of the last checkpoint; empty if none
+    std::string current() const;
+    bool empty() const { return books.empty(); }
+
+    // Checkpoint `filepath` at `position_ms` in `chapter`, as of `updated`
+    // (wall-clock seconds), and make it the current book. Repeating the last
+    // checkpoint writes nothing.
+    bool record(const std::string& filepath, int64_t position_ms, int chapter, int64_t updated);
+    // Remember the length of a book that has a position
+    bool set_duration(const std::string& filepath, int64_t duration_ms);
+    // Force everything recorded so far to disk
+    void sync();
+
+private:
+    struct Book {
+        std::string path;
+        int64_t position;
+        int64_t duration;
+        int chapter;
+        int64_t updated;
+
+        Book() : position(-1), duration(0), chapter(-1), updated(0) {}
+    };
+
+    std::string journal_path;
+    int fd;
+    uint64_t append_pos;
+    size_t record_count; // records in the file, stale ones included
+
+    std::unordered_map<uint64_t, Book> books; // by path hash
+    std::unordered_set<uint64_t> described;   // BOOK record already in the file
+    uint64_t current_book;
+
+    bool dirty;          // written since the last fdatasync()
+    int64_t last_sync;   // monotonic ms
+
+    void replay(const uint8_t* data, size_t size, uint64_t* valid_end);
+    bool append(const std::vector<uint8_t>& bytes, size_t records);
+    void after_append();
+    bool compact();
+    void sync_if_due();
+
+    PlaybackJournal(const PlaybackJournal&);
+    PlaybackJournal& operator=(const PlaybackJournal&);
+};
+
+#endif // PLAYBACK_JOURNAL_H
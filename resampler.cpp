@@ -0,0 +1,121 @@
+#include "resampler.h"
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Passband edge relative to the lower of the two Nyquist frequencies; the
+// rest is the transition band the 16 taps need
+static const double CUTOFF = 0.9;
+
+// Frames before the output position that the filter reads
+static const size_t LEAD = Resampler::TAPS / 2 - 1;
+
+int32_t resampler_filter(const int16_t* x, const int16_t* taps) {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t acc = vmull_s16(vld1_s16(x), vld1_s16(taps));
+    acc = vmlal_s16(acc, vld1_s16(x + 4), vld1_s16(taps + 4));
+    acc = vmlal_s16(acc, vld1_s16(x + 8), vld1_s16(taps + 8));
+    acc = vmlal_s16(acc, vld1_s16(x + 12), vld1_s16(taps + 12));
+    int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    return vget_lane_s32(vpadd_s32(sum, sum), 0);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_add_epi32(
+        _mm_madd_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps))),
+        _mm_madd_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 8)),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps + 8))));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc);
+#else
+    int32_t sum = 0;
+    for (unsigned k = 0; k < Resampler::TAPS; ++k) sum += x[k] * taps[k];
+    return sum;
+#endif
+}
+
+Resampler::Resampler() : in_rate(0), out_rate(0), channels(0), step(0), pos(0) {
+    configure(44100, 44100, 2);
+}
+
+void Resampler::configure(unsigned in, unsigned out, unsigned channel_count) {
+    in_rate = in > 0 ? in : 44100;
+    out_rate = out > 0 ? out : in_rate;
+    channels = channel_count > 0 ? channel_count : 1;
+    step = ((uint64_t)in_rate << 32) / out_rate;
+
+    // Blackman-windowed sinc, one row per phase, each row normalized to
+    // unity gain at DC so the rounding cannot add a hum
+    const unsigned phases = 1u << PHASE_BITS;
+    double fc = CUTOFF * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+    coeffs.resize(phases * TAPS);
+    for (unsigned p = 0; p < phases; ++p) {
+        double frac = (double)p / phases;
+        double h[TAPS];
+        double sum = 0;
+        for (unsigned k = 0; k < TAPS; ++k) {
+            double t = (double)k - LEAD - frac;
+            double x = t / (TAPS / 2);
+            double w = fabs(x) < 1.0 ? 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2.0 * M_PI * x) : 0.0;
+            double s = t == 0 ? 1.0 : sin(M_PI * fc * t) / (M_PI * fc * t);
+            h[k] = fc * s * w;
+            sum += h[k];
+        }
+        int total = 0;
+        int16_t* row = &coeffs[p * TAPS];
+        for (unsigned k = 0; k < TAPS; ++k) {
+            row[k] = (int16_t)lround(h[k] / sum * 32768.0);
+            total += row[k];
+        }
+        // Put the rounding error on the largest tap
+        unsigned center = frac < 0.5 ? LEAD : LEAD + 1;
+        row[center] = (int16_t)(row[center] + 32768 - total);
+    }
+    reset();
+}
+
+void Resampler::reset() {
+    history.assign(channels, std::vector<int16_t>(LEAD, 0));
+    pos = (uint64_t)LEAD << 32;
+}
+
+void Resampler::process(const int16_t* in, size_t frames, std::vector<int16_t>* out) {
+    out->clear();
+    if (is_passthrough()) {
+        out->assign(in, in + frames * channels);
+        return;
+    }
+
+    for (unsigned ch = 0; ch < channels; ++ch) {
+        std::vector<int16_t>& h = history[ch];
+        size_t base = h.size();
+        h.resize(base + frames);
+        for (size_t i = 0; i < frames; ++i) h[base + i] = in[i * channels + ch];
+    }
+
+    size_t available = history[0].size();
+    out->reserve((size_t)(((uint64_t)frames << 32) / step + 2) * channels);
+    const unsigned shift = 32 - PHASE_BITS;
+    const uint64_t mask = (1u << PHASE_BITS) - 1;
+    while ((size_t)(pos >> 32) + TAPS / 2 < available) {
+        size_t first = (size_t)(pos >> 32) - LEAD;
+        const int16_t* taps = &coeffs[((pos >> shift) & mask) * TAPS];
+        for (unsigned ch = 0; ch < channels; ++ch) {
+            int32_t y = (resampler_filter(&history[ch][first], taps) + (1 << 14)) >> 15;
+            out->push_back((int16_t)(y > 32767 ? 32767 : y < -32768 ? -32768 : y));
+        }
+        pos += step;
+    }
+
+    // Keep only what the next output still reads
+    size_t drop = (size_t)(pos >> 32) - LEAD;
+    if (drop > available) drop = available;
+    for (unsigned ch = 0; ch < channels; ++ch) {
+        history[ch].erase(history[ch].begin(), history[ch].begin() + drop);
+    }
+    pos -= (uint64_t)drop << 32;
+}
@@ -0,0 +1,54 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Fixed-point polyphase resampler for interleaved 16-bit PCM, so the sink
+// gets audio at the output device's native rate and never converts itself.
+//
+// Each output sample is a 16-tap windowed-sinc filter over the input, with
+// the taps picked from a table of 256 sub-sample phases. The position in the
+// input advances by a 32.32 fixed-point step, so the output length tracks
+// the exact rate ratio over a whole book. Coefficients are Q15 and summed in
+// 32 bits with a NEON/SSE2 kernel.
+class Resampler {
+public:
+    Resampler();
+
+    // Set the rates and channel count and drop buffered audio. Equal rates
+    // make process() a copy.
+    void configure(unsigned in_rate, unsigned out_rate, unsigned channels);
+    bool is_passthrough() const { return in_rate == out_rate; }
+
+    // Drop buffered input, e.g. after a seek. The next input frame lines up
+    // with the next output frame.
+    void reset();
+
+    // Feed `frames` interleaved frames and replace `out` with the output
+    // that is ready; the last few input frames stay buffered for the filter.
+    void process(const int16_t* in, size_t frames, std::vector<int16_t>* out);
+
+    static const unsigned TAPS = 16;
+    static const unsigned PHASE_BITS = 8;
+
+private:
+    unsigned in_rate;
+    unsigned out_rate;
+    unsigned channels;
+    uint64_t step;      // input frames per output frame, 32.32
+
+    std::vector<int16_t> coeffs;  // (1 << PHASE_BITS) rows of TAPS, Q15
+
+    // Input still needed by the filter, one row per channel so every tap run
+    // is contiguous; starts with TAPS / 2 - 1 frames of history
+    std::vector<std::vector<int16_t> > history;
+    uint64_t pos;       // next output's position in the history, 32.32
+};
+
+// Q15 filter of `Resampler::TAPS` samples, SIMD where available. The taps'
+// absolute sum must stay below 2.0 so the int32 lanes cannot overflow.
+int32_t resampler_filter(const int16_t* x, const int16_t* taps);
+
+#endif // RESAMPLER_H
@@ -0,0 +1,537 @@
+#include "seek_index.h"
+#include "mp4_boxes.h"
+#include "lark_paths.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const char INDEX_MAGIC[4] = { 'L', 'K', 'I', 'X' };
+static const uint32_t INDEX_VERSION = 1;
+static const int64_t NSEC_PER_SEC = 1000000000LL;
+
+// Sequential reader over a sample table, so multi-megabyte stsz/stco boxes
+// are read in large blocks instead of one pread per entry.
+class TableReader {
+public:
+    TableReader(const Mp4File& file, uint64_t pos, uint64_t end)
+        : file(file), pos(pos), end(end), fill(0), cursor(0) {}
+
+    bool u32(uint32_t* value) {
+        uint8_t b[4];
+        if (!bytes(b, 4)) return false;
+        *value = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+        return true;
+    }
+
+    bool u64(uint64_t* value) {
+        uint32_t hi, lo;
+        if (!u32(&hi) || !u32(&lo)) return false;
+        *value = ((uint64_t)hi << 32) | lo;
+        return true;
+    }
+
+    bool bytes(uint8_t* out, size_t len) {
+        while (len > 0) {
+            if (cursor == fill && !refill()) return false;
+            size_t n = std::min(len, fill - cursor);
+            memcpy(out, buffer + cursor, n);
+            out += n;
+            cursor += n;
+            len -= n;
+        }
+        return true;
+    }
+
+private:
+    const Mp4File& file;
+    uint64_t pos;
+    uint64_t end;
+    uint8_t buffer[65536];
+    size_t fill;
+    size_t cursor;
+
+    bool refill() {
+        if (pos >= end) return false;
+        size_t n = (size_t)std::min<uint64_t>(sizeof(buffer), end - pos);
+        if (!file.read(pos, buffer, n)) return false;
+        pos += n;
+        fill = n;
+        cursor = 0;
+        return true;
+    }
+};
+
+// Whether `count` entries of `entry_bits` each fit between `table_start` and
+// the end of `box`. Checked before sizing a vector from a count in the file,
+// so a corrupt header cannot ask for gigabytes.
+static bool table_fits(const Mp4Box& box, uint64_t table_start, uint32_t count, unsigned entry_bits) {
+    if (table_start > box.end()) return false;
+    return ((uint64_t)count * entry_bits + 7) / 8 <= box.end() - table_start;
+}
+
+SeekIndex::SeekIndex() {
+    clear();
+}
+
+void SeekIndex::clear() {
+    filepath.clear();
+    file_size = 0;
+    file_mtime = 0;
+    timescale = 0;
+    total = 0;
+    frames = 0;
+    fixed_size = 0;
+    max_size = 0;
+    runs.clear();
+    chunks.clear();
+    sizes.clear();
+}
+
+bool SeekIndex::build(const Mp4File& file, const Mp4Box& trak) {
+    clear();
+    file_size = file.size();
+    file_mtime = file.mtime();
+
+    static const uint32_t mdhd_path[] = { MP4_FOURCC('m','d','i','a'), MP4_FOURCC('m','d','h','d') };
+    static const uint32_t stbl_path[] = {
+        MP4_FOURCC('m','d','i','a'), MP4_FOURCC('m','i','n','f'), MP4_FOURCC('s','t','b','l')
+    };
+
+    Mp4Box mdhd, stbl;
+    if (!file.find_path(trak, mdhd_path, 2, &mdhd)) return false;
+    if (!file.find_path(trak, stbl_path, 3, &stbl)) return false;
+
+    uint8_t version;
+    if (!file.read_u8(mdhd.payload(), &version)) return false;
+    // version 1 uses 64-bit creation/modification times
+    if (!file.read_u32(mdhd.payload() + (version == 1 ? 20 : 12), &timescale) || timescale == 0) {
+        return false;
+    }
+
+    // --- stsz / stz2: frame sizes ---
+    Mp4Box box;
+    uint32_t count = 0;
+    if (file.find_child(stbl, MP4_FOURCC('s','t','s','z'), &box)) {
+        TableReader in(file, box.payload() + 4, box.end());
+        if (!in.u32(&fixed_size) || !in.u32(&count)) return false;
+        frames = count;
+        if (fixed_size == 0) {
+            if (!table_fits(box, box.payload() + 12, count, 32)) return false;
+            sizes.resize(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t size;
+                if (!in.u32(&size) || size > 0xFFFF) return false;
+                sizes[i] = (uint16_t)size;
+                max_size = std::max(max_size, size);
+            }
+        } else {
+            max_size = fixed_size;
+        }
+    } else if (file.find_child(stbl, MP4_FOURCC('s','t','z','2'), &box)) {
+        uint8_t field_size;
+        if (!file.read_u8(box.payload() + 7, &field_size)) return false;
+        TableReader in(file, box.payload() + 8, box.end());
+        if (!in.u32(&count)) return false;
+        if (field_size != 4 && field_size != 8 && field_size != 16) return false;
+        if (!table_fits(box, box.payload() + 12, count, field_size)) return false;
+        frames = count;
+        sizes.resize(count);
+        uint8_t packed = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t size = 0;
+            if (field_size == 4) {
+                if ((i & 1) == 0 && !in.bytes(&packed, 1)) return false;
+                size = (i & 1) ? (packed & 0x0F) : (packed >> 4);
+            } else if (field_size == 8) {
+                uint8_t b;
+                if (!in.bytes(&b, 1)) return false;
+                size = b;
+            } else if (field_size == 16) {
+                uint8_t b[2];
+                if (!in.bytes(b, 2)) return false;
+                size = (b[0] << 8) | b[1];
+            } else {
+                return false;
+            }
+            sizes[i] = (uint16_t)size;
+            max_size = std::max(max_size, size);
+        }
+    } else {
+        return false;
+    }
+    if (frames == 0) return false;
+
+    // --- stts: frame durations, stored as runs with cumulative start times ---
+    if (!file.find_child(stbl, MP4_FOURCC('s','t','t','s'), &box)) return false;
+    {
+        TableReader in(file, box.payload() + 4, box.end());
+        uint32_t entries;
+        if (!in.u32(&entries)) return false;
+        uint32_t frame = 0;
+        for (uint32_t i = 0; i < entries && frame < frames; ++i) {
+            TimeRun run;
+            if (!in.u32(&run.count) || !in.u32(&run.delta)) return false;
+            if (run.count == 0) continue;
+            run.count = std::min(run.count, frames - frame);
+            run.first_frame = frame;
+            run.first_unit = total;
+            runs.push_back(run);
+            frame += run.count;
+            total += (uint64_t)run.count * run.delta;
+        }
+        if (frame < frames) frames = frame;
+    }
+
+    // --- stco / co64: chunk offsets ---
+    std::vector<uint64_t> offsets;
+    bool wide = false;
+    if (file.find_child(stbl, MP4_FOURCC('c','o','6','4'), &box)) {
+        wide = true;
+    } else if (!file.find_child(stbl, MP4_FOURCC('s','t','c','o'), &box)) {
+        return false;
+    }
+    {
+        TableReader in(file, box.payload() + 4, box.end());
+        uint32_t entries;
+        if (!in.u32(&entries)) return false;
+        if (!table_fits(box, box.payload() + 8, entries, wide ? 64 : 32)) return false;
+        offsets.resize(entries);
+        for (uint32_t i = 0; i < entries; ++i) {
+            if (wide) {
+                if (!in.u64(&offsets[i])) return false;
+            } else {
+                uint32_t offset;
+                if (!in.u32(&offset)) return false;
+                offsets[i] = offset;
+            }
+        }
+    }
+
+    // --- stsc: frames per chunk, expanded to the first frame of every chunk ---
+    if (!file.find_child(stbl, MP4_FOURCC('s','t','s','c'), &box)) return false;
+    {
+        TableReader in(file, box.payload() + 4, box.end());
+        uint32_t entries;
+        if (!in.u32(&entries)) return false;
+
+        uint32_t first_chunk = 0, per_chunk = 0, desc;
+        if (entries > 0 && (!in.u32(&first_chunk) || !in.u32(&per_chunk) || !in.u32(&desc))) return false;
+        if (first_chunk == 0) return false; // chunk numbers are 1-based
+
+        uint32_t frame = 0;
+        chunks.reserve(offsets.size());
+        for (uint32_t e = 0; e < entries && frame < frames; ++e) {
+            uint32_t next_first = (uint32_t)offsets.size() + 1;
+            uint32_t next_per_chunk = 0;
+            if (e + 1 < entries) {
+                if (!in.u32(&next_first) || !in.u32(&next_per_chunk) || !in.u32(&desc)) return false;
+            }
+            for (uint32_t c = first_chunk; c < next_first && c <= offsets.size() && frame < frames; ++c) {
+                Chunk chunk;
+                chunk.first_frame = frame;
+                chunk.offset = offsets[c - 1];
+                chunks.push_back(chunk);
+                frame += per_chunk;
+            }
+            first_chunk = next_first;
+            per_chunk = next_per_chunk;
+        }
+        if (frame < frames) frames = frame;
+    }
+
+    if (chunks.empty() || runs.empty()) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+int64_t SeekIndex::track_duration(const Mp4File& file, const Mp4Box& trak) {
+    static const uint32_t mdhd_path[] = { MP4_FOURCC('m','d','i','a'), MP4_FOURCC('m','d','h','d') };
+    static const uint32_t stbl_path[] = {
+        MP4_FOURCC('m','d','i','a'), MP4_FOURCC('m','i','n','f'), MP4_FOURCC('s','t','b','l')
+    };
+
+    Mp4Box mdhd, stbl, box;
+    uint8_t version;
+    uint32_t scale;
+    if (!file.find_path(trak, mdhd_path, 2, &mdhd) || !file.find_path(trak, stbl_path, 3, &stbl)
+        || !file.read_u8(mdhd.payload(), &version)
+        || !file.read_u32(mdhd.payload() + (version == 1 ? 20 : 12), &scale) || scale == 0) {
+        return 0;
+    }
+
+    // Frame count from the stsz/stz2 header only, so the time runs are cut
+    // where build() cuts them
+    uint32_t frames;
+    if (file.find_child(stbl, MP4_FOURCC('s','t','s','z'), &box)) {
+        if (!file.read_u32(box.payload() + 8, &frames)) return 0;
+    } else if (file.find_child(stbl, MP4_FOURCC('s','t','z','2'), &box)) {
+        if (!file.read_u32(box.payload() + 8, &frames)) return 0;
+    } else {
+        return 0;
+    }
+
+    if (!file.find_child(stbl, MP4_FOURCC('s','t','t','s'), &box)) return 0;
+    TableReader in(file, box.payload() + 4, box.end());
+    uint32_t entries;
+    if (!in.u32(&entries)) return 0;
+    uint64_t units = 0;
+    uint32_t frame = 0;
+    for (uint32_t i = 0; i < entries && frame < frames; ++i) {
+        uint32_t count, delta;
+        if (!in.u32(&count) || !in.u32(&delta)) return 0;
+        count = std::min(count, frames - frame);
+        frame += count;
+        units += (uint64_t)count * delta;
+    }
+    return (int64_t)(units / scale) * NSEC_PER_SEC + (int64_t)((units % scale) * NSEC_PER_SEC / scale);
+}
+
+uint32_t SeekIndex::frame_for_units(uint64_t units) const {
+    if (runs.empty()) return 0;
+    if (units >= total) return frames - 1;
+
+    // Last run starting at or before `units`
+    size_t lo = 0, hi = runs.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (runs[mid].first_unit <= units) lo = mid;
+        else hi = mid;
+    }
+    const TimeRun& run = runs[lo];
+    uint64_t step = run.delta > 0 ? (units - run.first_unit) / run.delta : 0;
+    if (step >= run.count) step = run.count - 1;
+    return run.first_frame + (uint32_t)step;
+}
+
+uint64_t SeekIndex::frame_start_units(uint32_t frame) const {
+    if (runs.empty()) return 0;
+    if (frame >= frames) return total;
+
+    size_t lo = 0, hi = runs.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (runs[mid].first_frame <= frame) lo = mid;
+        else hi = mid;
+    }
+    const TimeRun& run = runs[lo];
+    return run.first_unit + (uint64_t)(frame - run.first_frame) * run.delta;
+}
+
+int64_t SeekIndex::frame_start_time(uint32_t frame) const {
+    if (timescale == 0) return 0;
+    uint64_t units = frame_start_units(frame);
+    return (int64_t)(units / timescale) * NSEC_PER_SEC
+         + (int64_t)((units % timescale) * NSEC_PER_SEC / timescale);
+}
+
+uint32_t SeekIndex::frame_for_time(int64_t position, int64_t* frame_start) const {
+    if (!is_valid()) {
+        if (frame_start) *frame_start = 0;
+        return 0;
+    }
+    if (position < 0) position = 0;
+
+    // Split to avoid overflowing 64 bits for very long books
+    uint64_t units = (uint64_t)(position / NSEC_PER_SEC) * timescale
+                   + (uint64_t)(position % NSEC_PER_SEC) * timescale / NSEC_PER_SEC;
+    uint32_t frame = frame_for_units(units);
+    if (frame_start) *frame_start = frame_start_time(frame);
+    return frame;
+}
+
+size_t SeekIndex::chunk_for_frame(uint32_t frame) const {
+    // Last chunk whose first frame is at or before `frame`
+    size_t lo = 0, hi = chunks.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (chunks[mid].first_frame <= frame) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+uint32_t SeekIndex::chunk_first_frame(size_t chunk) const {
+    return chunk < chunks.size() ? chunks[chunk].first_frame : frames;
+}
+
+uint64_t SeekIndex::frame_offset(uint32_t frame) const {
+    if (chunks.empty() || frame >= frames) return 0;
+
+    const Chunk& chunk = chunks[chunk_for_frame(frame)];
+    if (fixed_size) {
+        return chunk.offset + (uint64_t)(frame - chunk.first_frame) * fixed_size;
+    }
+    uint64_t offset = chunk.offset;
+    for (uint32_t i = chunk.first_frame; i < frame; ++i) {
+        offset += sizes[i];
+    }
+    return offset;
+}
+
+uint32_t SeekIndex::frame_size(uint32_t frame) const {
+    if (frame >= frames) return 0;
+    return fixed_size ? fixed_size : sizes[frame];
+}
+
+// --- On-disk cache ---
+
+struct IndexCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t path_len;
+    uint32_t timescale;
+    uint64_t total;
+    uint32_t frames;
+    uint32_t fixed_size;
+    uint32_t max_size;
+    uint32_t run_count;
+    uint32_t chunk_count;
+    uint32_t size_count;
+};
+
+std::string SeekIndex::cache_path_for(const std::string& filepath) {
+    std::string dir = lark_cache_dir(".lark_index");
+    if (dir.empty()) return std::string();
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.idx", lark_hash64(filepath));
+    return dir + name;
+}
+
+bool SeekIndex::load_cache(const std::string& cache_path) {
+    FILE* in = fopen(cache_path.c_str(), "rb");
+    if (!in) return false;
+
+    IndexCacheHeader header;
+    bool ok = fread(&header, sizeof(header), 1, in) == 1
+           && memcmp(header.magic, INDEX_MAGIC, 4) == 0
+           && header.version == INDEX_VERSION
+           && header.file_size == file_size
+           && header.file_mtime == file_mtime
+           && header.path_len == filepath.size()
+           // No table can have more entries than there are frames
+           && header.run_count <= header.frames
+           && header.chunk_count <= header.frames
+           && header.size_count <= header.frames;
+
+    if (ok) {
+        std::string stored(header.path_len, '\0');
+        ok = fread(&stored[0], 1, header.path_len, in) == header.path_len && stored == filepath;
+    }
+    if (ok) {
+        runs.resize(header.run_count);
+        chunks.resize(header.chunk_count);
+        sizes.resize(header.size_count);
+        ok = (runs.empty() || fread(&runs[0], sizeof(TimeRun), runs.size(), in) == runs.size())
+          && (chunks.empty() || fread(&chunks[0], sizeof(Chunk), chunks.size(), in) == chunks.size())
+          && (sizes.empty() || fread(&sizes[0], sizeof(uint16_t), sizes.size(), in) == sizes.size());
+    }
+    fclose(in);
+
+    if (ok) {
+        timescale = header.timescale;
+        total = header.total;
+        frames = header.frames;
+        fixed_size = header.fixed_size;
+        max_size = header.max_size;
+        ok = tables_consistent();
+    }
+    if (!ok) {
+        clear();
+        return false;
+    }
+    return is_valid();
+}
+
+// A cache written by another build or truncated on disk must not send the
+// lookups past the ends of the tables
+bool SeekIndex::tables_consistent() const {
+    if (fixed_size == 0 && sizes.size() != frames) return false;
+    if (runs.empty() || chunks.empty()) return false;
+
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (runs[i].count == 0 || runs[i].first_frame >= frames) return false;
+        if (runs[i].first_frame != (i == 0 ? 0 : runs[i - 1].first_frame + runs[i - 1].count)) return false;
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].first_frame >= frames) return false;
+        if (i == 0 ? chunks[i].first_frame != 0 : chunks[i].first_frame < chunks[i - 1].first_frame) return false;
+    }
+    return true;
+}
+
+bool SeekIndex::save_cache(const std::string& cache_path) const {
+    std::string tmp_path = cache_path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (!out) return false;
+
+    IndexCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = INDEX_VERSION;
+    header.file_size = file_size;
+    header.file_mtime = file_mtime;
+    header.path_len = (uint32_t)filepath.size();
+    header.timescale = timescale;
+    header.total = total;
+    header.frames = frames;
+    header.fixed_size = fixed_size;
+    header.max_size = max_size;
+    header.run_count = (uint32_t)runs.size();
+    header.chunk_count = (uint32_t)chunks.size();
+    header.size_count = (uint32_t)sizes.size();
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+           && fwrite(filepath.data(), 1, filepath.size(), out) == filepath.size()
+           && (runs.empty() || fwrite(&runs[0], sizeof(TimeRun), runs.size(), out) == runs.size())
+           && (chunks.empty() || fwrite(&chunks[0], sizeof(Chunk), chunks.size(), out) == chunks.size())
+           && (sizes.empty() || fwrite(&sizes[0], sizeof(uint16_t), sizes.size(), out) == sizes.size());
+    ok = (fclose(out) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SeekIndex::load_or_build(const char* path) {
+    clear();
+    if (!path) return false;
+
+    Mp4File file;
+    Mp4Box moov, trak;
+    if (!file.open(path) || !mp4_find_moov(file, &moov)
+        || !mp4_find_track(file, moov, MP4_FOURCC('s','o','u','n'), 0, &trak)) {
+        return false;
+    }
+    return load_or_build(path, file, trak);
+}
+
+bool SeekIndex::load_or_build(const char* path, const Mp4File& file, const Mp4Box& trak) {
+    clear();
+    filepath = path;
+    file_size = file.size();
+    file_mtime = file.mtime();
+
+    std::string cache_path = cache_path_for(filepath);
+    if (!cache_path.empty() && load_cache(cache_path)) {
+        return true;
+    }
+
+    if (!build(file, trak)) {
+        clear();
+        return false;
+    }
+    filepath = path;
+
+    if (!cache_path.empty()) {
+        save_cache(cache_path);
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class Mp4File;
+struct Mp4Box;
+
+// Time -> frame -> file offset index of one audio track, built from the
+// stts/stsc/stsz/stco/co64 sample tables. Lookups are binary searches, so a
+// seek costs O(log n) even in a 40-hour book, and the index is cached on disk
+// (keyed by path, size and mtime) so reopening a book does not rescan it.
+class SeekIndex {
+public:
+    SeekIndex();
+
+    // Load the cached index for `filepath`, or build it from the file and
+    // write it to the cache. Returns false if the file has no usable track.
+    bool load_or_build(const char* filepath);
+
+    // Same, for a file and audio track the caller has already opened
+    bool load_or_build(const char* filepath, const Mp4File& file, const Mp4Box& trak);
+
+    // Build from the sample tables of an already opened track
+    bool build(const Mp4File& file, const Mp4Box& trak);
+
+    // Duration of a track in nanoseconds from mdhd and stts alone, without
+    // reading its per-frame tables or touching the cache; 0 if unknown.
+    // Agrees with an index built from the same track.
+    static int64_t track_duration(const Mp4File& file, const Mp4Box& trak);
+
+    void clear();
+    bool is_valid() const { return frames > 0 && timescale > 0; }
+    const std::string& get_filepath() const { return filepath; }
+
+    uint32_t frame_count() const { return frames; }
+    uint32_t get_timescale() const { return timescale; }
+    uint64_t total_units() const { return total; }
+
+    // Frame containing `position` (nanoseconds). If `frame_start` is given it
+    // receives the frame's start in nanoseconds, so callers can trim the
+    // decoded output to the exact sample.
+    uint32_t frame_for_time(int64_t position, int64_t* frame_start = nullptr) const;
+
+    // Frame containing media time `units` (in timescale units)
+    uint32_t frame_for_units(uint64_t units) const;
+    uint64_t frame_start_units(uint32_t frame) const;
+    int64_t frame_start_time(uint32_t frame) const;
+
+    uint64_t frame_offset(uint32_t frame) const;
+    uint32_t frame_size(uint32_t frame) const;
+    uint32_t max_frame_size() const { return max_size; }
+
+    // Chunk layout, for readers that walk frames sequentially
+    size_t chunk_count() const { return chunks.size(); }
+    size_t chunk_for_frame(uint32_t frame) const;
+    uint32_t chunk_first_frame(size_t chunk) const;
+    uint64_t chunk_offset(size_t chunk) const { return chunks[chunk].offset; }
+
+private:
+    struct TimeRun {
+        uint32_t first_frame;
+        uint32_t count;
+        uint32_t delta;
+        uint64_t first_unit;
+    };
+    struct Chunk {
+        uint32_t first_frame;
+        uint64_t offset;
+    };
+
+    std::string filepath;
+    uint64_t file_size;
+    int64_t file_mtime;
+
+    uint32_t timescale;
+    uint64_t total;
+    uint32_t frames;
+    uint32_t fixed_size; // non-zero when every frame has the same size
+    uint32_t max_size;
+
+    std::vector<TimeRun> runs;
+    std::vector<Chunk> chunks;
+    std::vector<uint16_t> sizes;
+
+    bool load_cache(const std::string& cache_path);
+    bool tables_consistent() const;
+    bool save_cache(const std::string& cache_path) const;
+    static std::string cache_path_for(const std::string& filepath);
+};
+
+#endif // SEEK_INDEX_H
@@ -0,0 +1,146 @@
+#include "silence_skip.h"
+#include <math.h>
+#include <stdlib.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const unsigned WINDOW_MS = 10;
+
+// Samples summed in 32-bit lanes before they are widened: 32 squares of
+// 12-bit values per lane stay below 2^29
+static const size_t BLOCK = 128;
+
+void silence_window_stats(const int16_t* x, size_t n, uint64_t* sum_sq, int* peak) {
+    uint64_t sum = 0;
+    int max_abs = 0;
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int16x8_t vmax = vdupq_n_s16(0);
+    while (i + 8 <= n) {
+        int32x4_t acc = vdupq_n_s32(0);
+        size_t end = i + BLOCK < n ? i + BLOCK : n;
+        for (; i + 8 <= end; i += 8) {
+            int16x8_t v = vld1q_s16(x + i);
+            int16x8_t s = vshrq_n_s16(v, 3);
+            acc = vmlal_s16(acc, vget_low_s16(s), vget_low_s16(s));
+            acc = vmlal_s16(acc, vget_high_s16(s), vget_high_s16(s));
+            vmax = vmaxq_s16(vmax, vqabsq_s16(v));
+        }
+        int32_t lanes[4];
+        vst1q_s32(lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    int16_t maxes[8];
+    vst1q_s16(maxes, vmax);
+    for (int k = 0; k < 8; ++k) {
+        if (maxes[k] > max_abs) max_abs = maxes[k];
+    }
+#elif defined(__SSE2__)
+    __m128i vmax = _mm_setzero_si128();
+    while (i + 8 <= n) {
+        __m128i acc = _mm_setzero_si128();
+        size_t end = i + BLOCK < n ? i + BLOCK : n;
+        for (; i + 8 <= end; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+            __m128i s = _mm_srai_epi16(v, 3);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(s, s));
+            // |v| saturated, so -32768 becomes 32767
+            __m128i neg = _mm_subs_epi16(_mm_setzero_si128(), v);
+            vmax = _mm_max_epi16(vmax, _mm_max_epi16(v, neg));
+        }
+        int32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    int16_t maxes[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(maxes), vmax);
+    for (int k = 0; k < 8; ++k) {
+        if (maxes[k] > max_abs) max_abs = maxes[k];
+    }
+#endif
+    for (; i < n; ++i) {
+        int s = x[i] >> 3;
+        int a = abs((int)x[i]);
+        sum += (uint64_t)(s * s);
+        if (a > max_abs) max_abs = a > 32767 ? 32767 : a;
+    }
+    *sum_sq = sum;
+    *peak = max_abs;
+}
+
+SilenceSkipper::SilenceSkipper()
+    : samplerate(0), channels(0), window(0), min_silence(0), threshold(0), silent_run(0) {
+    configure(44100, 2);
+    set_params(0, -40);
+}
+
+void SilenceSkipper::configure(unsigned rate, unsigned channel_count) {
+    int min_ms = samplerate > 0 ? (int)(min_silence * 1000 / samplerate) : 0;
+    samplerate = rate > 0 ? rate : 44100;
+    channels = channel_count > 0 ? channel_count : 1;
+    window = samplerate * WINDOW_MS / 1000;
+    min_silence = (size_t)min_ms * samplerate / 1000;
+    reset();
+}
+
+void SilenceSkipper::set_params(int min_silence_ms, int threshold_db) {
+    min_silence = min_silence_ms > 0 ? (size_t)min_silence_ms * samplerate / 1000 : 0;
+    if (min_silence_ms > 0 && min_silence == 0) min_silence = 1;
+    threshold = 32768.0 * pow(10.0, threshold_db / 20.0);
+}
+
+void SilenceSkipper::reset() {
+    pending.clear();
+    silent_run = 0;
+}
+
+void SilenceSkipper::process(const int16_t* in, size_t frames, std::vector<int16_t>* out,
+                             std::vector<Cut>* cuts) {
+    out->clear();
+    cuts->clear();
+    if (!is_enabled()) {
+        // Switched off: hand back what was held, then pass through
+        out->swap(pending);
+        out->insert(out->end(), in, in + frames * channels);
+        silent_run = 0;
+        return;
+    }
+
+    pending.insert(pending.end(), in, in + frames * channels);
+    size_t total = pending.size() / channels;
+    size_t samples = window * channels;
+    // Compare in the detector's units: sum of (x >> 3)^2 over a window
+    double limit = threshold * threshold / 64.0 * samples;
+    int peak_limit = (int)(threshold * 4.0);
+
+    size_t done = 0;
+    size_t out_frames = 0;
+    out->reserve(pending.size());
+    for (; done + window <= total; done += window) {
+        const int16_t* w = &pending[done * channels];
+        uint64_t sum_sq;
+        int peak;
+        silence_window_stats(w, samples, &sum_sq, &peak);
+
+        bool silent = (double)sum_sq < limit && peak < peak_limit;
+        silent_run = silent ? silent_run + window : 0;
+
+        if (silent && silent_run > min_silence) {
+            if (!cuts->empty() && cuts->back().out_frame == out_frames) {
+                cuts->back().frames += window;
+            } else {
+                Cut cut = { out_frames, window };
+                cuts->push_back(cut);
+            }
+            continue;
+        }
+        out->insert(out->end(), w, w + samples);
+        out_frames += window;
+    }
+    pending.erase(pending.begin(), pending.begin() + done * channels);
+}
@@ -0,0 +1,59 @@
+#ifndef SILENCE_SKIP_H
+#define SILENCE_SKIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Shortens dead air in interleaved 16-bit PCM. Audio is classified in 10 ms
+// windows by RMS (with a peak guard so a quiet plosive is not mistaken for
+// silence); once a silent run is longer than the configured length, further
+// silent windows are dropped until sound returns. Pauses therefore keep
+// their natural start and are only cut short.
+//
+// Works as a streaming stage with no look-ahead: at most one partial window
+// is held back between calls.
+class SilenceSkipper {
+public:
+    // `frames` were dropped right before output frame `out_frame` of a call
+    struct Cut {
+        size_t out_frame;
+        size_t frames;
+    };
+
+    SilenceSkipper();
+
+    // Set the stream format; drops buffered audio
+    void configure(unsigned samplerate, unsigned channels);
+    unsigned get_channels() const { return channels; }
+
+    // Cut silences down to `min_silence_ms` (0 disables). Windows whose RMS
+    // is below `threshold_db` dBFS count as silent.
+    void set_params(int min_silence_ms, int threshold_db);
+    bool is_enabled() const { return min_silence > 0; }
+    // Disabled and nothing held back: process() would copy its input
+    bool is_idle() const { return min_silence == 0 && pending.empty(); }
+
+    // Forget the current silent run and any held-back audio, e.g. on seek
+    void reset();
+
+    // Replace `out` with the audio to play and `cuts` with where silence was
+    // removed from it
+    void process(const int16_t* in, size_t frames, std::vector<int16_t>* out, std::vector<Cut>* cuts);
+
+private:
+    unsigned samplerate;
+    unsigned channels;
+    size_t window;       // frames per analysis window
+    size_t min_silence;  // frames of silence kept, 0 when disabled
+    double threshold;    // RMS amplitude
+    size_t silent_run;   // frames of silence seen in a row
+
+    std::vector<int16_t> pending; // less than one window, carried over
+};
+
+// Energy of `n` samples for the silence detector, with NEON/SSE2 kernels:
+// the sum of (x >> 3)^2 (small enough for 32-bit lanes) and the peak |x|.
+void silence_window_stats(const int16_t* x, size_t n, uint64_t* sum_sq, int* peak);
+
+#endif // SILENCE_SKIP_H
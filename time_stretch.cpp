@@ -0,0 +1,191 @@
+#include "time_stretch.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Segment layout tuned for speech: 40 ms segments, 8 ms cross-fades, and a
+// 15 ms window to look for the best alignment in
+static const unsigned SEQUENCE_MS = 40;
+static const unsigned OVERLAP_MS = 8;
+static const unsigned SEEK_MS = 15;
+
+// Keeps time_stretch_dot() sums inside int32 lanes (see the mono scaling)
+static const size_t MAX_OVERLAP = 1024;
+
+int64_t time_stretch_dot(const int16_t* a, const int16_t* b, size_t n) {
+    size_t i = 0;
+    int64_t sum = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t va = vld1q_s16(a + i);
+        int16x8_t vb = vld1q_s16(b + i);
+        acc = vmlal_s16(acc, vget_low_s16(va), vget_low_s16(vb));
+        acc = vmlal_s16(acc, vget_high_s16(va), vget_high_s16(vb));
+    }
+    int32_t lanes[4];
+    vst1q_s32(lanes, acc);
+    sum = (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; ++i) {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+TimeStretch::TimeStretch()
+    : samplerate(0), channels(0), speed(MIN_SPEED), active_speed(MIN_SPEED),
+      sequence(0), overlap(0), seek_range(0),
+      input_start(0), input_pos(0), primed(false) {
+    configure(44100, 2);
+}
+
+void TimeStretch::configure(unsigned rate, unsigned channel_count) {
+    samplerate = rate > 0 ? rate : 44100;
+    channels = channel_count > 0 ? channel_count : 1;
+
+    overlap = samplerate * OVERLAP_MS / 1000;
+    if (overlap > MAX_OVERLAP) overlap = MAX_OVERLAP;
+    sequence = samplerate * SEQUENCE_MS / 1000;
+    if (sequence < 2 * overlap) sequence = 2 * overlap;
+    seek_range = samplerate * SEEK_MS / 1000;
+    reset();
+}
+
+void TimeStretch::set_speed(int value) {
+    if (value < MIN_SPEED) value = MIN_SPEED;
+    if (value > MAX_SPEED) value = MAX_SPEED;
+    speed = value;
+}
+
+void TimeStretch::reset() {
+    input.clear();
+    mono.clear();
+    input_start = 0;
+    input_pos = 0;
+    primed = false;
+    active_speed = speed;
+}
+
+void TimeStretch::process(const int16_t* in, size_t frames, std::vector<int16_t>* out) {
+    out->clear();
+    if (active_speed == MIN_SPEED) {
+        out->assign(in, in + frames * channels);
+        return;
+    }
+
+    input.insert(input.end(), in, in + frames * channels);
+    // Mono copy at 12 bits: plenty to find an alignment, and small enough
+    // for the SIMD dot product to accumulate in 32-bit lanes
+    size_t first = mono.size();
+    mono.resize(first + frames);
+    for (size_t i = 0; i < frames; ++i) {
+        const int16_t* f = in + i * channels;
+        mono[first + i] = channels >= 2 ? (int16_t)((f[0] + f[1]) >> 5) : (int16_t)(f[0] >> 4);
+    }
+
+    size_t live = mono.size() - input_start;
+    double advance = (double)sequence * active_speed / 1000.0;
+
+    if (!primed) {
+        // The first segment plays from the start as is
+        if (live < sequence + overlap) return;
+        const int16_t* seg = &input[input_start * channels];
+        out->insert(out->end(), seg, seg + sequence * channels);
+        tail.assign(seg + sequence * channels, seg + (sequence + overlap) * channels);
+        tail_mono.assign(mono.begin() + input_start + sequence,
+                         mono.begin() + input_start + sequence + overlap);
+        input_pos = advance;
+        primed = true;
+    }
+
+    while ((size_t)input_pos + seek_range + sequence + overlap <= live) {
+        size_t start = input_start + (size_t)input_pos;
+        emit_segment(start + find_best_offset(start), out);
+        input_pos += advance;
+    }
+
+    compact();
+}
+
+size_t TimeStretch::find_best_offset(size_t start) const {
+    const int16_t* ref = &tail_mono[0];
+    size_t step = samplerate / 11025;
+    if (step < 1) step = 1;
+
+    size_t best = 0;
+    double best_score = -HUGE_VAL;
+    size_t lo = 0, hi = seek_range;
+
+    // Coarse pass over the whole window, then every offset around the winner
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t offset = lo; offset < hi; offset += step) {
+            const int16_t* x = &mono[start + offset];
+            double corr = (double)time_stretch_dot(ref, x, overlap);
+            double energy = (double)time_stretch_dot(x, x, overlap);
+            // Normalized correlation, squared with its sign kept (no sqrt)
+            double score = corr * fabs(corr) / (energy + 1.0);
+            if (score > best_score) {
+                best_score = score;
+                best = offset;
+            }
+        }
+        if (step == 1) break;
+        lo = best >= step ? best - step + 1 : 0;
+        hi = best + step < seek_range ? best + step : seek_range;
+        step = 1;
+    }
+    return best;
+}
+
+void TimeStretch::emit_segment(size_t start, std::vector<int16_t>* out) {
+    const int16_t* seg = &input[start * channels];
+    size_t base = out->size();
+    out->resize(base + sequence * channels);
+    int16_t* dst = &(*out)[base];
+
+    // Linear cross-fade from where the last segment was heading
+    int32_t len = (int32_t)overlap;
+    for (size_t i = 0; i < overlap; ++i) {
+        int32_t w = (int32_t)i;
+        for (unsigned c = 0; c < channels; ++c) {
+            size_t k = i * channels + c;
+            dst[k] = (int16_t)((tail[k] * (len - w) + seg[k] * w) / len);
+        }
+    }
+    memcpy(dst + overlap * channels, seg + overlap * channels,
+           (sequence - overlap) * channels * sizeof(int16_t));
+
+    tail.assign(seg + sequence * channels, seg + (sequence + overlap) * channels);
+    tail_mono.assign(mono.begin() + start + sequence, mono.begin() + start + sequence + overlap);
+}
+
+void TimeStretch::compact() {
+    // At high speeds the next segment may start past the input received so far
+    size_t consumed = (size_t)input_pos;
+    if (consumed > mono.size() - input_start) consumed = mono.size() - input_start;
+    input_start += consumed;
+    input_pos -= consumed;
+
+    // Move the live part to the front once the dead part dominates
+    if (input_start > 0 && input_start * 2 >= mono.size()) {
+        input.erase(input.begin(), input.begin() + input_start * channels);
+        mono.erase(mono.begin(), mono.begin() + input_start);
+        input_start = 0;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef TREE_COLUMNS_H
+#define TREE_COLUMNS_H
+
+#include <gtk/gtk.h>
+
+// Append a column showing `renderer` to `tree_view`, `width` pixels wide.
+// The dialog lists run in fixed-height mode, which measures one row instead
+// of every row but needs all columns fixed; the caller binds the renderer to
+// the model through the returned column.
+inline GtkTreeViewColumn *append_fixed_column(GtkWidget *tree_view, const char *title, int width,
+                                              GtkCellRenderer *renderer) {
+    GtkTreeViewColumn *col = gtk_tree_view_column_new();
+    gtk_tree_view_column_set_title(col, title);
+    gtk_tree_view_column_pack_start(col, renderer, TRUE);
+    gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(col, width);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
+    return col;
+}
+
+#endif // TREE_COLUMNS_H